@@ -0,0 +1,216 @@
+/* File-backed emulator of the RP2040 on-board flash block device
+ *
+ * The image file holds the littlefs region only. Every operation is counted
+ * and charged with the typical timing of the W25Q16JV on the Raspberry Pi Pico
+ * driven by the SSI at the clock set up by `ssi_enable()`.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include "blockdevice/flash.h"
+#include "emulator.h"
+
+#define FLASH_SCK_NS            128ULL       // 125 MHz system clock / SSI baudr 16
+#define FLASH_COMMAND_BYTES     4ULL         // Instruction and 24-bit address
+#define FLASH_PAGE_PROGRAM_NS   400000ULL    // tPP typ. 0.4 ms
+#define FLASH_SECTOR_ERASE_NS   45000000ULL  // tSE typ. 45 ms
+
+typedef struct {
+    uint32_t start;
+    size_t length;
+    FILE *image;
+    uint8_t *buffer;
+} blockdevice_flash_config_t;
+
+static const char *image_path = NULL;
+static FILE *trace_file = NULL;
+static emulator_stats_t stats;
+
+void flash_emulator_set_image(const char *path) {
+    image_path = path;
+}
+
+void flash_emulator_set_trace(FILE *trace) {
+    trace_file = trace;
+}
+
+emulator_stats_t flash_emulator_stats(void) {
+    return stats;
+}
+
+void flash_emulator_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+static uint64_t transfer_ns(bd_size_t length) {
+    return (FLASH_COMMAND_BYTES + length) * 8 * FLASH_SCK_NS;
+}
+
+static void record(char op, bd_size_t addr, bd_size_t length, uint64_t ns) {
+    stats.busy_ns += ns;
+    if (trace_file != NULL) {
+        fprintf(trace_file, "%llu,%c,%llu,%llu\n", (unsigned long long)stats.busy_ns, op,
+                (unsigned long long)addr, (unsigned long long)length);
+    }
+}
+
+static int flash_init(blockdevice_t *device) {
+    blockdevice_flash_config_t *config = device->config;
+    if (device->is_initialized)
+        return BD_ERROR_OK;
+    config->image = image_path ? fopen(image_path, "r+b") : NULL;
+    if (config->image == NULL && image_path != NULL)
+        config->image = fopen(image_path, "w+b");
+    else if (config->image == NULL)
+        config->image = tmpfile();
+    if (config->image == NULL)
+        return BD_ERROR_DEVICE_ERROR;
+
+    fseek(config->image, 0, SEEK_END);
+    long current = ftell(config->image);
+    if (current < (long)config->length) {
+        // A blank flash reads as erased
+        uint8_t erased[FLASH_SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        for (long pos = current; pos < (long)config->length; pos += sizeof(erased)) {
+            size_t n = config->length - pos < sizeof(erased) ? config->length - pos : sizeof(erased);
+            fwrite(erased, 1, n, config->image);
+        }
+        fflush(config->image);
+    }
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int flash_deinit(blockdevice_t *device) {
+    blockdevice_flash_config_t *config = device->config;
+    if (config->image != NULL)
+        fclose(config->image);
+    config->image = NULL;
+    device->is_initialized = false;
+    return BD_ERROR_OK;
+}
+
+static int flash_sync(blockdevice_t *device) {
+    blockdevice_flash_config_t *config = device->config;
+    fflush(config->image);
+    return BD_ERROR_OK;
+}
+
+static int flash_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_flash_config_t *config = device->config;
+    if (addr + length > config->length)
+        return BD_ERROR_DEVICE_ERROR;
+    if (pread(fileno(config->image), (void *)buffer, length, addr) != (ssize_t)length)
+        return BD_ERROR_DEVICE_ERROR;
+
+    stats.read_count++;
+    stats.read_bytes += length;
+    record('r', addr, length, transfer_ns(length));
+    return BD_ERROR_OK;
+}
+
+static int flash_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_flash_config_t *config = device->config;
+    if (addr % FLASH_SECTOR_SIZE || length % FLASH_SECTOR_SIZE || addr + length > config->length)
+        return BD_ERROR_DEVICE_ERROR;
+
+    fflush(config->image);
+    memset(config->buffer, 0xFF, FLASH_SECTOR_SIZE);
+    for (bd_size_t offset = 0; offset < length; offset += FLASH_SECTOR_SIZE) {
+        if (pwrite(fileno(config->image), config->buffer, FLASH_SECTOR_SIZE, addr + offset) != FLASH_SECTOR_SIZE)
+            return BD_ERROR_DEVICE_ERROR;
+        stats.erase_count++;
+        stats.erase_bytes += FLASH_SECTOR_SIZE;
+        record('e', addr + offset, FLASH_SECTOR_SIZE, transfer_ns(0) + FLASH_SECTOR_ERASE_NS);
+    }
+    return BD_ERROR_OK;
+}
+
+static int flash_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_flash_config_t *config = device->config;
+    if (addr % FLASH_PAGE_SIZE || length % FLASH_PAGE_SIZE || addr + length > config->length)
+        return BD_ERROR_DEVICE_ERROR;
+
+    const uint8_t *data = buffer;
+    int fd = fileno(config->image);
+    stats.program_calls++;
+    for (bd_size_t offset = 0; offset < length; offset += FLASH_PAGE_SIZE) {
+        // NOR flash can only clear bits, programming never sets a bit back to 1
+        uint8_t *page = config->buffer;
+        if (pread(fd, page, FLASH_PAGE_SIZE, addr + offset) != FLASH_PAGE_SIZE)
+            return BD_ERROR_DEVICE_ERROR;
+        for (size_t i = 0; i < FLASH_PAGE_SIZE; i++)
+            page[i] &= data[offset + i];
+        if (pwrite(fd, page, FLASH_PAGE_SIZE, addr + offset) != FLASH_PAGE_SIZE)
+            return BD_ERROR_DEVICE_ERROR;
+        stats.program_count++;
+        stats.program_bytes += FLASH_PAGE_SIZE;
+        record('p', addr + offset, FLASH_PAGE_SIZE, transfer_ns(FLASH_PAGE_SIZE) + FLASH_PAGE_PROGRAM_NS);
+    }
+    return BD_ERROR_OK;
+}
+
+static int flash_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    (void)device;
+    (void)addr;
+    (void)length;
+    return BD_ERROR_OK;
+}
+
+static bd_size_t flash_size(blockdevice_t *device) {
+    blockdevice_flash_config_t *config = device->config;
+    return config->length;
+}
+
+blockdevice_t *blockdevice_flash_create(uint32_t start, size_t length) {
+    blockdevice_t *device = calloc(1, sizeof(blockdevice_t));
+    if (device == NULL)
+        return NULL;
+    blockdevice_flash_config_t *config = calloc(1, sizeof(blockdevice_flash_config_t));
+    uint8_t *buffer = malloc(FLASH_SECTOR_SIZE);
+    if (config == NULL || buffer == NULL) {
+        free(buffer);
+        free(config);
+        free(device);
+        return NULL;
+    }
+    config->start = start;
+    config->length = length > 0 ? length : PICO_FLASH_SIZE_BYTES - start;
+    config->buffer = buffer;
+
+    device->init = flash_init;
+    device->deinit = flash_deinit;
+    device->read = flash_read;
+    device->erase = flash_erase;
+    device->program = flash_program;
+    device->trim = flash_trim;
+    device->sync = flash_sync;
+    device->size = flash_size;
+    device->read_size = 1;
+    device->erase_size = FLASH_SECTOR_SIZE;
+    device->program_size = FLASH_PAGE_SIZE;
+    device->name = "flash";
+    device->config = config;
+    device->is_initialized = false;
+
+    if (flash_init(device) != BD_ERROR_OK) {
+        blockdevice_flash_free(device);
+        return NULL;
+    }
+    return device;
+}
+
+void blockdevice_flash_free(blockdevice_t *device) {
+    if (device == NULL)
+        return;
+    flash_deinit(device);
+    blockdevice_flash_config_t *config = device->config;
+    free(config->buffer);
+    free(config);
+    free(device);
+}
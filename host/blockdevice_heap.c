@@ -0,0 +1,139 @@
+/* Host stand-in for the pico-vfs heap memory block device
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "blockdevice/heap.h"
+#include "emulator.h"
+
+#define HEAP_BLOCK_SIZE    512
+
+typedef struct {
+    size_t size;
+    uint8_t *heap;
+} blockdevice_heap_config_t;
+
+static emulator_stats_t stats;
+static uint8_t *dirty_sectors = NULL;
+static size_t dirty_size = 0;
+
+emulator_stats_t heap_emulator_stats(void) {
+    return stats;
+}
+
+void heap_emulator_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+uint8_t *heap_emulator_dirty_sectors(void) {
+    return dirty_sectors;
+}
+
+void heap_emulator_clear_dirty_sectors(void) {
+    if (dirty_sectors != NULL)
+        memset(dirty_sectors, 0, dirty_size);
+}
+
+static int heap_init(blockdevice_t *device) {
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int heap_deinit(blockdevice_t *device) {
+    device->is_initialized = false;
+    return BD_ERROR_OK;
+}
+
+static int heap_sync(blockdevice_t *device) {
+    (void)device;
+    return BD_ERROR_OK;
+}
+
+static int heap_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_heap_config_t *config = device->config;
+    if (addr + length > config->size)
+        return BD_ERROR_DEVICE_ERROR;
+    memcpy((uint8_t *)buffer, config->heap + addr, length);
+    stats.read_count++;
+    stats.read_bytes += length;
+    return BD_ERROR_OK;
+}
+
+static int heap_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_heap_config_t *config = device->config;
+    if (addr + length > config->size)
+        return BD_ERROR_DEVICE_ERROR;
+    stats.erase_count++;
+    stats.erase_bytes += length;
+    return BD_ERROR_OK;
+}
+
+static int heap_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_heap_config_t *config = device->config;
+    if (addr + length > config->size)
+        return BD_ERROR_DEVICE_ERROR;
+    memcpy(config->heap + addr, buffer, length);
+    for (bd_size_t lba = addr / HEAP_BLOCK_SIZE; lba * HEAP_BLOCK_SIZE < addr + length; lba++)
+        dirty_sectors[lba / 8] |= (uint8_t)(1 << (lba % 8));
+    stats.program_count++;
+    stats.program_bytes += length;
+    return BD_ERROR_OK;
+}
+
+static int heap_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    (void)device;
+    (void)addr;
+    (void)length;
+    return BD_ERROR_OK;
+}
+
+static bd_size_t heap_size(blockdevice_t *device) {
+    blockdevice_heap_config_t *config = device->config;
+    return config->size;
+}
+
+blockdevice_t *blockdevice_heap_create(size_t length) {
+    blockdevice_t *device = calloc(1, sizeof(blockdevice_t));
+    blockdevice_heap_config_t *config = calloc(1, sizeof(blockdevice_heap_config_t));
+    uint8_t *heap = calloc(1, length);
+    size_t bitmap_size = (length / HEAP_BLOCK_SIZE + 7) / 8;
+    uint8_t *dirty = calloc(1, bitmap_size);
+    if (device == NULL || config == NULL || heap == NULL || dirty == NULL) {
+        free(dirty);
+        free(heap);
+        free(config);
+        free(device);
+        return NULL;
+    }
+    config->size = length;
+    config->heap = heap;
+    free(dirty_sectors);
+    dirty_sectors = dirty;  // Tracks the most recently created device, as USB MSC does
+    dirty_size = bitmap_size;
+
+    device->init = heap_init;
+    device->deinit = heap_deinit;
+    device->read = heap_read;
+    device->erase = heap_erase;
+    device->program = heap_program;
+    device->trim = heap_trim;
+    device->sync = heap_sync;
+    device->size = heap_size;
+    device->read_size = HEAP_BLOCK_SIZE;
+    device->erase_size = HEAP_BLOCK_SIZE;
+    device->program_size = HEAP_BLOCK_SIZE;
+    device->name = "heap";
+    device->config = config;
+    device->is_initialized = true;
+    return device;
+}
+
+void blockdevice_heap_free(blockdevice_t *device) {
+    if (device == NULL)
+        return;
+    blockdevice_heap_config_t *config = device->config;
+    free(config->heap);
+    free(config);
+    free(device);
+}
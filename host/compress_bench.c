@@ -0,0 +1,140 @@
+/* Benchmark of the compressed RAM disk on the host build
+ *
+ * Fills a compressed block device sector by sector with content typical of
+ * littlefs (JSON configuration, CSV logs, Python sources) and reports the
+ * compression ratio and the cost of programming and reading back a sector.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "blockdevice/compressed.h"
+
+#define SECTOR_SIZE     512
+#define LOGICAL_SIZE    (1024 * 1024)
+#define ARENA_SIZE      (64 * 1024)
+
+typedef struct {
+    const char *name;
+    void (*generate)(uint8_t *buffer, size_t size);
+} corpus_t;
+
+static uint32_t random_state = 1;
+
+static uint32_t random_next(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void append(uint8_t *buffer, size_t size, size_t *offset, const char *text) {
+    size_t length = strlen(text);
+    if (*offset + length > size)
+        length = size - *offset;
+    memcpy(buffer + *offset, text, length);
+    *offset += length;
+}
+
+static void generate_json(uint8_t *buffer, size_t size) {
+    static const char *keys[] = {"ssid", "interval", "threshold", "enabled", "name", "pin", "mode"};
+    char line[96];
+    size_t offset = 0;
+    append(buffer, size, &offset, "{\n");
+    while (offset < size) {
+        snprintf(line, sizeof(line), "  \"%s_%lu\": %lu,\n", keys[random_next() % 7],
+                 (unsigned long)(random_next() % 16), (unsigned long)(random_next() % 1000));
+        append(buffer, size, &offset, line);
+    }
+}
+
+static void generate_csv(uint8_t *buffer, size_t size) {
+    char line[96];
+    size_t offset = 0;
+    uint32_t time = 1700000000;
+    while (offset < size) {
+        time += 60;
+        snprintf(line, sizeof(line), "%lu,%u.%02u,%u.%u,%u\n", (unsigned long)time,
+                 20 + (unsigned)(random_next() % 5), (unsigned)(random_next() % 100),
+                 40 + (unsigned)(random_next() % 20), (unsigned)(random_next() % 10),
+                 (unsigned)(random_next() % 4096));
+        append(buffer, size, &offset, line);
+    }
+}
+
+static void generate_python(uint8_t *buffer, size_t size) {
+    static const char *lines[] = {
+        "import machine\n", "from time import sleep\n", "\n",
+        "def read_sensor(pin):\n", "    adc = machine.ADC(pin)\n",
+        "    return adc.read_u16() * 3.3 / 65535\n",
+        "while True:\n", "    value = read_sensor(26)\n",
+        "    print(\"temperature:\", value)\n", "    sleep(1)\n",
+    };
+    size_t offset = 0;
+    while (offset < size)
+        append(buffer, size, &offset, lines[random_next() % 10]);
+}
+
+static void generate_random(uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        buffer[i] = (uint8_t)random_next();
+}
+
+static const corpus_t corpora[] = {
+    {"json", generate_json},
+    {"csv", generate_csv},
+    {"python", generate_python},
+    {"random", generate_random},
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run_corpus(const corpus_t *corpus) {
+    static uint8_t data[LOGICAL_SIZE];
+    static uint8_t readback[SECTOR_SIZE];
+    blockdevice_t *device = blockdevice_compressed_create(LOGICAL_SIZE, ARENA_SIZE);
+    if (device == NULL) {
+        fprintf(stderr, "blockdevice_compressed_create failure\n");
+        exit(EXIT_FAILURE);
+    }
+    corpus->generate(data, sizeof(data));
+
+    size_t sectors = 0;
+    double start = now_ns();
+    for (; sectors < LOGICAL_SIZE / SECTOR_SIZE; sectors++) {
+        int err = device->program(device, data + sectors * SECTOR_SIZE, sectors * SECTOR_SIZE, SECTOR_SIZE);
+        if (err == BD_ERROR_COMPRESSED_FULL)
+            break;
+    }
+    double program_ns = (now_ns() - start) / (sectors ? sectors : 1);
+    size_t used = blockdevice_compressed_used(device);
+
+    start = now_ns();
+    for (size_t i = 0; i < sectors; i++) {
+        if (device->read(device, readback, i * SECTOR_SIZE, SECTOR_SIZE) != BD_ERROR_OK ||
+            memcmp(readback, data + i * SECTOR_SIZE, SECTOR_SIZE) != 0) {
+            fprintf(stderr, "%s: sector %zu does not read back\n", corpus->name, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    double read_ns = (now_ns() - start) / (sectors ? sectors : 1);
+
+    printf("%-8s %10zu %10zu %7.2f %12.0f %12.0f\n", corpus->name, sectors * SECTOR_SIZE, used,
+           used ? (double)(sectors * SECTOR_SIZE) / used : 0.0, program_ns, read_ns);
+    blockdevice_compressed_free(device);
+}
+
+int main(void) {
+    printf("# arena %u bytes, logical disk %u bytes\n", (unsigned)ARENA_SIZE, (unsigned)LOGICAL_SIZE);
+    printf("%-8s %10s %10s %7s %12s %12s\n", "corpus", "stored_B", "arena_B", "ratio", "program_ns", "read_ns");
+    for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+        run_corpus(&corpora[i]);
+    return EXIT_SUCCESS;
+}
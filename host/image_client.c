@@ -0,0 +1,333 @@
+/* Client of the raw littlefs image transfer on the CDC port
+ *
+ *   image_client [-p /dev/ttyACM0] export backup.img
+ *   image_client [-p /dev/ttyACM0] import backup.img
+ *
+ * With `-e flash.img` the device side runs in a child process on the
+ * file-backed flash emulator instead, connected through a socket pair, so
+ * the whole path can be tested and timed without a Pico.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include "blockdevice/flash.h"
+#include "emulator.h"
+#include "image_transfer.h"
+
+#define NAK_TIMEOUT_MS  1000  // Silence after which a lost frame is asked for again
+#define MAX_RETRIES     10
+
+static size_t fd_read(void *context, void *buffer, size_t size, uint32_t timeout_ms) {
+    int fd = *(int *)context;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, (int)timeout_ms) <= 0)
+        return 0;
+    ssize_t n = read(fd, buffer, size);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static bool fd_write(void *context, const void *buffer, size_t size) {
+    int fd = *(int *)context;
+    const uint8_t *p = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool show_progress = false;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static bool receive_info(const image_stream_t *stream, uint32_t *size, uint32_t *sector_size) {
+    uint8_t payload[256];
+    image_frame_t frame;
+    for (int i = 0; i < MAX_RETRIES; i++) {
+        image_receive_t received = image_receive_frame(stream, &frame, payload, sizeof(payload), IMAGE_TIMEOUT_MS);
+        if (received == IMAGE_RECEIVE_TIMEOUT)
+            break;
+        if (received != IMAGE_RECEIVE_OK)
+            continue;
+        if (frame.type == IMAGE_FRAME_ERROR) {
+            fprintf(stderr, "device: %.*s\n", (int)frame.length, payload);
+            return false;
+        }
+        if (frame.type == IMAGE_FRAME_INFO && frame.length >= 8) {
+            *size = image_get_le32(payload);
+            *sector_size = image_get_le32(payload + 4);
+            return *sector_size > 0 && *size % *sector_size == 0;
+        }
+    }
+    fprintf(stderr, "no answer from the device\n");
+    return false;
+}
+
+static bool export_image(const image_stream_t *stream, FILE *fp, image_stats_t *stats) {
+    uint32_t size, sector_size;
+    if (!receive_info(stream, &size, &sector_size))
+        return false;
+    uint8_t *payload = malloc(sector_size);
+    if (payload == NULL)
+        return false;
+
+    uint32_t expected = 0;
+    int silences = 0;
+    bool result = false;
+    while (1) {
+        image_frame_t frame;
+        image_receive_t received = image_receive_frame(stream, &frame, payload, sector_size, NAK_TIMEOUT_MS);
+        if (received == IMAGE_RECEIVE_TIMEOUT) {
+            if (++silences > MAX_RETRIES)
+                break;
+            stats->retries++;
+            image_send_frame(stream, IMAGE_FRAME_NAK, expected, NULL, 0);
+            continue;
+        }
+        silences = 0;
+        if (received == IMAGE_RECEIVE_CORRUPT) {
+            stats->retries++;
+            continue;  // The next frame reveals the gap
+        }
+        if (frame.type == IMAGE_FRAME_END) {
+            result = expected == size;
+            break;
+        }
+        if (frame.type == IMAGE_FRAME_ERROR) {
+            fprintf(stderr, "device: %.*s\n", (int)frame.length, payload);
+            break;
+        }
+        if (frame.type != IMAGE_FRAME_DATA || frame.offset < expected)
+            continue;  // Resent after a NAK, already stored
+        if (frame.offset > expected) {
+            image_send_frame(stream, IMAGE_FRAME_NAK, expected, NULL, 0);
+            continue;
+        }
+        if (fwrite(payload, 1, frame.length, fp) != frame.length) {
+            perror("fwrite");
+            break;
+        }
+        expected += frame.length;
+        stats->bytes = expected;
+        if (show_progress)
+            fprintf(stderr, "\r%lu / %lu KB", (unsigned long)expected / 1024, (unsigned long)size / 1024);
+        image_send_frame(stream, IMAGE_FRAME_ACK, expected, NULL, 0);
+    }
+    if (show_progress)
+        fprintf(stderr, "\n");
+    free(payload);
+    return result;
+}
+
+static bool import_image(const image_stream_t *stream, FILE *fp, image_stats_t *stats) {
+    uint32_t size, sector_size;
+    if (!receive_info(stream, &size, &sector_size))
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (file_size != (long)size) {
+        fprintf(stderr, "the image has %ld bytes, the littlefs region of the device %lu\n",
+                file_size, (unsigned long)size);
+        image_send_frame(stream, IMAGE_FRAME_ERROR, 0, "size mismatch", 13);
+        return false;
+    }
+    uint8_t *data = malloc(sector_size);
+    uint8_t payload[256];
+    if (data == NULL)
+        return false;
+
+    bool result = true;
+    for (uint32_t offset = 0; offset < size && result; offset += sector_size) {
+        if (fread(data, 1, sector_size, fp) != sector_size) {
+            perror("fread");
+            result = false;
+            break;
+        }
+        int attempts = 0;
+        while (1) {
+            if (attempts++ > MAX_RETRIES) {
+                result = false;
+                break;
+            }
+            if (attempts > 1)
+                stats->retries++;
+            image_send_frame(stream, IMAGE_FRAME_DATA, offset, data, sector_size);
+            image_frame_t frame;
+            image_receive_t received = image_receive_frame(stream, &frame, payload, sizeof(payload), IMAGE_TIMEOUT_MS);
+            if (received != IMAGE_RECEIVE_OK)
+                continue;
+            if (frame.type == IMAGE_FRAME_ACK && frame.offset == offset)
+                break;
+            if (frame.type == IMAGE_FRAME_ERROR) {
+                fprintf(stderr, "device: %.*s\n", (int)frame.length, payload);
+                result = false;
+                break;
+            }
+        }
+        stats->bytes = offset + sector_size;
+        if (show_progress)
+            fprintf(stderr, "\r%lu / %lu KB", (unsigned long)stats->bytes / 1024, (unsigned long)size / 1024);
+    }
+    if (show_progress)
+        fprintf(stderr, "\n");
+    free(data);
+    if (!result)
+        return false;
+
+    image_send_frame(stream, IMAGE_FRAME_END, size, NULL, 0);
+    image_frame_t frame;
+    if (image_receive_frame(stream, &frame, payload, sizeof(payload), IMAGE_TIMEOUT_MS) != IMAGE_RECEIVE_OK ||
+        frame.type != IMAGE_FRAME_END || frame.length < 8) {
+        fprintf(stderr, "no confirmation from the device\n");
+        return false;
+    }
+    stats->sectors_written = image_get_le32(payload);
+    stats->sectors_skipped = image_get_le32(payload + 4);
+    return true;
+}
+
+static int open_port(const char *port, bool import) {
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd == -1) {
+        perror(port);
+        return -1;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    tcflush(fd, TCIOFLUSH);
+    const char *command = import ? "image import\n" : "image export\n";
+    if (!fd_write(&fd, command, strlen(command))) {
+        perror(port);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Run the device side on the flash emulator backed by `image` in a child process */
+static int spawn_emulator(const char *image, bool import, pid_t *child) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    *child = fork();
+    if (*child == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (*child == 0) {
+        close(fds[0]);
+        flash_emulator_set_image(image);
+        blockdevice_t *flash = blockdevice_flash_create(PICO_FLASH_SIZE_BYTES - PICO_FS_DEFAULT_SIZE, 0);
+        image_stream_t stream = {fd_read, fd_write, &fds[1]};
+        image_stats_t stats;
+        bool result = flash != NULL &&
+                      (import ? image_import(flash, &stream, NULL, &stats) : image_export(flash, &stream, &stats));
+        emulator_stats_t flash_stats = flash_emulator_stats();
+        fprintf(stderr, "emulator: %llu reads, %llu programs, %llu erases, %.2f ms flash busy\n",
+                (unsigned long long)flash_stats.read_count, (unsigned long long)flash_stats.program_count,
+                (unsigned long long)flash_stats.erase_count, flash_stats.busy_ns / 1e6);
+        if (flash != NULL)
+            blockdevice_flash_free(flash);
+        _exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-p port | -e flash.img] export|import file\n"
+            "  -p  CDC serial port of the Pico (default: /dev/ttyACM0)\n"
+            "  -e  serve the transfer from the flash emulator backed by flash.img\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    const char *port = "/dev/ttyACM0";
+    const char *emulator_image = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:e:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = optarg;
+            break;
+        case 'e':
+            emulator_image = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 != argc || (strcmp(argv[optind], "export") != 0 && strcmp(argv[optind], "import") != 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    bool import = strcmp(argv[optind], "import") == 0;
+    const char *path = argv[optind + 1];
+
+    FILE *fp = fopen(path, import ? "rb" : "wb");
+    if (fp == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    pid_t child = -1;
+    int fd = emulator_image != NULL ? spawn_emulator(emulator_image, import, &child) : open_port(port, import);
+    if (fd == -1) {
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    image_stream_t stream = {fd_read, fd_write, &fd};
+    image_stats_t stats = {0};
+    show_progress = isatty(STDERR_FILENO);
+    double start = now_ms();
+    bool result = import ? import_image(&stream, fp, &stats) : export_image(&stream, fp, &stats);
+    double elapsed = now_ms() - start;
+    close(fd);
+    if (fclose(fp) != 0)
+        result = false;
+    if (child != -1) {
+        int status;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            result = false;
+    }
+
+    printf("%s %lu bytes in %.1f ms (%.1f KB/s), %lu retries",
+           import ? "import" : "export", (unsigned long)stats.bytes, elapsed,
+           elapsed > 0 ? stats.bytes / 1.024 / elapsed : 0.0, (unsigned long)stats.retries);
+    if (import)
+        printf(", %lu sectors written, %lu unchanged", (unsigned long)stats.sectors_written,
+               (unsigned long)stats.sectors_skipped);
+    printf("%s\n", result ? "" : ", FAILED");
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
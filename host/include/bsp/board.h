@@ -0,0 +1,5 @@
+/* Host stand-in for the TinyUSB <bsp/board.h>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
@@ -0,0 +1,36 @@
+/* Instrumented host stand-ins for the pico-vfs block devices
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    uint64_t read_count;
+    uint64_t read_bytes;
+    uint64_t program_count;  // Pages
+    uint64_t program_calls;  // Calls, each programming a run of pages
+    uint64_t program_bytes;
+    uint64_t erase_count;
+    uint64_t erase_bytes;
+    uint64_t busy_ns;  // Simulated time the device spent on the operations
+} emulator_stats_t;
+
+/* Back the next `blockdevice_flash_create()` with the image file at `path`.
+ * A temporary file is used when `path` is NULL. */
+void flash_emulator_set_image(const char *path);
+
+/* Log every flash operation as `time_ns,op,addr,length` CSV lines to `trace` */
+void flash_emulator_set_trace(FILE *trace);
+
+emulator_stats_t flash_emulator_stats(void);
+void flash_emulator_reset_stats(void);
+emulator_stats_t heap_emulator_stats(void);
+void heap_emulator_reset_stats(void);
+
+/* Bitmap of the heap sectors programmed since the last clear, in the same
+ * layout as the one `tud_msc_write10_cb` keeps for the RAM disk */
+uint8_t *heap_emulator_dirty_sectors(void);
+void heap_emulator_clear_dirty_sectors(void);
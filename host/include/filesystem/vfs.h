@@ -0,0 +1,62 @@
+/* Host stand-in for the pico-vfs <filesystem/vfs.h>
+ *
+ * On the Pico, pico-vfs hooks the newlib system calls so that the POSIX and
+ * stdio functions reach the mounted file systems. glibc offers no such hook,
+ * so the host build redirects the calls used by the firmware sources to the
+ * small mount table in `host/vfs.c`. The file descriptors of mounted files are
+ * numbered above the host ones, so that `read()` and `write()` can tell them
+ * apart. Paths outside every mount point are
+ * passed through to the host file system.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "filesystem/filesystem.h"
+
+bool fs_init(void);
+int fs_format(filesystem_t *fs, blockdevice_t *device);
+int fs_mount(const char *path, filesystem_t *fs, blockdevice_t *device);
+int fs_unmount(const char *path);
+int fs_info(const char *path, filesystem_t **fs, blockdevice_t **device);
+
+FILE *vfs_host_fopen(const char *path, const char *mode);
+DIR *vfs_host_opendir(const char *path);
+struct dirent *vfs_host_readdir(DIR *dir);
+int vfs_host_closedir(DIR *dir);
+int vfs_host_mkdir(const char *path, mode_t mode);
+int vfs_host_rmdir(const char *path);
+int vfs_host_unlink(const char *path);
+int vfs_host_rename(const char *oldpath, const char *newpath);
+int vfs_host_stat(const char *path, struct stat *st);
+int vfs_host_open(const char *path, int flags, ...);
+int vfs_host_close(int fd);
+ssize_t vfs_host_read(int fd, void *buffer, size_t size);
+ssize_t vfs_host_write(int fd, const void *buffer, size_t size);
+off_t vfs_host_lseek(int fd, off_t offset, int whence);
+int vfs_host_ftruncate(int fd, off_t length);
+
+#ifndef VFS_HOST_IMPLEMENTATION
+#define fopen(path, mode)           vfs_host_fopen(path, mode)
+#define opendir(path)               vfs_host_opendir(path)
+#define readdir(dir)                vfs_host_readdir(dir)
+#define closedir(dir)               vfs_host_closedir(dir)
+#define mkdir(path, mode)           vfs_host_mkdir(path, mode)
+#define rmdir(path)                 vfs_host_rmdir(path)
+#define unlink(path)                vfs_host_unlink(path)
+#define rename(oldpath, newpath)    vfs_host_rename(oldpath, newpath)
+#define stat(path, st)              vfs_host_stat(path, st)
+#define open(path, ...)             vfs_host_open(path, __VA_ARGS__)
+#define close(fd)                   vfs_host_close(fd)
+#define read(fd, buffer, size)      vfs_host_read(fd, buffer, size)
+#define write(fd, buffer, size)     vfs_host_write(fd, buffer, size)
+#define lseek(fd, offset, whence)   vfs_host_lseek(fd, offset, whence)
+#define ftruncate(fd, length)       vfs_host_ftruncate(fd, length)
+#endif
@@ -0,0 +1,13 @@
+/* Host stand-in for the pico-sdk <hardware/flash.h>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#define FLASH_PAGE_SIZE         (1u << 8)
+#define FLASH_SECTOR_SIZE       (1u << 12)
+#define FLASH_BLOCK_SIZE        (1u << 16)
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES   (2 * 1024 * 1024)
+#endif
@@ -0,0 +1,13 @@
+/* Host stand-in for the pico-sdk <pico/critical_section.h>
+ *
+ * The host build is single threaded, so the critical sections are no-ops.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+typedef struct { int owner; } critical_section_t;
+
+#define critical_section_init(c)            ((void)(c))
+#define critical_section_enter_blocking(c)  ((void)(c))
+#define critical_section_exit(c)            ((void)(c))
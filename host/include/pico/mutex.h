@@ -0,0 +1,17 @@
+/* Host stand-in for the pico-sdk <pico/mutex.h>
+ *
+ * The host build is single threaded, so the locks used by pico-vfs are no-ops.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+typedef struct { int owner; } mutex_t;
+typedef struct { int owner; int count; } recursive_mutex_t;
+
+#define mutex_init(m)                   ((void)(m))
+#define mutex_enter_blocking(m)         ((void)(m))
+#define mutex_exit(m)                   ((void)(m))
+#define recursive_mutex_init(m)         ((void)(m))
+#define recursive_mutex_enter_blocking(m)   ((void)(m))
+#define recursive_mutex_exit(m)         ((void)(m))
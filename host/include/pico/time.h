@@ -0,0 +1,11 @@
+/* Host stand-in for the pico-sdk <pico/time.h>
+ *
+ * `time_us_64()` is left to the program, so that `scsi_replay` can run the
+ * flush scheduler of usb_msc.c on the clock of the trace.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include <stdint.h>
+
+uint64_t time_us_64(void);
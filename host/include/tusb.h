@@ -0,0 +1,38 @@
+/* Host stand-in for the parts of <tusb.h> used by usb_msc.c
+ *
+ * `tud_msc_set_sense()` is left to the program, which drives the MSC
+ * callbacks directly instead of through a USB device stack.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+    SCSI_CMD_TEST_UNIT_READY              = 0x00,
+    SCSI_CMD_START_STOP_UNIT              = 0x1B,
+    SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+    SCSI_CMD_READ_10                      = 0x28,
+    SCSI_CMD_WRITE_10                     = 0x2A,
+};
+
+enum {
+    SCSI_SENSE_NONE            = 0x00,
+    SCSI_SENSE_NOT_READY       = 0x02,
+    SCSI_SENSE_MEDIUM_ERROR    = 0x03,
+    SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+    SCSI_SENSE_UNIT_ATTENTION  = 0x06,
+    SCSI_SENSE_DATA_PROTECT    = 0x07,
+};
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size);
+bool tud_msc_test_unit_ready_cb(uint8_t lun);
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize);
+void tud_msc_write10_complete_cb(uint8_t lun);
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize);
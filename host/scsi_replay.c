@@ -0,0 +1,392 @@
+/* Replay of a SCSI trace recorded by the firmware on the host build
+ *
+ * The trace printed by the `trace` command on the USB serial port is fed into
+ * the MSC callbacks of usb_msc.c, which run on top of the RAM disk, the flush
+ * scheduler and the sync engine as on the Pico. The clock seen by usb_msc.c
+ * follows the time stamps of the trace, so the commits happen where they
+ * happened on the device. Every READ10 is checked against the hash recorded.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include <tusb.h>
+#include "blockdevice/flash.h"
+#include "blockdevice/snapshot.h"
+#include "filesystem/littlefs.h"
+#include "filesystem/vfs.h"
+#include "emulator.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "scsi_trace.h"
+#include "sync.h"
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10  0x35
+#define SCSI_CMD_SYNCHRONIZE_CACHE_16  0x91
+#define SCSI_CMD_UNMAP                 0x42
+#define SCHEDULER_STEP_US              1000    // How often the USB loop of core 1 is emulated
+#define SETTLE_US                      60000000  // Idle time after the last record
+
+extern bool usb_msc_flush_due(bool *force);     // from usb_msc.c
+extern bool is_usb_msc_dirty(void);             // from usb_msc.c
+extern void usb_msc_init(void);                 // from usb_msc.c
+extern uint8_t *usb_msc_take_dirty_sectors(void);  // from usb_msc.c
+extern void usb_msc_clear_dirty_sectors(void);  // from usb_msc.c
+extern bool remount_ram_disk(blockdevice_t *device);  // from fs_init.c
+extern blockdevice_t *blockdevice_heap;         // from fs_init.c
+
+typedef struct {
+    uint32_t sector_count;
+    uint32_t sector_size;
+    uint32_t records;
+    uint32_t dropped;
+    uint8_t *data;
+    size_t size;
+} trace_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t reads;
+    uint32_t read_mismatches;
+    uint32_t writes;
+    uint32_t writes_without_data;
+    uint32_t commits;
+    uint32_t host_commits;
+    uint32_t failed_commits;
+} replay_stats_t;
+
+static bool verbose = false;
+static uint64_t clock_us = 0;
+static replay_stats_t stats;
+static int saved_stdout = -1;
+volatile bool image_transfer_active = false;  // Read by usb_msc.c. No image transfer is replayed
+
+uint64_t time_us_64(void) {
+    return clock_us;
+}
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier) {
+    (void)lun;
+    if (verbose)
+        printf("sense %02x/%02x/%02x\n", sense_key, add_sense_code, add_sense_qualifier);
+    return true;
+}
+
+/* Same as commit_host_writes() of main.c, run in line instead of on core 0 */
+static bool commit_host_writes(bool force) {
+    if (!is_usb_msc_dirty())
+        return true;
+    stats.commits++;
+    uint64_t start = metrics_now_us();
+    uint8_t *dirty = usb_msc_take_dirty_sectors();
+    blockdevice_snapshot_freeze(blockdevice_heap);
+    blockdevice_t *view = blockdevice_snapshot_view(blockdevice_heap);
+    bool result = remount_ram_disk(view);
+    if (result) {
+        if (dirty == NULL || !sync_touched_to_flash(view, dirty, force)) {
+            sync_ram_to_flash();
+            usb_msc_clear_dirty_sectors();
+        }
+    }
+    blockdevice_snapshot_release(blockdevice_heap);
+    metrics_record(METRIC_SYNC, start);
+    if (!result)
+        stats.failed_commits++;
+    return result;
+}
+
+bool commit_host_writes_now(void) {
+    stats.host_commits++;
+    return commit_host_writes(true);
+}
+
+/* Let `delta_us` pass, running the flush scheduler as the USB loop of core 1 does */
+static void advance_clock(uint64_t delta_us) {
+    uint64_t end = clock_us + delta_us;
+    while (1) {
+        bool force;
+        if (usb_msc_flush_due(&force))
+            commit_host_writes(force);
+        if (clock_us >= end)
+            break;
+        clock_us = end - clock_us < SCHEDULER_STEP_US ? end : clock_us + SCHEDULER_STEP_US;
+    }
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Read the first trace dump in `path`, which may hold other console output around it */
+static bool load_trace(const char *path, trace_t *trace) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[256];
+    unsigned version = 0;
+    unsigned long sector_count, sector_size, records, dropped, bytes;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "scsi-trace %u sectors %lu size %lu records %lu dropped %lu bytes %lu",
+                   &version, &sector_count, &sector_size, &records, &dropped, &bytes) == 6)
+            break;
+    }
+    if (version != SCSI_TRACE_VERSION) {
+        fprintf(stderr, "%s: no scsi-trace version %d found\n", path, SCSI_TRACE_VERSION);
+        fclose(fp);
+        return false;
+    }
+
+    trace->sector_count = (uint32_t)sector_count;
+    trace->sector_size = (uint32_t)sector_size;
+    trace->records = (uint32_t)records;
+    trace->dropped = (uint32_t)dropped;
+    trace->data = malloc(bytes ? bytes : 1);
+    trace->size = 0;
+    bool complete = false;
+    while (trace->data != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "scsi-trace end", 14) == 0) {
+            complete = true;
+            break;
+        }
+        for (char *p = line; hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0 && trace->size < bytes; p += 2)
+            trace->data[trace->size++] = (uint8_t)(hex_value(p[0]) << 4 | hex_value(p[1]));
+    }
+    fclose(fp);
+    if (!complete || trace->size != bytes) {
+        fprintf(stderr, "%s: truncated trace, %lu of %lu bytes\n", path,
+                (unsigned long)trace->size, bytes);
+        free(trace->data);
+        return false;
+    }
+    return true;
+}
+
+static void replay_record(const scsi_trace_record_t *record, const uint8_t *data, uint8_t *buffer) {
+    uint8_t cdb[16] = {0};
+    uint8_t parameters[24] = {0};
+    stats.records++;
+    switch (record->opcode) {
+    case SCSI_CMD_TEST_UNIT_READY:
+        tud_msc_test_unit_ready_cb(0);
+        break;
+    case SCSI_CMD_START_STOP_UNIT:
+        tud_msc_start_stop_cb(0, 0, record->lba & 0x01, record->lba & 0x02);
+        break;
+    case SCSI_CMD_READ_10:
+        stats.reads++;
+        tud_msc_read10_cb(0, record->lba, 0, buffer, record->length);
+        if (manifest_hash(MANIFEST_HASH_INIT, buffer, record->length) != record->hash) {
+            stats.read_mismatches++;
+            fprintf(stderr, "record %lu: READ10 of %lu bytes at sector %lu differs from the trace\n",
+                    (unsigned long)stats.records, (unsigned long)record->length, (unsigned long)record->lba);
+        }
+        break;
+    case SCSI_CMD_WRITE_10:
+        if (data == NULL) {  // Recorded without SCSI_TRACE_DATA
+            stats.writes_without_data++;
+            break;
+        }
+        stats.writes++;
+        memcpy(buffer, data, record->length);
+        tud_msc_write10_cb(0, record->lba, 0, buffer, record->length);
+        tud_msc_write10_complete_cb(0);
+        break;
+    case SCSI_CMD_UNMAP:
+        cdb[0] = SCSI_CMD_UNMAP;
+        parameters[3] = 16;  // One block descriptor
+        parameters[12] = (uint8_t)(record->lba >> 24);
+        parameters[13] = (uint8_t)(record->lba >> 16);
+        parameters[14] = (uint8_t)(record->lba >> 8);
+        parameters[15] = (uint8_t)record->lba;
+        uint32_t count = record->length / blockdevice_heap->erase_size;
+        parameters[16] = (uint8_t)(count >> 24);
+        parameters[17] = (uint8_t)(count >> 16);
+        parameters[18] = (uint8_t)(count >> 8);
+        parameters[19] = (uint8_t)count;
+        tud_msc_scsi_cb(0, cdb, parameters, sizeof(parameters));
+        break;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+        cdb[0] = record->opcode;
+        cdb[4] = (uint8_t)record->lba;
+        tud_msc_scsi_cb(0, cdb, buffer, 0);
+        break;
+    default:
+        fprintf(stderr, "record %lu: unknown operation code 0x%02x\n",
+                (unsigned long)stats.records, record->opcode);
+        break;
+    }
+}
+
+static bool replay(const trace_t *trace) {
+    uint8_t *buffer = malloc(64 * 1024);
+    if (buffer == NULL)
+        return false;
+    size_t offset = 0;
+    while (offset + SCSI_TRACE_HEADER_SIZE <= trace->size) {
+        scsi_trace_record_t record;
+        scsi_trace_decode(trace->data + offset, &record);
+        offset += SCSI_TRACE_HEADER_SIZE;
+        const uint8_t *data = NULL;
+        if (record.flags & SCSI_TRACE_HAS_DATA) {
+            data = trace->data + offset;
+            offset += record.length;
+        }
+        if (offset > trace->size || record.length > 64 * 1024) {
+            fprintf(stderr, "record %lu is broken\n", (unsigned long)stats.records + 1);
+            free(buffer);
+            return false;
+        }
+        advance_clock(record.delta_us);
+        replay_record(&record, data, buffer);
+    }
+    advance_clock(SETTLE_US);
+    free(buffer);
+    return true;
+}
+
+static void quiet_begin(void) {
+    if (verbose)
+        return;
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+}
+
+static void quiet_end(void) {
+    if (verbose)
+        return;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-v] [-m] [-i image] trace.txt\n"
+            "  -v  show the log lines of the MSC callbacks and the sync engine\n"
+            "  -m  print the telemetry as one JSON line at the end\n"
+            "  -i  flash image holding the littlefs the trace starts from; it is modified.\n"
+            "      Without it the replay starts from an empty littlefs\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL;
+    bool dump_metrics = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "vmi:h")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'm':
+            dump_metrics = true;
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    trace_t trace;
+    if (!load_trace(argv[optind], &trace))
+        return EXIT_FAILURE;
+    if (trace.dropped > 0)
+        fprintf(stderr, "warning: the oldest %lu records were dropped on the device, reads may differ\n",
+                (unsigned long)trace.dropped);
+
+    flash_emulator_set_image(image);
+    if (image == NULL) {
+        blockdevice_t *flash = blockdevice_flash_create(PICO_FLASH_SIZE_BYTES - PICO_FS_DEFAULT_SIZE, 0);
+        filesystem_t *lfs = filesystem_littlefs_create(500, 16);
+        if (flash == NULL || lfs == NULL || fs_format(lfs, flash) == -1) {
+            fprintf(stderr, "littlefs format failure\n");
+            return EXIT_FAILURE;
+        }
+        filesystem_littlefs_free(lfs);
+        blockdevice_flash_free(flash);
+    }
+    quiet_begin();
+    bool ok = fs_init();
+    if (ok)
+        sync_flash_to_ram();
+    quiet_end();
+    if (!ok) {
+        fprintf(stderr, "File system initialize failure\n");
+        return EXIT_FAILURE;
+    }
+    usb_msc_init();
+
+    uint32_t block_count;
+    uint16_t block_size;
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    if (block_count != trace.sector_count || block_size != trace.sector_size) {
+        fprintf(stderr, "the trace was recorded on %lu sectors of %lu bytes, the RAM disk has %lu of %u;"
+                " set -DRAM_DISK_SIZE=%lu\n",
+                (unsigned long)trace.sector_count, (unsigned long)trace.sector_size,
+                (unsigned long)block_count, block_size,
+                (unsigned long)trace.sector_count * trace.sector_size);
+        return EXIT_FAILURE;
+    }
+
+    flash_emulator_reset_stats();
+    metrics_reset();
+    quiet_begin();
+    double start = now_ms();
+    ok = replay(&trace);
+    double elapsed = now_ms() - start;
+    quiet_end();
+    free(trace.data);
+
+    emulator_stats_t flash = flash_emulator_stats();
+    printf("# trace of %lu records, %lu dropped, %lu sectors of %lu bytes\n",
+           (unsigned long)trace.records, (unsigned long)trace.dropped,
+           (unsigned long)trace.sector_count, (unsigned long)trace.sector_size);
+    printf("%8s %8s %10s %8s %9s %8s %8s %9s %10s %8s %10s %7s\n",
+           "records", "reads", "mismatch", "writes", "no_data", "commits", "by_host", "wall_ms",
+           "flash_ms", "programs", "program_B", "erases");
+    printf("%8lu %8lu %10lu %8lu %9lu %8lu %8lu %9.2f %10.2f %8llu %10llu %7llu\n",
+           (unsigned long)stats.records, (unsigned long)stats.reads, (unsigned long)stats.read_mismatches,
+           (unsigned long)stats.writes, (unsigned long)stats.writes_without_data,
+           (unsigned long)stats.commits, (unsigned long)stats.host_commits, elapsed, flash.busy_ns / 1e6,
+           (unsigned long long)flash.program_count, (unsigned long long)flash.program_bytes,
+           (unsigned long long)flash.erase_count);
+    if (dump_metrics)
+        metrics_dump(stdout);
+
+    fs_unmount("/ram");
+    fs_unmount("/flash");
+    if (!ok || stats.failed_commits > 0 || stats.read_mismatches > 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
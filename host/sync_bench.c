@@ -0,0 +1,404 @@
+/* Benchmark driver for the sync engine on the host build
+ *
+ * Each workload starts from a freshly formatted flash image, fills `/flash`,
+ * measures the boot copy to `/ram`, applies a host-side edit to `/ram` and
+ * measures the write back to `/flash`.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include "blockdevice/flash.h"
+#include "blockdevice/heap.h"
+#include "blockdevice/snapshot.h"
+#include "filesystem/littlefs.h"
+#include "filesystem/vfs.h"
+#include "emulator.h"
+#include "metrics.h"
+#include "pre_erase.h"
+#include "sync.h"
+
+extern blockdevice_t *blockdevice_heap;  // from fs_init.c
+extern bool remount_ram_disk(blockdevice_t *device);  // from fs_init.c
+extern size_t flash_write_cache_size;  // from fs_init.c
+extern blockdevice_t *blockdevice_littlefs;  // from fs_init.c
+
+typedef struct {
+    const char *name;
+    void (*populate)(void);
+    void (*edit)(void);
+} workload_t;
+
+static bool verbose = false;
+static bool touched_sync = false;
+static bool pre_erase = false;
+static uint32_t random_state = 1;
+
+static uint32_t random_next(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/* Text-like content, similar to the configuration and log files on littlefs */
+static void fill_content(uint8_t *buffer, size_t size) {
+    static const char words[] = "sensor value time temp 0123456789 ,{}:\"\n";
+    for (size_t i = 0; i < size; i++)
+        buffer[i] = (uint8_t)words[random_next() % (sizeof(words) - 1)];
+}
+
+static void write_file(const char *path, size_t size) {
+    static uint8_t buffer[64 * 1024];
+    if (size > sizeof(buffer))
+        size = sizeof(buffer);
+    fill_content(buffer, size);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(buffer, 1, size, fp) != size) {
+        fprintf(stderr, "fwrite %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+}
+
+static void make_directory(const char *path) {
+    if (mkdir(path, 0777) == -1) {
+        fprintf(stderr, "mkdir %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void populate_tiny_files(void) {
+    char path[64];
+    for (int d = 0; d < 20; d++) {
+        snprintf(path, sizeof(path), "/flash/dir%02d", d);
+        make_directory(path);
+        for (int f = 0; f < 50; f++) {
+            snprintf(path, sizeof(path), "/flash/dir%02d/file%02d.txt", d, f);
+            write_file(path, 24 + random_next() % 96);
+        }
+    }
+}
+
+static void edit_tiny_files(void) {
+    write_file("/ram/dir07/file13.txt", 80);
+}
+
+static void populate_large_files(void) {
+    write_file("/flash/large0.bin", 60 * 1024);
+    write_file("/flash/large1.bin", 62 * 1024);
+    write_file("/flash/large2.bin", 63 * 1024);
+}
+
+static void edit_large_files(void) {
+    FILE *fp = fopen("/ram/large1.bin", "r+b");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen /ram/large1.bin failed\n");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t patch[100];
+    fill_content(patch, sizeof(patch));
+    fseek(fp, 30 * 1024, SEEK_SET);
+    fwrite(patch, 1, sizeof(patch), fp);
+    fclose(fp);
+}
+
+#define DEEP_TREE_DEPTH    24
+
+static void populate_deep_tree(void) {
+    char path[512] = "/flash";
+    char file[560];
+    for (int depth = 0; depth < DEEP_TREE_DEPTH; depth++) {
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/d%d", depth);
+        make_directory(path);
+        snprintf(file, sizeof(file), "%s/a.txt", path);
+        write_file(file, 1024);
+        snprintf(file, sizeof(file), "%s/b.txt", path);
+        write_file(file, 1024);
+    }
+}
+
+static void edit_deep_tree(void) {
+    char path[512] = "/ram";
+    for (int depth = 0; depth < DEEP_TREE_DEPTH; depth++) {
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/d%d", depth);
+    }
+    strncat(path, "/new.txt", sizeof(path) - strlen(path) - 1);
+    write_file(path, 512);
+}
+
+static void populate_delete_heavy(void) {
+    char path[64];
+    for (int d = 0; d < 4; d++) {
+        snprintf(path, sizeof(path), "/flash/logs%d", d);
+        make_directory(path);
+        for (int f = 0; f < 50; f++) {
+            snprintf(path, sizeof(path), "/flash/logs%d/%03d.csv", d, f);
+            write_file(path, 1024);
+        }
+    }
+}
+
+static void edit_delete_heavy(void) {
+    char path[64];
+    for (int d = 0; d < 3; d++) {
+        for (int f = 0; f < 50; f++) {
+            snprintf(path, sizeof(path), "/ram/logs%d/%03d.csv", d, f);
+            unlink(path);
+        }
+    }
+    rmdir("/ram/logs0");
+}
+
+static void populate_move_files(void) {
+    char path[64];
+    make_directory("/flash/incoming");
+    for (int f = 0; f < 4; f++) {
+        snprintf(path, sizeof(path), "/flash/incoming/data%d.bin", f);
+        write_file(path, 40 * 1024);
+    }
+}
+
+static void edit_move_files(void) {
+    char from[64], to[64];
+    make_directory("/ram/archive");
+    for (int f = 0; f < 3; f++) {
+        snprintf(from, sizeof(from), "/ram/incoming/data%d.bin", f);
+        snprintf(to, sizeof(to), "/ram/archive/data%d.bin", f);
+        if (rename(from, to) == -1) {
+            fprintf(stderr, "rename %s failed\n", from);
+            exit(EXIT_FAILURE);
+        }
+    }
+    rename("/ram/incoming/data3.bin", "/ram/incoming/renamed.bin");
+}
+
+static void populate_append_log(void) {
+    write_file("/flash/sensor.csv", 48 * 1024);
+    write_file("/flash/events.log", 16 * 1024);
+}
+
+static void edit_append_log(void) {
+    FILE *fp = fopen("/ram/sensor.csv", "ab");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen /ram/sensor.csv failed\n");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t line[300];
+    fill_content(line, sizeof(line));
+    fwrite(line, 1, sizeof(line), fp);
+    fclose(fp);
+
+    // The host keeps the first half of the other log
+    int fd = open("/ram/events.log", O_RDWR);
+    if (fd == -1 || ftruncate(fd, 8 * 1024) != 0) {
+        fprintf(stderr, "truncate /ram/events.log failed\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static const workload_t workloads[] = {
+    {"tiny-files", populate_tiny_files, edit_tiny_files},
+    {"large-files", populate_large_files, edit_large_files},
+    {"deep-tree", populate_deep_tree, edit_deep_tree},
+    {"delete-heavy", populate_delete_heavy, edit_delete_heavy},
+    {"move-files", populate_move_files, edit_move_files},
+    {"append-log", populate_append_log, edit_append_log},
+};
+
+static int saved_stdout = -1;
+
+/* Silence the per-file log lines of the sync engine while measuring */
+static void quiet_begin(void) {
+    if (verbose)
+        return;
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+}
+
+static void quiet_end(void) {
+    if (verbose)
+        return;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void report(const char *workload, const char *phase, double wall_ms) {
+    emulator_stats_t flash = flash_emulator_stats();
+    emulator_stats_t heap = heap_emulator_stats();
+    // Bytes written to either side per second of wall time
+    double copied = (double)(flash.program_bytes + heap.program_bytes);
+    printf("%-13s %-6s %9.2f %7.1f %10.2f %8llu %10llu %8llu %10llu %10llu %7llu %10llu %10llu\n",
+           workload, phase, wall_ms, wall_ms > 0 ? copied / (wall_ms * 1e3) : 0.0, flash.busy_ns / 1e6,
+           (unsigned long long)flash.read_count, (unsigned long long)flash.read_bytes,
+           (unsigned long long)flash.program_count, (unsigned long long)flash.program_calls,
+           (unsigned long long)flash.program_bytes,
+           (unsigned long long)flash.erase_count,
+           (unsigned long long)heap.read_bytes, (unsigned long long)heap.program_bytes);
+}
+
+static void reset_stats(void) {
+    flash_emulator_reset_stats();
+    heap_emulator_reset_stats();
+}
+
+static void format_flash(void) {
+    blockdevice_t *flash = blockdevice_flash_create(PICO_FLASH_SIZE_BYTES - PICO_FS_DEFAULT_SIZE, 0);
+    filesystem_t *lfs = filesystem_littlefs_create(500, 16);
+    if (flash == NULL || lfs == NULL || fs_format(lfs, flash) == -1) {
+        fprintf(stderr, "littlefs format failure\n");
+        exit(EXIT_FAILURE);
+    }
+    filesystem_littlefs_free(lfs);
+    blockdevice_flash_free(flash);
+}
+
+static void run_workload(const workload_t *workload, const char *image) {
+    unlink(image);
+    flash_emulator_set_image(image);
+    format_flash();
+
+    quiet_begin();
+    bool ok = fs_init();
+    quiet_end();
+    if (!ok) {
+        fprintf(stderr, "File system initialize failure\n");
+        exit(EXIT_FAILURE);
+    }
+    workload->populate();
+
+    reset_stats();
+    quiet_begin();
+    double start = now_ms();
+    sync_flash_to_ram();
+    double elapsed = now_ms() - start;
+    quiet_end();
+    report(workload->name, "boot", elapsed);
+
+    if (pre_erase && flash_write_cache_size > 0) {
+        reset_stats();
+        start = now_ms();
+        if (pre_erase_scan(blockdevice_littlefs)) {
+            while (pre_erase_step())
+                ;
+        }
+        elapsed = now_ms() - start;
+        report(workload->name, "idle", elapsed);
+    }
+
+    heap_emulator_clear_dirty_sectors();
+    workload->edit();
+
+    reset_stats();
+    quiet_begin();
+    start = now_ms();
+    if (remount_ram_disk(blockdevice_heap)) {
+        if (!touched_sync || !sync_touched_to_flash(blockdevice_heap, heap_emulator_dirty_sectors(), true))
+            sync_ram_to_flash();
+    }
+    elapsed = now_ms() - start;
+    quiet_end();
+    report(workload->name, "sync", elapsed);
+
+    fs_unmount("/ram");
+    fs_unmount("/flash");
+    blockdevice_heap_free(blockdevice_snapshot_device(blockdevice_heap));
+    blockdevice_snapshot_free(blockdevice_heap);
+    blockdevice_heap = NULL;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-v] [-d] [-m] [-c bytes] [-e] [-i image] [-t trace.csv] [workload...]\n"
+            "  -v  show the log lines of the sync engine\n"
+            "  -d  write back only the files owning the sectors written by the edit\n"
+            "  -m  print the telemetry of all workloads as one JSON line at the end\n"
+            "  -c  bytes of the flash write cache, 0 to write littlefs straight to the flash\n"
+            "  -e  erase the free flash blocks between the boot copy and the edit, as the idle firmware does\n"
+            "  -i  flash image file (default: sync_bench.img)\n"
+            "  -t  write every flash operation with its simulated time stamp\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    const char *image = "sync_bench.img";
+    FILE *trace = NULL;
+    bool dump_metrics = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "vdmc:ei:t:h")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'd':
+            touched_sync = true;
+            break;
+        case 'm':
+            dump_metrics = true;
+            break;
+        case 'c':
+            flash_write_cache_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            pre_erase = true;
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 't':
+            trace = fopen(optarg, "w");
+            if (trace == NULL) {
+                perror(optarg);
+                return EXIT_FAILURE;
+            }
+            flash_emulator_set_trace(trace);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    printf("# RAM disk %u bytes, littlefs %u bytes, flash write cache %lu bytes\n", (unsigned)RAM_DISK_SIZE,
+           (unsigned)PICO_FS_DEFAULT_SIZE, (unsigned long)flash_write_cache_size);
+    printf("%-13s %-6s %9s %7s %10s %8s %10s %8s %10s %10s %7s %10s %10s\n",
+           "workload", "phase", "wall_ms", "MB_s", "flash_ms", "reads", "read_B",
+           "programs", "prog_calls", "program_B", "erases", "ram_read_B", "ram_prog_B");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        bool selected = optind == argc;
+        for (int a = optind; a < argc; a++)
+            selected |= strcmp(argv[a], workloads[i].name) == 0;
+        if (selected)
+            run_workload(&workloads[i], image);
+    }
+
+    if (dump_metrics)
+        metrics_dump(stdout);
+    if (trace != NULL)
+        fclose(trace);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+/* Minimal virtual file system for the host build
+ *
+ * Routes the POSIX and stdio calls of the firmware sources to the pico-vfs
+ * file system drivers, in the same way pico-vfs does on the Pico.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _GNU_SOURCE
+#define VFS_HOST_IMPLEMENTATION
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "filesystem/vfs.h"
+
+#define VFS_HOST_MAX_MOUNTS    4
+#define VFS_HOST_MAX_FILES     16
+#define VFS_HOST_FD_BASE       1000  // Descriptors of mounted files, above the host ones
+
+typedef struct {
+    char prefix[16];
+    filesystem_t *fs;
+    blockdevice_t *device;
+} mountpoint_t;
+
+typedef struct {
+    filesystem_t *fs;
+    fs_file_t file;
+} vfs_host_file_t;
+
+typedef struct {
+    filesystem_t *fs;
+    fs_dir_t dir;
+    DIR *host_dir;
+    struct dirent ent;
+} vfs_host_dir_t;
+
+static mountpoint_t mountpoints[VFS_HOST_MAX_MOUNTS];
+static vfs_host_file_t *descriptors[VFS_HOST_MAX_FILES];
+
+static int error_remap(int err) {
+    errno = err < 0 ? -err : err;
+    return -1;
+}
+
+/* Find the mount point of `path` and the path relative to it */
+static mountpoint_t *find_mountpoint(const char *path, const char **entrypoint) {
+    for (size_t i = 0; i < VFS_HOST_MAX_MOUNTS; i++) {
+        mountpoint_t *m = &mountpoints[i];
+        if (m->fs == NULL)
+            continue;
+        size_t length = strlen(m->prefix);
+        if (strncmp(path, m->prefix, length) != 0)
+            continue;
+        if (path[length] == '\0') {
+            *entrypoint = "/";
+            return m;
+        }
+        if (path[length] == '/') {
+            *entrypoint = path + length;
+            return m;
+        }
+    }
+    return NULL;
+}
+
+int fs_format(filesystem_t *fs, blockdevice_t *device) {
+    int err = fs->format(fs, device);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int fs_mount(const char *path, filesystem_t *fs, blockdevice_t *device) {
+    const char *entrypoint;
+    if (find_mountpoint(path, &entrypoint) != NULL)
+        return error_remap(-EBUSY);
+    for (size_t i = 0; i < VFS_HOST_MAX_MOUNTS; i++) {
+        mountpoint_t *m = &mountpoints[i];
+        if (m->fs != NULL)
+            continue;
+        int err = fs->mount(fs, device, false);
+        if (err != 0)
+            return error_remap(err);
+        strncpy(m->prefix, path, sizeof(m->prefix) - 1);
+        m->fs = fs;
+        m->device = device;
+        return 0;
+    }
+    return error_remap(-ENFILE);
+}
+
+int fs_unmount(const char *path) {
+    for (size_t i = 0; i < VFS_HOST_MAX_MOUNTS; i++) {
+        mountpoint_t *m = &mountpoints[i];
+        if (m->fs == NULL || strcmp(m->prefix, path) != 0)
+            continue;
+        int err = m->fs->unmount(m->fs);
+        if (err != 0)
+            return error_remap(err);
+        memset(m, 0, sizeof(*m));
+        return 0;
+    }
+    return error_remap(-ENOENT);
+}
+
+int fs_info(const char *path, filesystem_t **fs, blockdevice_t **device) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return error_remap(-ENOENT);
+    *fs = m->fs;
+    *device = m->device;
+    return 0;
+}
+
+static ssize_t cookie_read(void *cookie, char *buffer, size_t size) {
+    vfs_host_file_t *f = cookie;
+    ssize_t n = f->fs->file_read(f->fs, &f->file, buffer, size);
+    if (n < 0)
+        return error_remap((int)n);
+    return n;
+}
+
+static ssize_t cookie_write(void *cookie, const char *buffer, size_t size) {
+    vfs_host_file_t *f = cookie;
+    ssize_t n = f->fs->file_write(f->fs, &f->file, buffer, size);
+    if (n < 0)
+        return error_remap((int)n);
+    return n;
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+    vfs_host_file_t *f = cookie;
+    off_t pos = f->fs->file_seek(f->fs, &f->file, (off_t)*offset, whence);
+    if (pos < 0)
+        return error_remap((int)pos);
+    *offset = pos;
+    return 0;
+}
+
+static int cookie_close(void *cookie) {
+    vfs_host_file_t *f = cookie;
+    int err = f->fs->file_close(f->fs, &f->file);
+    free(f);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+static int mode_to_flags(const char *mode) {
+    int flags;
+    switch (mode[0]) {
+    case 'r':
+        flags = O_RDONLY;
+        break;
+    case 'w':
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    default:
+        return -1;
+    }
+    if (strchr(mode, '+') != NULL)
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    return flags;
+}
+
+FILE *vfs_host_fopen(const char *path, const char *mode) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return fopen(path, mode);
+
+    int flags = mode_to_flags(mode);
+    if (flags == -1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    vfs_host_file_t *f = calloc(1, sizeof(vfs_host_file_t));
+    if (f == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->fs = m->fs;
+    int err = f->fs->file_open(f->fs, &f->file, entrypoint, flags);
+    if (err != 0) {
+        free(f);
+        error_remap(err);
+        return NULL;
+    }
+    cookie_io_functions_t io = {
+        .read = cookie_read,
+        .write = cookie_write,
+        .seek = cookie_seek,
+        .close = cookie_close,
+    };
+    FILE *fp = fopencookie(f, mode, io);
+    if (fp == NULL) {
+        f->fs->file_close(f->fs, &f->file);
+        free(f);
+    }
+    return fp;
+}
+
+DIR *vfs_host_opendir(const char *path) {
+    vfs_host_dir_t *d = calloc(1, sizeof(vfs_host_dir_t));
+    if (d == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL) {
+        d->host_dir = opendir(path);
+        if (d->host_dir == NULL) {
+            free(d);
+            return NULL;
+        }
+        return (DIR *)d;
+    }
+    d->fs = m->fs;
+    int err = d->fs->dir_open(d->fs, &d->dir, entrypoint);
+    if (err != 0) {
+        free(d);
+        error_remap(err);
+        return NULL;
+    }
+    return (DIR *)d;
+}
+
+struct dirent *vfs_host_readdir(DIR *dir) {
+    vfs_host_dir_t *d = (vfs_host_dir_t *)dir;
+    if (d->host_dir != NULL)
+        return readdir(d->host_dir);
+    int err = d->fs->dir_read(d->fs, &d->dir, &d->ent);
+    if (err != 0)
+        return NULL;
+    return &d->ent;
+}
+
+int vfs_host_closedir(DIR *dir) {
+    vfs_host_dir_t *d = (vfs_host_dir_t *)dir;
+    int err;
+    if (d->host_dir != NULL)
+        err = closedir(d->host_dir);
+    else
+        err = d->fs->dir_close(d->fs, &d->dir);
+    free(d);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int vfs_host_mkdir(const char *path, mode_t mode) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return mkdir(path, mode);
+    int err = m->fs->mkdir(m->fs, entrypoint, mode);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int vfs_host_rmdir(const char *path) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return rmdir(path);
+    int err = m->fs->rmdir(m->fs, entrypoint);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int vfs_host_unlink(const char *path) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return unlink(path);
+    int err = m->fs->remove(m->fs, entrypoint);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int vfs_host_rename(const char *oldpath, const char *newpath) {
+    const char *old_entrypoint, *new_entrypoint;
+    mountpoint_t *m = find_mountpoint(oldpath, &old_entrypoint);
+    if (m == NULL)
+        return rename(oldpath, newpath);
+    if (find_mountpoint(newpath, &new_entrypoint) != m)
+        return error_remap(-EXDEV);
+    int err = m->fs->rename(m->fs, old_entrypoint, new_entrypoint);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+int vfs_host_stat(const char *path, struct stat *st) {
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return stat(path, st);
+    int err = m->fs->stat(m->fs, entrypoint, st);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
+
+static vfs_host_file_t *find_descriptor(int fd) {
+    if (fd < VFS_HOST_FD_BASE || fd >= VFS_HOST_FD_BASE + VFS_HOST_MAX_FILES)
+        return NULL;
+    return descriptors[fd - VFS_HOST_FD_BASE];
+}
+
+int vfs_host_open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = (mode_t)va_arg(args, int);
+        va_end(args);
+    }
+    const char *entrypoint;
+    mountpoint_t *m = find_mountpoint(path, &entrypoint);
+    if (m == NULL)
+        return open(path, flags, mode);
+
+    int slot = 0;
+    while (slot < VFS_HOST_MAX_FILES && descriptors[slot] != NULL)
+        slot++;
+    if (slot == VFS_HOST_MAX_FILES) {
+        errno = EMFILE;
+        return -1;
+    }
+    vfs_host_file_t *f = calloc(1, sizeof(vfs_host_file_t));
+    if (f == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    f->fs = m->fs;
+    int err = f->fs->file_open(f->fs, &f->file, entrypoint, flags);
+    if (err != 0) {
+        free(f);
+        return error_remap(err);
+    }
+    descriptors[slot] = f;
+    return VFS_HOST_FD_BASE + slot;
+}
+
+int vfs_host_close(int fd) {
+    vfs_host_file_t *f = find_descriptor(fd);
+    if (f == NULL)
+        return close(fd);
+    descriptors[fd - VFS_HOST_FD_BASE] = NULL;
+    return cookie_close(f);
+}
+
+ssize_t vfs_host_read(int fd, void *buffer, size_t size) {
+    vfs_host_file_t *f = find_descriptor(fd);
+    if (f == NULL)
+        return read(fd, buffer, size);
+    return cookie_read(f, buffer, size);
+}
+
+ssize_t vfs_host_write(int fd, const void *buffer, size_t size) {
+    vfs_host_file_t *f = find_descriptor(fd);
+    if (f == NULL)
+        return write(fd, buffer, size);
+    return cookie_write(f, buffer, size);
+}
+
+off_t vfs_host_lseek(int fd, off_t offset, int whence) {
+    vfs_host_file_t *f = find_descriptor(fd);
+    if (f == NULL)
+        return lseek(fd, offset, whence);
+    off64_t position = offset;
+    if (cookie_seek(f, &position, whence) != 0)
+        return -1;
+    return (off_t)position;
+}
+
+int vfs_host_ftruncate(int fd, off_t length) {
+    vfs_host_file_t *f = find_descriptor(fd);
+    if (f == NULL)
+        return ftruncate(fd, length);
+    int err = f->fs->file_truncate(f->fs, &f->file, length);
+    if (err != 0)
+        return error_remap(err);
+    return 0;
+}
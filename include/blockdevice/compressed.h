@@ -0,0 +1,20 @@
+#pragma once
+
+/* Compressed RAM disk block device
+ *
+ * Drop-in replacement for the heap memory block device that presents a larger
+ * logical size than the memory it uses. Every 512-byte sector is compressed on
+ * its own with a small LZ77 coder and stored in a chain of fixed size slabs, so
+ * the arena never fragments. Sectors filled with zeros take no space at all.
+ */
+#include <stddef.h>
+#include "blockdevice/blockdevice.h"
+
+#define BD_ERROR_COMPRESSED_FULL    (-4101)  // The arena has no room left for the sector
+
+/* Create a device of `length` logical bytes backed by an `arena_size` byte arena */
+blockdevice_t *blockdevice_compressed_create(size_t length, size_t arena_size);
+void blockdevice_compressed_free(blockdevice_t *device);
+
+/* Bytes of the arena holding compressed sectors */
+size_t blockdevice_compressed_used(blockdevice_t *device);
@@ -0,0 +1,32 @@
+#pragma once
+
+/* Copy-on-write snapshot of a RAM disk shared by the two cores
+ *
+ * The USB stack on core 1 reads and writes the device returned by
+ * `blockdevice_snapshot_create()` while the sync engine on core 0 reads its
+ * view. Once the view is frozen, the first write to a sector saves the sector
+ * to a small pool first, so the view keeps the contents of the moment it was
+ * frozen. Every call holds a lock only while it copies its own sectors.
+ */
+#include <stddef.h>
+#include "blockdevice/blockdevice.h"
+
+#define BD_ERROR_SNAPSHOT_BUSY  (-4103)  // The pool is full until the view is released
+
+/* Share `device` through a snapshot able to save `pool_size` bytes of sectors
+ *
+ * The pool is taken from the memory arena, and `blockdevice_snapshot_free()`
+ * does not give it back.
+ */
+blockdevice_t *blockdevice_snapshot_create(blockdevice_t *device, size_t pool_size);
+void blockdevice_snapshot_free(blockdevice_t *device);
+
+/* The wrapped device */
+blockdevice_t *blockdevice_snapshot_device(blockdevice_t *device);
+
+/* Read-only view of the contents at the last freeze */
+blockdevice_t *blockdevice_snapshot_view(blockdevice_t *device);
+
+/* Fix the contents of the view until `blockdevice_snapshot_release()` */
+void blockdevice_snapshot_freeze(blockdevice_t *device);
+void blockdevice_snapshot_release(blockdevice_t *device);
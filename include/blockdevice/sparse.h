@@ -0,0 +1,19 @@
+#pragma once
+
+/* Thin-provisioned RAM disk block device
+ *
+ * Sectors take a slot of a fixed pool only once they hold non-zero data.
+ * Unallocated sectors read as zeros, and trimming a sector or writing zeros
+ * to it returns its slot to the pool.
+ */
+#include <stddef.h>
+#include "blockdevice/blockdevice.h"
+
+#define BD_ERROR_SPARSE_FULL    (-4102)  // Every slot of the pool is in use
+
+/* Create a device of `length` logical bytes backed by a `pool_size` byte pool */
+blockdevice_t *blockdevice_sparse_create(size_t length, size_t pool_size);
+void blockdevice_sparse_free(blockdevice_t *device);
+
+/* Bytes of the pool holding sectors */
+size_t blockdevice_sparse_used(blockdevice_t *device);
@@ -0,0 +1,36 @@
+#pragma once
+
+/* Write-back cache of whole erase sectors in front of the flash
+ *
+ * littlefs programs one page at a time and erases a sector before its first
+ * page. The cache holds the erase and the programs of a few sectors in RAM
+ * and sends each sector to the flash in one go: at most one erase, then one
+ * program for each run of adjacent pages. A sector is flushed on `sync()`,
+ * which littlefs calls at the end of every commit, or when its buffer is
+ * needed for another sector. Sectors are flushed in the order they were
+ * first written, so the flash sees the same order of sectors as without the
+ * cache.
+ *
+ * The cache also remembers the sectors known to be erased on the flash, and
+ * finds blank sectors by reading them, so an erase that would not change a
+ * sector is skipped.
+ *
+ * Nothing is locked: the device is used by one core at a time.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include "blockdevice/blockdevice.h"
+
+/* Cache the writes to `device` in `cache_size` bytes of whole erase sectors
+ *
+ * The buffers are taken from the memory arena, and
+ * `blockdevice_write_cache_free()` only flushes them.
+ */
+blockdevice_t *blockdevice_write_cache_create(blockdevice_t *device, size_t cache_size);
+void blockdevice_write_cache_free(blockdevice_t *device);
+
+/* The wrapped device */
+blockdevice_t *blockdevice_write_cache_device(blockdevice_t *device);
+
+/* Erases sent to the wrapped device so far, not counting the skipped ones */
+uint32_t blockdevice_write_cache_erases(blockdevice_t *device);
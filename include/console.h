@@ -0,0 +1,46 @@
+#pragma once
+
+/* Output of core 0 on the CDC port, written there by core 1
+ *
+ * Once core 1 runs the USB stack, it is the only core that calls TinyUSB.
+ * CFG_TUSB_OS is OPT_OS_NONE, so TinyUSB takes no locks, and pico-sdk's
+ * stdio_usb writes to the CDC FIFO and runs tud_task() on whichever core
+ * prints. The console driver installed in place of stdio_usb therefore
+ * queues what core 0 prints in a ring buffer. Core 1 writes the ring to the
+ * port between two runs of the USB stack. The bytes of an image transfer take
+ * two more rings, one each way.
+ *
+ * Each ring has one producer and one consumer, so neither side takes a lock.
+ * Core 0 may hold the stdio mutex while it prints, so it never waits for
+ * room: log output that does not fit the ring is dropped and counted.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef CONSOLE_LOG_SIZE
+#define CONSOLE_LOG_SIZE     4096  // Bytes of log of core 0 waiting for core 1, a power of two
+#endif
+#define CONSOLE_STREAM_SIZE  1024  // Bytes of an image transfer waiting in each direction
+
+/* Print through the console driver instead of stdio_usb. Called after `stdio_init_all()`. */
+void console_init(void);
+
+/* Queue the output of core 0 from here on. Called before core 1 is launched. */
+void console_hand_over(void);
+
+/* Core 1: write the queued output of core 0 to the CDC port
+ *
+ * @param stream  An image transfer holds the port: move its bytes both ways,
+ *                and keep the log until it is over.
+ */
+void console_task(bool stream);
+
+/* Core 0: the bytes of an image transfer, through core 1; the count moved */
+size_t console_stream_read(void *buffer, size_t size);
+size_t console_stream_write(const void *buffer, size_t size);
+
+/* Core 0: forget the bytes received before an image transfer */
+void console_stream_reset(void);
+
+/* Whether a terminal holds the CDC port open, as last seen by core 1 */
+bool console_connected(void);
@@ -0,0 +1,10 @@
+#pragma once
+
+/* CRC-32 of IEEE 802.3, the one of zlib and of `crc32` on Linux */
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32_INIT  0u
+
+/* CRC-32 over `size` bytes, chained from `crc`, which is CRC32_INIT to start */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
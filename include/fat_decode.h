@@ -0,0 +1,48 @@
+#pragma once
+
+/* Lightweight FAT12/FAT16 decoder for the RAM disk
+ *
+ * Reads the boot sector, FAT and directory entries straight from the block
+ * device, independently of FatFs, and maps the sectors written by the USB host
+ * back to the files and directories that own them.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockdevice/blockdevice.h"
+
+typedef enum {
+    FAT_TOUCHED_FILE,        // File whose directory entry and cluster chain are consistent
+    FAT_TOUCHED_INCOMPLETE,  // File the host is still writing
+    FAT_TOUCHED_DIRECTORY,   // Directory whose entries have changed
+} fat_touched_t;
+
+/* Called with the path relative to the volume root, e.g. "/dir/file.txt" */
+typedef void (*fat_touched_cb_t)(const char *path, fat_touched_t state, void *context);
+
+typedef struct {
+    blockdevice_t *device;
+    uint32_t device_sectors;
+    uint32_t sectors_per_cluster;
+    uint32_t reserved_sectors;
+    uint32_t fat_count;
+    uint32_t fat_sectors;
+    uint32_t root_sector;
+    uint32_t root_sectors;
+    uint32_t data_sector;
+    uint32_t cluster_count;
+    uint8_t fat_type;        // 12 or 16
+} fat_volume_t;
+
+/* Parse the boot sector of the FAT volume on `device` */
+bool fat_volume_open(fat_volume_t *volume, blockdevice_t *device);
+
+/* Report every file and directory owning a sector set in the `dirty` bitmap
+ *
+ * The sectors of files that are not yet complete are set in `pending`, so that
+ * they can be examined again after the next write from the host.
+ *
+ * @retval false The reserved region was rewritten or the volume is not
+ *               decodable; the caller must fall back to a full scan.
+ */
+bool fat_volume_scan(fat_volume_t *volume, const uint8_t *dirty, uint8_t *pending,
+                     fat_touched_cb_t touched, void *context);
@@ -0,0 +1,97 @@
+#pragma once
+
+/* Raw image transfer of the littlefs region over a byte stream
+ *
+ * The region is sent in frames of one erase sector, each protected by a
+ * CRC-32, so that a backup skips FAT, the RAM disk and the file copies.
+ *
+ *   header   magic "PI", type, flags, offset (LE32), length (LE32)
+ *   payload  `length` bytes
+ *   trailer  CRC-32 of the header and the payload (LE32)
+ *
+ * The device starts both transfers with an INFO frame. An export sends up to
+ * IMAGE_WINDOW data frames ahead of the ACK of the client, which carries the
+ * offset received in order so far; a NAK makes the device resend from its
+ * offset. An import is sent by the client one data frame at a time, each
+ * acknowledged once the device has stored the sector, and the END frame is
+ * answered once the device is synced and the new littlefs mounts. The device
+ * erases and programs only the sectors that differ from the frame.
+ *
+ * The region is too large to be staged in RAM, so an import is checked as it
+ * arrives: the frames come in order from offset 0, and the first one must hold
+ * a littlefs superblock before any sector is erased.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "blockdevice/blockdevice.h"
+
+#define IMAGE_FRAME_HEADER_SIZE   12
+#define IMAGE_FRAME_TRAILER_SIZE  4
+#define IMAGE_WINDOW              4      // Data frames an export sends ahead of the ACK
+#define IMAGE_TIMEOUT_MS          5000   // Silence of the peer that ends a transfer
+
+typedef enum {
+    IMAGE_FRAME_INFO  = 'I',  // Device: region size, sector size (LE32 each)
+    IMAGE_FRAME_DATA  = 'D',  // The bytes of the region at `offset`
+    IMAGE_FRAME_ACK   = 'A',  // Export: bytes received in order. Import: sector at `offset` stored
+    IMAGE_FRAME_NAK   = 'N',  // Resend from `offset`
+    IMAGE_FRAME_END   = 'E',  // Import: sectors written and skipped (LE32 each)
+    IMAGE_FRAME_ERROR = 'X',  // Abort, with a message
+} image_frame_type_t;
+
+typedef enum {
+    IMAGE_RECEIVE_OK,
+    IMAGE_RECEIVE_TIMEOUT,
+    IMAGE_RECEIVE_CORRUPT,  // CRC mismatch or too long; the stream is in sync again
+} image_receive_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t offset;
+    uint32_t length;
+} image_frame_t;
+
+/* Byte stream of the transfer, e.g. the CDC port or a socket */
+typedef struct {
+    /* Read up to `size` bytes, waiting at most `timeout_ms` for the first; the count read */
+    size_t (*read)(void *context, void *buffer, size_t size, uint32_t timeout_ms);
+    bool (*write)(void *context, const void *buffer, size_t size);
+    void *context;
+} image_stream_t;
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t sectors_written;  // Import only
+    uint32_t sectors_skipped;  // Import only, already identical
+    uint32_t retries;          // Frames sent again after a NAK or a corrupt frame
+    const char *error;         // Why the transfer failed, or NULL
+} image_stats_t;
+
+bool image_send_frame(const image_stream_t *stream, uint8_t type, uint32_t offset, const void *payload, uint32_t length);
+
+/* Receive the next frame, skipping bytes until its magic, with a payload of at most `capacity` bytes */
+image_receive_t image_receive_frame(const image_stream_t *stream, image_frame_t *frame,
+                                    uint8_t *payload, size_t capacity, uint32_t timeout_ms);
+
+/* Device side: take the buffer of one `sector_size` flash sector from the memory arena
+ *
+ * Called at boot, so that a transfer never runs out of memory. A transfer
+ * takes it on first use otherwise.
+ */
+bool image_transfer_reserve(uint32_t sector_size);
+
+/* Device side: send every sector of `flash` */
+bool image_export(blockdevice_t *flash, const image_stream_t *stream, image_stats_t *stats);
+
+/* Device side: store the sectors sent by the client on `flash`
+ *
+ * `reload`, if given, is called once every sector is on the flash, before the
+ * END frame is answered; its failure is reported to the client.
+ */
+bool image_import(blockdevice_t *flash, const image_stream_t *stream,
+                  bool (*reload)(const image_stats_t *stats), image_stats_t *stats);
+
+uint32_t image_get_le32(const uint8_t *p);
+void image_put_le32(uint8_t *p, uint32_t value);
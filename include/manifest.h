@@ -0,0 +1,63 @@
+#pragma once
+
+/* Per-file manifest of the littlefs contents
+ *
+ * Holds the size and a content hash of every file synchronised between
+ * `/flash` and `/ram`, so that the write back can skip files the host did not
+ * change. The manifest is kept in a hidden littlefs file as an append-only
+ * journal; a sync appends only the records of the files it touched and the
+ * journal is rewritten once it grows well beyond the live entries.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MANIFEST_FILE_NAME  ".sync_manifest"
+#define MANIFEST_HASH_INIT  2166136261u  // FNV-1a offset basis
+
+typedef struct {
+    char *path;        // Path relative to the mount point, e.g. "/dir/file.txt"
+    uint32_t size;
+    uint32_t hash;
+    uint8_t flags;
+} manifest_entry_t;
+
+typedef struct {
+    manifest_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    uint32_t *index;         // Open addressing table of entry index + 1 by path hash, 0 while empty
+    size_t index_size;       // Power of two
+    size_t journal_records;  // Records currently stored in the manifest file
+    char **removed;          // Paths removed since the last save
+    size_t removed_count;
+    bool compact;            // Rewrite the whole file on the next save
+} manifest_t;
+
+/* FNV-1a over `size` bytes, chained from `hash` */
+uint32_t manifest_hash(uint32_t hash, const void *data, size_t size);
+
+/* Load the manifest from `path`. A missing or corrupt file yields an empty manifest. */
+bool manifest_load(manifest_t *manifest, const char *path);
+
+/* Persist the changes made since the last load or save */
+bool manifest_save(manifest_t *manifest, const char *path);
+
+void manifest_free(manifest_t *manifest);
+
+/* Bytes of heap the entries, their paths and the index take */
+size_t manifest_memory(const manifest_t *manifest);
+
+manifest_entry_t *manifest_find(manifest_t *manifest, const char *path);
+
+/* The next entry after `after`, or the first one if NULL, with the given size and hash */
+manifest_entry_t *manifest_find_content(manifest_t *manifest, const manifest_entry_t *after,
+                                        uint32_t size, uint32_t hash);
+
+/* Record the current size and hash of `path` and mark it as seen */
+bool manifest_update(manifest_t *manifest, const char *path, uint32_t size, uint32_t hash);
+
+void manifest_remove(manifest_t *manifest, const char *path);
+
+/* Drop every entry not seen since the last prune */
+void manifest_prune(manifest_t *manifest);
@@ -0,0 +1,64 @@
+#pragma once
+
+/* Static memory arena and the memory budget report
+ *
+ * The fixed-size buffers kept for as long as the firmware runs are carved from
+ * one array in .bss: the snapshot pool, the flash write cache, the littlefs
+ * instance of the pre-erase, the copy buffer and sector bitmaps of the sync
+ * engine and the sector buffer of the image transfer. The linker's
+ * `--print-memory-usage` counts them, and they are all taken during boot, so
+ * none of them can run out of memory at runtime.
+ *
+ * The heap is left to what is sized at boot from the free heap or grows with
+ * the file tree:
+ * - the objects pico-vfs allocates itself, measured around their creation;
+ * - the RAM disk, including the compressed and sparse devices, whose tables
+ *   are sized with their storage, measured the same way;
+ * - the manifest, booked by the sync engine after each save;
+ * - the path sets and the touched file list of a single commit, and the
+ *   plan of the boot copy, which are freed again. HEAP_RESERVE in fs_init.c
+ *   keeps room for them, and the high-water mark in `mem_report()` shows
+ *   how much they took.
+ *
+ * Nothing is given back to the arena.
+ */
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef MEM_ARENA_SIZE
+#define MEM_ARENA_SIZE  (28 * 1024)  // Fits the consumers below at their default sizes
+#endif
+
+typedef enum {
+    MEM_FILESYSTEM,   // pico-vfs file systems, their mounts and the flash device (heap)
+    MEM_RAM_DISK,     // RAM disk device and its storage (heap)
+    MEM_SNAPSHOT,     // Copy-on-write pool in front of the RAM disk
+    MEM_FLASH_CACHE,  // Flash write cache, and the littlefs instance and free block map of the pre-erase
+    MEM_SYNC,         // Copy buffer and sector bitmaps of the sync engine; the manifest (heap)
+    MEM_IMAGE,        // Sector buffer of the image transfer
+    MEM_TAG_COUNT,
+} mem_tag_t;
+
+/* Zeroed memory from the arena, aligned to 8 bytes
+ *
+ * @return NULL once the arena is full.
+ */
+void *mem_arena_alloc(mem_tag_t tag, size_t size);
+void *mem_arena_alloc_aligned(mem_tag_t tag, size_t size, size_t alignment);
+
+/* Bytes of heap in use, 0 off the device */
+size_t mem_heap_used(void);
+
+/* Book the heap taken since `mem_heap_used()` returned `since` under `tag` */
+void mem_heap_charge(mem_tag_t tag, size_t since);
+
+/* Book `bytes` of heap under `tag`, for a consumer that knows its own size */
+void mem_heap_set(mem_tag_t tag, size_t bytes);
+
+/* Heap the RAM disk can take on top of the heap already in use and `reserve` */
+size_t mem_heap_available(size_t reserve);
+
+/* Print each consumer's share of the arena and the heap, the heap high-water
+ * mark and the largest RAM disk the heap would have held
+ */
+void mem_report(FILE *stream);
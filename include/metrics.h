@@ -0,0 +1,62 @@
+#pragma once
+
+/* Telemetry of the sync engine and of the USB MSC data path
+ *
+ * Counters and latency histograms, dumped as a single JSON line by
+ * `metrics_dump()`, which the `metrics` command on the CDC serial port calls.
+ * Histogram bucket `i` counts the samples below 2^i microseconds; the last
+ * bucket takes everything longer.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "blockdevice/blockdevice.h"
+
+#define METRICS_BUCKETS  24  // The last finite bucket ends at about 4 s
+
+typedef enum {
+    METRIC_SYNC,         // Commit of the host writes to littlefs
+    METRIC_FILE_COPY,    // One file copied in either direction
+    METRIC_READ10,       // READ10 callback
+    METRIC_WRITE10,      // WRITE10 callback
+    METRIC_USB_GAP,      // Time between two calls of tud_task()
+    METRIC_HISTOGRAM_COUNT,
+} metrics_histogram_t;
+
+typedef enum {
+    METRIC_BOOT_COPY_US,
+    METRIC_EXPORT_FILES,        // littlefs to RAM disk
+    METRIC_EXPORT_BYTES,
+    METRIC_IMPORT_FILES,        // RAM disk to littlefs
+    METRIC_IMPORT_BYTES,
+    METRIC_DELETED_FILES,
+    METRIC_MOVED_FILES,         // Renamed on littlefs instead of copied
+    METRIC_VERIFY_FAILURES,     // Files read back different from the RAM disk, or not written
+    METRIC_FLASH_READ_BYTES,
+    METRIC_FLASH_PROGRAMS,
+    METRIC_FLASH_PROGRAM_BYTES,
+    METRIC_FLASH_ERASES,
+    METRIC_FLASH_ERASE_BYTES,
+    METRIC_PRE_ERASED_BLOCKS,   // Free blocks erased on the flash while idle, not the blank ones
+    METRIC_USB_READ_BYTES,
+    METRIC_USB_WRITE_BYTES,
+    METRIC_RAM_DISK_HIGH_WATER,  // End of the furthest sector the host has written
+    METRIC_QUIET_FLUSHES,       // Commits after the host went idle for SYNC_DEBOUNCE_MS
+    METRIC_DEADLINE_FLUSHES,    // Commits of a burst longer than SYNC_MAX_DELAY_MS
+    METRIC_COUNTER_COUNT,
+} metrics_counter_t;
+
+uint64_t metrics_now_us(void);
+
+void metrics_add(metrics_counter_t counter, uint32_t value);
+
+/* Raise `counter` to `value` if it is lower */
+void metrics_max(metrics_counter_t counter, uint32_t value);
+
+/* Record the time elapsed since `start_us`, taken from `metrics_now_us()` */
+void metrics_record(metrics_histogram_t histogram, uint64_t start_us);
+
+/* Count the reads, programs and erases of the littlefs block device `flash` */
+void metrics_track_flash(blockdevice_t *flash);
+
+void metrics_dump(FILE *stream);
+void metrics_reset(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+/* Set of paths stored in a single arena
+ *
+ * The strings are appended to one growing buffer, in insertion order, and
+ * indexed by an open addressing table of their offsets. A lookup hashes the
+ * path once and compares only the strings in its probe sequence.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    uint32_t *table;     // Arena offset + 1 of each slot, 0 while empty
+    size_t table_size;   // Power of two
+    size_t count;
+    bool incomplete;     // A path could not be added for lack of memory
+} path_set_t;
+
+/* Add `path`, which is kept once however often it is added */
+bool path_set_add(path_set_t *set, const char *path);
+
+bool path_set_contains(const path_set_t *set, const char *path);
+
+/* Iterate in insertion order, starting with `*offset` set to 0
+ *
+ * @return The next path, or NULL at the end.
+ */
+const char *path_set_next(const path_set_t *set, size_t *offset);
+
+void path_set_free(path_set_t *set);
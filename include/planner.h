@@ -0,0 +1,31 @@
+#pragma once
+
+/* Boot time planner of the RAM disk size and of the files exported to it
+ *
+ * Before the RAM disk is created, the littlefs tree is scanned to estimate
+ * the space its files and directories take on a FAT volume formatted by
+ * FatFs. The RAM disk is sized to the contents within the free heap, and when
+ * the contents still do not fit, a deterministic subset of the files is
+ * chosen: the paths listed in the priority file first, then the smallest.
+ * Files left out are neither copied to the RAM disk nor deleted from littlefs.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PLANNER_PRIORITY_FILE_NAME  ".sync_priority"  // One path or directory per line, e.g. "/main.py"
+
+/* Scan the tree under `root`, the mount point of littlefs */
+bool planner_scan(const char *root);
+
+/* Bytes of RAM disk to create: at least `minimum` when the contents need
+ * less, with room left for the host, but never more than `available`
+ */
+size_t planner_disk_size(size_t minimum, size_t available);
+
+/* Choose the files exported to a RAM disk of `disk_size` bytes */
+void planner_select(size_t disk_size);
+
+/* Whether the scanned file or directory `path`, relative to the mount point,
+ * was left out of the RAM disk
+ */
+bool planner_is_excluded(const char *path);
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Erase the free littlefs blocks ahead of time while the host is idle
+ *
+ * After each commit the littlefs metadata is traversed, read only, to find
+ * the blocks it does not use. Between commits they are erased one at a time
+ * through the flash write cache, which remembers them as erased, so the
+ * erase littlefs asks for when it allocates such a block is skipped.
+ *
+ * Only meaningful on the write cache: the free blocks must be scanned again
+ * after every write to littlefs before the next step.
+ */
+#include <stdbool.h>
+#include "blockdevice/blockdevice.h"
+
+/* Find the free blocks of the littlefs on `device`, which must be idle */
+bool pre_erase_scan(blockdevice_t *device);
+
+/* Erase the next free block
+ *
+ * @return false once every free block found by the last scan is erased.
+ */
+bool pre_erase_step(void);
@@ -0,0 +1,47 @@
+#pragma once
+
+/* Recorder of the SCSI commands sent by the USB host
+ *
+ * Each READ10, WRITE10, TEST UNIT READY and commit point of the host is kept
+ * as a record in a ring buffer of SCSI_TRACE_SIZE bytes, dropping the oldest
+ * records when it is full. The `trace` command on the USB serial port prints
+ * the buffer as hex lines, which `host/scsi_replay` feeds back into the MSC
+ * callbacks and the sync engine. With SCSI_TRACE_DATA the payload of every
+ * WRITE10 is kept as well, which replaying the writes requires.
+ *
+ * The default SCSI_TRACE_SIZE of 0 compiles the recorder out.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SCSI_TRACE_SIZE
+#define SCSI_TRACE_SIZE  0
+#endif
+#ifndef SCSI_TRACE_DATA
+#define SCSI_TRACE_DATA  0
+#endif
+
+#define SCSI_TRACE_VERSION      1
+#define SCSI_TRACE_HEADER_SIZE  20   // Encoded size of a record without its data
+#define SCSI_TRACE_HAS_DATA     (1u << 0)
+
+typedef struct {
+    uint8_t opcode;     // SCSI operation code
+    uint8_t flags;
+    uint32_t delta_us;  // Time since the previous record
+    uint32_t lba;       // First sector, or CDB byte 4 for START STOP UNIT and PREVENT ALLOW MEDIUM REMOVAL
+    uint32_t length;    // Bytes transferred or unmapped
+    uint32_t hash;      // FNV-1a of the bytes transferred
+} scsi_trace_record_t;  // Followed by `length` bytes of data if SCSI_TRACE_HAS_DATA is set
+
+/* Record a command; `data` is hashed, and kept too if `keep_data` and SCSI_TRACE_DATA */
+void scsi_trace_record(uint8_t opcode, uint32_t lba, uint32_t length, const void *data, bool keep_data);
+
+/* Print the records, oldest first, between a `scsi-trace` header line and a `scsi-trace end` line */
+void scsi_trace_dump(FILE *stream, uint32_t sector_count, uint32_t sector_size);
+void scsi_trace_clear(void);
+
+/* Little-endian encoding of the SCSI_TRACE_HEADER_SIZE bytes of a record */
+void scsi_trace_encode(uint8_t *buffer, const scsi_trace_record_t *record);
+void scsi_trace_decode(const uint8_t *buffer, scsi_trace_record_t *record);
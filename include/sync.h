@@ -0,0 +1,30 @@
+#pragma once
+
+/* Synchronisation engine between the littlefs on flash and the FAT RAM disk
+ *
+ * The engine works only through the POSIX file API provided by pico-vfs, so the
+ * same code runs on the Pico and in the host build under `host/`.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockdevice/blockdevice.h"
+
+#define SYNC_FLASH_PREFIX   "/flash"
+#define SYNC_RAM_PREFIX     "/ram"
+
+/* Copy the whole littlefs tree to the RAM disk. Called once at boot. */
+void sync_flash_to_ram(void);
+
+/* Write back the RAM disk contents to littlefs and remove deleted entries. */
+void sync_ram_to_flash(void);
+
+/* Write back only the files and directories owning the sectors in the `dirty`
+ * bitmap of the RAM disk `device`
+ *
+ * Files the host is still writing are skipped and their sectors are left set
+ * in `dirty`, unless `force` is given.
+ *
+ * @retval false The FAT could not be decoded or the touched files could not all
+ *               be listed; use `sync_ram_to_flash()`.
+ */
+bool sync_touched_to_flash(blockdevice_t *device, uint8_t *dirty, bool force);
@@ -0,0 +1,47 @@
+#pragma once
+
+/* Iterative walker of a directory tree
+ *
+ * The tree is walked depth first with a bounded stack of open directories and
+ * a single path buffer: each entry name is appended to the path in place and
+ * cut off again when the walk moves on. The memory taken is one path buffer
+ * plus one handle and one length per level, whatever the shape of the tree.
+ */
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TREE_WALK_MAX_DEPTH  32  // Directories open at once, the root included
+
+typedef enum {
+    TREE_WALK_FILE,
+    TREE_WALK_DIRECTORY,      // On the way down, before its entries
+    TREE_WALK_DIRECTORY_END,  // On the way up, after its entries
+    TREE_WALK_END,
+} tree_walk_event_t;
+
+typedef struct {
+    char path[PATH_MAX];      // Path of the current entry, starting with the root
+    const char *name;         // Last component of `path`
+    size_t root_length;       // `path + root_length` is relative to the root, e.g. "/dir/file"
+    size_t depth;             // Directories between the root and the current entry
+    DIR *dirs[TREE_WALK_MAX_DEPTH];
+    size_t lengths[TREE_WALK_MAX_DEPTH];  // Path length of each open directory
+    size_t open_count;
+    bool enter;               // The directory just returned is entered on the next call
+} tree_walk_t;
+
+/* Start walking the entries under `root`
+ *
+ * @retval false The root could not be opened; see errno.
+ */
+bool tree_walk_open(tree_walk_t *walk, const char *root);
+
+/* Move to the next entry, skipping "." and ".." and entries other than files and directories */
+tree_walk_event_t tree_walk_next(tree_walk_t *walk);
+
+/* Do not enter the directory just returned, nor report its end */
+void tree_walk_skip(tree_walk_t *walk);
+
+void tree_walk_close(tree_walk_t *walk);
@@ -79,8 +79,9 @@
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
-// MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE   512
+// MSC Buffer size of Device Mass storage. READ10/WRITE10 callbacks get up to 8 sectors at a time.
+// A single buffer: the class driver waits for each callback before the next USB transfer
+#define CFG_TUD_MSC_EP_BUFSIZE   4096
 
 #ifdef __cplusplus
  }
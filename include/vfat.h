@@ -0,0 +1,21 @@
+#pragma once
+
+/* Virtual FAT16 volume generated on the fly from littlefs
+ *
+ * Only the directory tree (names, sizes and cluster ranges) is kept in RAM.
+ * The boot sector, FAT and directory clusters are synthesised on every read
+ * and file data is streamed straight from flash, so neither the capacity nor
+ * the boot time depend on a RAM disk copy. The volume is read-only.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VFAT_SECTOR_SIZE    512
+
+/* Scan the tree under `root` and lay out the virtual volume */
+bool vfat_build(const char *root);
+
+uint32_t vfat_sector_count(void);
+
+/* Fill `buffer` with `count` sectors starting at `lba` */
+bool vfat_read(uint32_t lba, void *buffer, uint32_t count);
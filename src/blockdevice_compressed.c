@@ -0,0 +1,313 @@
+/* Compressed RAM disk block device
+ *
+ * Compressed sector format, a sequence of:
+ *   0x00-0x7F  literal run of (b + 1) bytes, which follow
+ *   0x80-0xFF  match of (((b >> 1) & 0x3F) + 3) bytes, whose distance back into
+ *              the sector is ((b & 1) << 8) plus the following byte
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockdevice/compressed.h"
+
+#define SECTOR_SIZE        512
+#define SLAB_SIZE          32
+#define SLAB_NONE          0xFFFF
+#define MIN_MATCH          3
+#define MAX_MATCH          (0x3F + MIN_MATCH)
+#define MAX_LITERALS       0x80
+#define HASH_BITS          10
+
+typedef struct {
+    size_t length;
+    size_t sector_count;
+    uint16_t *first_slab;  // First slab of the chain of each sector
+    uint16_t *stored;      // Stored bytes of each sector: 0 all zeros, SECTOR_SIZE uncompressed
+    uint8_t *arena;
+    uint16_t *next_slab;   // Chains and the free list, placed at the head of the arena
+    uint8_t *slabs;
+    size_t slab_count;
+    size_t free_count;
+    uint16_t free_list;
+} blockdevice_compressed_config_t;
+
+static uint8_t packed[SECTOR_SIZE];
+static int16_t match_table[1 << HASH_BITS];  // Last position of each hashed 3-byte sequence
+
+
+static size_t compress_sector(const uint8_t *src, uint8_t *dst) {
+    int16_t *table = match_table;
+    memset(table, 0xFF, sizeof(match_table));
+    size_t out = 0;
+    size_t literal_start = 0;
+    size_t i = 0;
+
+    while (i + MIN_MATCH <= SECTOR_SIZE) {
+        uint32_t hash = (((uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2]) * 2654435761u) >> (32 - HASH_BITS);
+        int16_t candidate = table[hash];
+        table[hash] = (int16_t)i;
+        size_t length = 0;
+        if (candidate >= 0) {
+            size_t limit = SECTOR_SIZE - i < MAX_MATCH ? SECTOR_SIZE - i : MAX_MATCH;
+            while (length < limit && src[(size_t)candidate + length] == src[i + length])
+                length++;
+        }
+        if (length < MIN_MATCH) {
+            i++;
+            continue;
+        }
+        while (literal_start < i) {
+            size_t run = i - literal_start < MAX_LITERALS ? i - literal_start : MAX_LITERALS;
+            if (out + 1 + run >= SECTOR_SIZE)
+                return SECTOR_SIZE;
+            dst[out++] = (uint8_t)(run - 1);
+            memcpy(dst + out, src + literal_start, run);
+            out += run;
+            literal_start += run;
+        }
+        if (out + 2 >= SECTOR_SIZE)
+            return SECTOR_SIZE;
+        size_t distance = i - (size_t)candidate;
+        dst[out++] = (uint8_t)(0x80 | (length - MIN_MATCH) << 1 | distance >> 8);
+        dst[out++] = (uint8_t)distance;
+        i += length;
+        literal_start = i;
+    }
+    while (literal_start < SECTOR_SIZE) {
+        size_t run = SECTOR_SIZE - literal_start < MAX_LITERALS ? SECTOR_SIZE - literal_start : MAX_LITERALS;
+        if (out + 1 + run >= SECTOR_SIZE)
+            return SECTOR_SIZE;
+        dst[out++] = (uint8_t)(run - 1);
+        memcpy(dst + out, src + literal_start, run);
+        out += run;
+        literal_start += run;
+    }
+    return out;
+}
+
+static bool decompress_sector(const uint8_t *src, size_t length, uint8_t *dst) {
+    size_t in = 0, out = 0;
+    while (in < length) {
+        uint8_t token = src[in++];
+        if (token < 0x80) {
+            size_t run = (size_t)token + 1;
+            if (in + run > length || out + run > SECTOR_SIZE)
+                return false;
+            memcpy(dst + out, src + in, run);
+            in += run;
+            out += run;
+        } else {
+            if (in + 1 > length)
+                return false;
+            size_t match = (size_t)((token >> 1) & 0x3F) + MIN_MATCH;
+            size_t distance = (size_t)(token & 1) << 8 | src[in++];
+            if (distance == 0 || distance > out || out + match > SECTOR_SIZE)
+                return false;
+            for (size_t k = 0; k < match; k++, out++)  // Overlapping copies repeat the pattern
+                dst[out] = dst[out - distance];
+        }
+    }
+    return out == SECTOR_SIZE;
+}
+
+static size_t slabs_for(size_t stored) {
+    return (stored + SLAB_SIZE - 1) / SLAB_SIZE;
+}
+
+static void release_sector(blockdevice_compressed_config_t *config, size_t sector) {
+    uint16_t slab = config->first_slab[sector];
+    while (slab != SLAB_NONE) {
+        uint16_t next = config->next_slab[slab];
+        config->next_slab[slab] = config->free_list;
+        config->free_list = slab;
+        config->free_count++;
+        slab = next;
+    }
+    config->first_slab[sector] = SLAB_NONE;
+    config->stored[sector] = 0;
+}
+
+static int store_sector(blockdevice_compressed_config_t *config, size_t sector, const uint8_t *data) {
+    const uint8_t *body = packed;
+    size_t stored = 0;
+    for (size_t i = 0; i < SECTOR_SIZE; i++) {
+        if (data[i] != 0) {
+            stored = compress_sector(data, packed);
+            if (stored == SECTOR_SIZE)
+                body = data;
+            break;
+        }
+    }
+    size_t needed = slabs_for(stored);
+    if (needed > config->free_count + slabs_for(config->stored[sector]))
+        return BD_ERROR_COMPRESSED_FULL;  // The old contents are kept
+
+    release_sector(config, sector);
+    uint16_t *link = &config->first_slab[sector];
+    for (size_t offset = 0; offset < stored; offset += SLAB_SIZE) {
+        uint16_t slab = config->free_list;
+        config->free_list = config->next_slab[slab];
+        config->free_count--;
+        size_t chunk = stored - offset < SLAB_SIZE ? stored - offset : SLAB_SIZE;
+        memcpy(config->slabs + (size_t)slab * SLAB_SIZE, body + offset, chunk);
+        *link = slab;
+        link = &config->next_slab[slab];
+    }
+    *link = SLAB_NONE;
+    config->stored[sector] = (uint16_t)stored;
+    return BD_ERROR_OK;
+}
+
+static int load_sector(blockdevice_compressed_config_t *config, size_t sector, uint8_t *data) {
+    size_t stored = config->stored[sector];
+    if (stored == 0) {
+        memset(data, 0, SECTOR_SIZE);
+        return BD_ERROR_OK;
+    }
+    uint8_t *body = stored == SECTOR_SIZE ? data : packed;
+    uint16_t slab = config->first_slab[sector];
+    for (size_t offset = 0; offset < stored; offset += SLAB_SIZE) {
+        size_t chunk = stored - offset < SLAB_SIZE ? stored - offset : SLAB_SIZE;
+        memcpy(body + offset, config->slabs + (size_t)slab * SLAB_SIZE, chunk);
+        slab = config->next_slab[slab];
+    }
+    if (stored != SECTOR_SIZE && !decompress_sector(packed, stored, data))
+        return BD_ERROR_DEVICE_ERROR;
+    return BD_ERROR_OK;
+}
+
+static int compressed_init(blockdevice_t *device) {
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int compressed_deinit(blockdevice_t *device) {
+    device->is_initialized = false;
+    return BD_ERROR_OK;
+}
+
+static int compressed_sync(blockdevice_t *device) {
+    (void)device;
+    return BD_ERROR_OK;
+}
+
+static bool is_valid_range(blockdevice_compressed_config_t *config, bd_size_t addr, bd_size_t length) {
+    return addr % SECTOR_SIZE == 0 && length % SECTOR_SIZE == 0 && addr + length <= config->length;
+}
+
+static int compressed_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_compressed_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    uint8_t *p = (uint8_t *)buffer;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE) {
+        int err = load_sector(config, (size_t)((addr + offset) / SECTOR_SIZE), p + offset);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return BD_ERROR_OK;
+}
+
+static int compressed_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_compressed_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    return BD_ERROR_OK;  // Sectors are replaced as a whole by program
+}
+
+static int compressed_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_compressed_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    const uint8_t *p = buffer;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE) {
+        int err = store_sector(config, (size_t)((addr + offset) / SECTOR_SIZE), p + offset);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return BD_ERROR_OK;
+}
+
+static int compressed_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_compressed_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE)
+        release_sector(config, (size_t)((addr + offset) / SECTOR_SIZE));
+    return BD_ERROR_OK;
+}
+
+static bd_size_t compressed_size(blockdevice_t *device) {
+    blockdevice_compressed_config_t *config = device->config;
+    return config->length;
+}
+
+size_t blockdevice_compressed_used(blockdevice_t *device) {
+    blockdevice_compressed_config_t *config = device->config;
+    return (config->slab_count - config->free_count) * SLAB_SIZE;
+}
+
+blockdevice_t *blockdevice_compressed_create(size_t length, size_t arena_size) {
+    size_t slab_count = arena_size / (SLAB_SIZE + sizeof(uint16_t));
+    if (slab_count > SLAB_NONE)
+        slab_count = SLAB_NONE;
+    size_t sector_count = length / SECTOR_SIZE;
+
+    blockdevice_t *device = calloc(1, sizeof(blockdevice_t));
+    blockdevice_compressed_config_t *config = calloc(1, sizeof(blockdevice_compressed_config_t));
+    uint16_t *first_slab = malloc(sector_count * sizeof(uint16_t));
+    uint16_t *stored = calloc(sector_count, sizeof(uint16_t));
+    uint8_t *arena = malloc(slab_count * (SLAB_SIZE + sizeof(uint16_t)));
+    if (device == NULL || config == NULL || first_slab == NULL || stored == NULL || arena == NULL) {
+        free(arena);
+        free(stored);
+        free(first_slab);
+        free(config);
+        free(device);
+        return NULL;
+    }
+    for (size_t i = 0; i < sector_count; i++)
+        first_slab[i] = SLAB_NONE;
+    config->length = sector_count * SECTOR_SIZE;
+    config->sector_count = sector_count;
+    config->first_slab = first_slab;
+    config->stored = stored;
+    config->arena = arena;
+    config->next_slab = (uint16_t *)arena;
+    config->slabs = arena + slab_count * sizeof(uint16_t);
+    config->slab_count = slab_count;
+    config->free_count = slab_count;
+    for (size_t i = 0; i < slab_count; i++)
+        config->next_slab[i] = i + 1 < slab_count ? (uint16_t)(i + 1) : SLAB_NONE;
+    config->free_list = slab_count > 0 ? 0 : SLAB_NONE;
+
+    device->init = compressed_init;
+    device->deinit = compressed_deinit;
+    device->read = compressed_read;
+    device->erase = compressed_erase;
+    device->program = compressed_program;
+    device->trim = compressed_trim;
+    device->sync = compressed_sync;
+    device->size = compressed_size;
+    device->read_size = SECTOR_SIZE;
+    device->erase_size = SECTOR_SIZE;
+    device->program_size = SECTOR_SIZE;
+    device->name = "compressed";
+    device->config = config;
+    device->is_initialized = true;
+    return device;
+}
+
+void blockdevice_compressed_free(blockdevice_t *device) {
+    if (device == NULL)
+        return;
+    blockdevice_compressed_config_t *config = device->config;
+    free(config->arena);
+    free(config->stored);
+    free(config->first_slab);
+    free(config);
+    free(device);
+}
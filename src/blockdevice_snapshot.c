@@ -0,0 +1,248 @@
+/* Copy-on-write snapshot of a RAM disk shared by the two cores
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include "blockdevice/snapshot.h"
+#include "mem_arena.h"
+
+#define SECTOR_SIZE    512
+
+typedef struct {
+    blockdevice_t *device;
+    blockdevice_t *view;
+    mutex_t mutex;
+    bool frozen;
+    uint8_t *pool;
+    uint32_t *saved;      // Sector number of each pool slot in use
+    size_t slot_count;
+    size_t saved_count;
+} blockdevice_snapshot_config_t;
+
+
+static bool is_valid_range(blockdevice_snapshot_config_t *config, bd_size_t addr, bd_size_t length) {
+    return addr % SECTOR_SIZE == 0 && length % SECTOR_SIZE == 0 &&
+           addr + length <= config->device->size(config->device);
+}
+
+static uint8_t *find_saved(blockdevice_snapshot_config_t *config, uint32_t sector) {
+    for (size_t i = 0; i < config->saved_count; i++) {
+        if (config->saved[i] == sector)
+            return config->pool + i * SECTOR_SIZE;
+    }
+    return NULL;
+}
+
+/* Save the sectors of the range not saved yet before they are overwritten
+ *
+ * Nothing is saved unless the whole range fits, so that a write is either
+ * applied in full or refused.
+ */
+static int save_range(blockdevice_snapshot_config_t *config, bd_size_t addr, bd_size_t length) {
+    if (!config->frozen)
+        return BD_ERROR_OK;
+    uint32_t first = (uint32_t)(addr / SECTOR_SIZE);
+    uint32_t count = (uint32_t)(length / SECTOR_SIZE);
+    size_t needed = 0;
+    for (uint32_t sector = first; sector < first + count; sector++) {
+        if (find_saved(config, sector) == NULL)
+            needed++;
+    }
+    if (needed > config->slot_count - config->saved_count)
+        return BD_ERROR_SNAPSHOT_BUSY;
+
+    for (uint32_t sector = first; sector < first + count; sector++) {
+        if (find_saved(config, sector) != NULL)
+            continue;
+        uint8_t *slot = config->pool + config->saved_count * SECTOR_SIZE;
+        int err = config->device->read(config->device, slot, (bd_size_t)sector * SECTOR_SIZE, SECTOR_SIZE);
+        if (err != BD_ERROR_OK)
+            return err;
+        config->saved[config->saved_count++] = sector;
+    }
+    return BD_ERROR_OK;
+}
+
+static int snapshot_init(blockdevice_t *device) {
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int snapshot_deinit(blockdevice_t *device) {
+    device->is_initialized = false;
+    return BD_ERROR_OK;
+}
+
+static int snapshot_sync(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    mutex_enter_blocking(&config->mutex);
+    int err = config->device->sync(config->device);
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static int snapshot_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_snapshot_config_t *config = device->config;
+    mutex_enter_blocking(&config->mutex);
+    int err = config->device->read(config->device, buffer, addr, length);
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static int snapshot_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_snapshot_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    mutex_enter_blocking(&config->mutex);
+    int err = save_range(config, addr, length);
+    if (err == BD_ERROR_OK)
+        err = config->device->erase(config->device, addr, length);
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static int snapshot_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_snapshot_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    mutex_enter_blocking(&config->mutex);
+    int err = save_range(config, addr, length);
+    if (err == BD_ERROR_OK)
+        err = config->device->program(config->device, buffer, addr, length);
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static int snapshot_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_snapshot_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    mutex_enter_blocking(&config->mutex);
+    int err = save_range(config, addr, length);
+    if (err == BD_ERROR_OK)
+        err = config->device->trim(config->device, addr, length);
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static bd_size_t snapshot_size(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    return config->device->size(config->device);
+}
+
+static int view_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_snapshot_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    uint8_t *p = (uint8_t *)buffer;
+    int err = BD_ERROR_OK;
+    mutex_enter_blocking(&config->mutex);
+    for (bd_size_t offset = 0; offset < length && err == BD_ERROR_OK; offset += SECTOR_SIZE) {
+        uint8_t *saved = config->frozen ? find_saved(config, (uint32_t)((addr + offset) / SECTOR_SIZE)) : NULL;
+        if (saved != NULL)
+            memcpy(p + offset, saved, SECTOR_SIZE);
+        else
+            err = config->device->read(config->device, p + offset, addr + offset, SECTOR_SIZE);
+    }
+    mutex_exit(&config->mutex);
+    return err;
+}
+
+static int view_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    (void)device;
+    (void)addr;
+    (void)length;
+    return BD_ERROR_DEVICE_ERROR;  // Read only
+}
+
+static int view_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    (void)device;
+    (void)buffer;
+    (void)addr;
+    (void)length;
+    return BD_ERROR_DEVICE_ERROR;  // Read only
+}
+
+static int view_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    return view_erase(device, addr, length);
+}
+
+static blockdevice_t *create_device(blockdevice_t *device, blockdevice_snapshot_config_t *config) {
+    blockdevice_t *snapshot = mem_arena_alloc(MEM_SNAPSHOT, sizeof(blockdevice_t));
+    if (snapshot == NULL)
+        return NULL;
+    snapshot->init = snapshot_init;
+    snapshot->deinit = snapshot_deinit;
+    snapshot->read = snapshot_read;
+    snapshot->erase = snapshot_erase;
+    snapshot->program = snapshot_program;
+    snapshot->trim = snapshot_trim;
+    snapshot->sync = snapshot_sync;
+    snapshot->size = snapshot_size;
+    snapshot->read_size = device->read_size;
+    snapshot->erase_size = device->erase_size;
+    snapshot->program_size = device->program_size;
+    snapshot->name = "snapshot";
+    snapshot->config = config;
+    snapshot->is_initialized = true;
+    return snapshot;
+}
+
+blockdevice_t *blockdevice_snapshot_create(blockdevice_t *device, size_t pool_size) {
+    if (device->erase_size != SECTOR_SIZE)
+        return NULL;
+    size_t slot_count = pool_size / (SECTOR_SIZE + sizeof(uint32_t));
+    blockdevice_snapshot_config_t *config = mem_arena_alloc(MEM_SNAPSHOT, sizeof(blockdevice_snapshot_config_t));
+    uint8_t *pool = mem_arena_alloc(MEM_SNAPSHOT, slot_count * SECTOR_SIZE);
+    uint32_t *saved = mem_arena_alloc(MEM_SNAPSHOT, slot_count * sizeof(uint32_t));
+    blockdevice_t *snapshot = config ? create_device(device, config) : NULL;
+    blockdevice_t *view = config ? create_device(device, config) : NULL;
+    if (config == NULL || pool == NULL || saved == NULL || snapshot == NULL || view == NULL)
+        return NULL;
+    view->read = view_read;
+    view->erase = view_erase;
+    view->program = view_program;
+    view->trim = view_trim;
+    view->name = "snapshot_view";
+
+    mutex_init(&config->mutex);
+    config->device = device;
+    config->view = view;
+    config->pool = pool;
+    config->saved = saved;
+    config->slot_count = slot_count;
+    return snapshot;
+}
+
+void blockdevice_snapshot_free(blockdevice_t *device) {
+    (void)device;  // Its memory stays in the arena
+}
+
+blockdevice_t *blockdevice_snapshot_device(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    return config->device;
+}
+
+blockdevice_t *blockdevice_snapshot_view(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    return config->view;
+}
+
+void blockdevice_snapshot_freeze(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    mutex_enter_blocking(&config->mutex);
+    config->saved_count = 0;
+    config->frozen = true;
+    mutex_exit(&config->mutex);
+}
+
+void blockdevice_snapshot_release(blockdevice_t *device) {
+    blockdevice_snapshot_config_t *config = device->config;
+    mutex_enter_blocking(&config->mutex);
+    config->frozen = false;
+    config->saved_count = 0;
+    mutex_exit(&config->mutex);
+}
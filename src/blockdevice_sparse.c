@@ -0,0 +1,193 @@
+/* Thin-provisioned RAM disk block device
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockdevice/sparse.h"
+
+#define SECTOR_SIZE    512
+#define SLOT_NONE      0xFFFF
+
+typedef struct {
+    size_t length;
+    size_t sector_count;
+    uint16_t *slot;        // Pool slot of each sector, SLOT_NONE while unallocated
+    uint8_t *pool;
+    uint16_t *next_free;   // Free list threaded through the slot numbers
+    size_t slot_count;
+    size_t free_count;
+    uint16_t free_list;
+} blockdevice_sparse_config_t;
+
+
+static bool is_zero(const uint8_t *data) {
+    for (size_t i = 0; i < SECTOR_SIZE; i++) {
+        if (data[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+static void release_sector(blockdevice_sparse_config_t *config, size_t sector) {
+    uint16_t slot = config->slot[sector];
+    if (slot == SLOT_NONE)
+        return;
+    config->next_free[slot] = config->free_list;
+    config->free_list = slot;
+    config->free_count++;
+    config->slot[sector] = SLOT_NONE;
+}
+
+static int store_sector(blockdevice_sparse_config_t *config, size_t sector, const uint8_t *data) {
+    if (is_zero(data)) {
+        release_sector(config, sector);
+        return BD_ERROR_OK;
+    }
+    uint16_t slot = config->slot[sector];
+    if (slot == SLOT_NONE) {
+        if (config->free_count == 0)
+            return BD_ERROR_SPARSE_FULL;
+        slot = config->free_list;
+        config->free_list = config->next_free[slot];
+        config->free_count--;
+        config->slot[sector] = slot;
+    }
+    memcpy(config->pool + (size_t)slot * SECTOR_SIZE, data, SECTOR_SIZE);
+    return BD_ERROR_OK;
+}
+
+static int sparse_init(blockdevice_t *device) {
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int sparse_deinit(blockdevice_t *device) {
+    device->is_initialized = false;
+    return BD_ERROR_OK;
+}
+
+static int sparse_sync(blockdevice_t *device) {
+    (void)device;
+    return BD_ERROR_OK;
+}
+
+static bool is_valid_range(blockdevice_sparse_config_t *config, bd_size_t addr, bd_size_t length) {
+    return addr % SECTOR_SIZE == 0 && length % SECTOR_SIZE == 0 && addr + length <= config->length;
+}
+
+static int sparse_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_sparse_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    uint8_t *p = (uint8_t *)buffer;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE) {
+        uint16_t slot = config->slot[(addr + offset) / SECTOR_SIZE];
+        if (slot == SLOT_NONE)
+            memset(p + offset, 0, SECTOR_SIZE);
+        else
+            memcpy(p + offset, config->pool + (size_t)slot * SECTOR_SIZE, SECTOR_SIZE);
+    }
+    return BD_ERROR_OK;
+}
+
+static int sparse_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_sparse_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    return BD_ERROR_OK;  // Sectors are replaced as a whole by program
+}
+
+static int sparse_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_sparse_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    const uint8_t *p = buffer;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE) {
+        int err = store_sector(config, (size_t)((addr + offset) / SECTOR_SIZE), p + offset);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return BD_ERROR_OK;
+}
+
+static int sparse_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_sparse_config_t *config = device->config;
+    if (!is_valid_range(config, addr, length))
+        return BD_ERROR_DEVICE_ERROR;
+    for (bd_size_t offset = 0; offset < length; offset += SECTOR_SIZE)
+        release_sector(config, (size_t)((addr + offset) / SECTOR_SIZE));
+    return BD_ERROR_OK;
+}
+
+static bd_size_t sparse_size(blockdevice_t *device) {
+    blockdevice_sparse_config_t *config = device->config;
+    return config->length;
+}
+
+size_t blockdevice_sparse_used(blockdevice_t *device) {
+    blockdevice_sparse_config_t *config = device->config;
+    return (config->slot_count - config->free_count) * SECTOR_SIZE;
+}
+
+blockdevice_t *blockdevice_sparse_create(size_t length, size_t pool_size) {
+    size_t slot_count = pool_size / (SECTOR_SIZE + sizeof(uint16_t));
+    if (slot_count > SLOT_NONE)
+        slot_count = SLOT_NONE;
+    size_t sector_count = length / SECTOR_SIZE;
+
+    blockdevice_t *device = calloc(1, sizeof(blockdevice_t));
+    blockdevice_sparse_config_t *config = calloc(1, sizeof(blockdevice_sparse_config_t));
+    uint16_t *slot = malloc(sector_count * sizeof(uint16_t));
+    uint16_t *next_free = malloc(slot_count * sizeof(uint16_t));
+    uint8_t *pool = malloc(slot_count * SECTOR_SIZE);
+    if (device == NULL || config == NULL || slot == NULL || next_free == NULL || pool == NULL) {
+        free(pool);
+        free(next_free);
+        free(slot);
+        free(config);
+        free(device);
+        return NULL;
+    }
+    for (size_t i = 0; i < sector_count; i++)
+        slot[i] = SLOT_NONE;
+    for (size_t i = 0; i < slot_count; i++)
+        next_free[i] = i + 1 < slot_count ? (uint16_t)(i + 1) : SLOT_NONE;
+    config->length = sector_count * SECTOR_SIZE;
+    config->sector_count = sector_count;
+    config->slot = slot;
+    config->pool = pool;
+    config->next_free = next_free;
+    config->slot_count = slot_count;
+    config->free_count = slot_count;
+    config->free_list = slot_count > 0 ? 0 : SLOT_NONE;
+
+    device->init = sparse_init;
+    device->deinit = sparse_deinit;
+    device->read = sparse_read;
+    device->erase = sparse_erase;
+    device->program = sparse_program;
+    device->trim = sparse_trim;
+    device->sync = sparse_sync;
+    device->size = sparse_size;
+    device->read_size = SECTOR_SIZE;
+    device->erase_size = SECTOR_SIZE;
+    device->program_size = SECTOR_SIZE;
+    device->name = "sparse";
+    device->config = config;
+    device->is_initialized = true;
+    return device;
+}
+
+void blockdevice_sparse_free(blockdevice_t *device) {
+    if (device == NULL)
+        return;
+    blockdevice_sparse_config_t *config = device->config;
+    free(config->pool);
+    free(config->next_free);
+    free(config->slot);
+    free(config);
+    free(device);
+}
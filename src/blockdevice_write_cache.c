@@ -0,0 +1,305 @@
+/* Write-back cache of whole erase sectors in front of the flash
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <string.h>
+#include "blockdevice/write_cache.h"
+#include "mem_arena.h"
+
+#define UNUSED_SECTOR     UINT32_MAX
+#define BLANK_CHECK_SIZE  256  // Bytes read at a time to find out whether a sector is erased
+
+typedef struct {
+    uint32_t sector;    // UNUSED_SECTOR while the buffer is free
+    uint32_t sequence;  // Order of the first write, the oldest sector is flushed first
+    uint32_t dirty;     // Bitmap of the pages programmed into `data`
+    bool erase;         // The sector is erased before the pages are programmed
+    uint8_t *data;
+} cache_entry_t;
+
+typedef struct {
+    blockdevice_t *device;
+    cache_entry_t *entries;
+    size_t entry_count;
+    uint32_t sequence;
+    uint8_t *erased;    // Bitmap of the sectors known to be blank on the device
+    uint8_t *buffers;
+    uint32_t erases;    // Erases sent to the device
+} blockdevice_write_cache_config_t;
+
+
+static bool is_erased(blockdevice_write_cache_config_t *config, uint32_t sector) {
+    return config->erased[sector / 8] & (1 << (sector % 8));
+}
+
+static void set_erased(blockdevice_write_cache_config_t *config, uint32_t sector, bool erased) {
+    if (erased)
+        config->erased[sector / 8] |= (uint8_t)(1 << (sector % 8));
+    else
+        config->erased[sector / 8] &= (uint8_t)~(1 << (sector % 8));
+}
+
+/* Whether the sector at `addr` reads as erased, stopping at the first programmed byte */
+static bool is_blank(blockdevice_t *device, bd_size_t addr) {
+    uint8_t buffer[BLANK_CHECK_SIZE];
+    for (bd_size_t offset = 0; offset < device->erase_size; offset += sizeof(buffer)) {
+        bd_size_t length = device->erase_size - offset < sizeof(buffer) ? device->erase_size - offset : sizeof(buffer);
+        if (device->read(device, buffer, addr + offset, length) != BD_ERROR_OK)
+            return false;
+        for (bd_size_t i = 0; i < length; i++) {
+            if (buffer[i] != 0xFF)
+                return false;
+        }
+    }
+    return true;
+}
+
+static cache_entry_t *find_entry(blockdevice_write_cache_config_t *config, uint32_t sector) {
+    for (size_t i = 0; i < config->entry_count; i++) {
+        if (config->entries[i].sector == sector)
+            return &config->entries[i];
+    }
+    return NULL;
+}
+
+static cache_entry_t *oldest_entry(blockdevice_write_cache_config_t *config) {
+    cache_entry_t *oldest = NULL;
+    for (size_t i = 0; i < config->entry_count; i++) {
+        cache_entry_t *entry = &config->entries[i];
+        if (entry->sector != UNUSED_SECTOR && (oldest == NULL || entry->sequence - oldest->sequence > UINT32_MAX / 2))
+            oldest = entry;
+    }
+    return oldest;
+}
+
+/* Erase the sector of `entry` unless it is blank, then program each run of adjacent pages at once */
+static int flush_entry(blockdevice_write_cache_config_t *config, cache_entry_t *entry) {
+    blockdevice_t *device = config->device;
+    bd_size_t addr = (bd_size_t)entry->sector * device->erase_size;
+    int err = BD_ERROR_OK;
+    if (entry->erase && !is_erased(config, entry->sector)) {
+        if (!is_blank(device, addr)) {
+            err = device->erase(device, addr, device->erase_size);
+            config->erases++;
+        }
+        if (err != BD_ERROR_OK)
+            return err;
+        set_erased(config, entry->sector, true);
+    }
+
+    size_t pages = device->erase_size / device->program_size;
+    size_t page = 0;
+    while (page < pages) {
+        if ((entry->dirty & (1u << page)) == 0) {
+            page++;
+            continue;
+        }
+        size_t end = page;
+        while (end < pages && (entry->dirty & (1u << end)))
+            end++;
+        err = device->program(device, entry->data + page * device->program_size,
+                              addr + page * device->program_size, (end - page) * device->program_size);
+        if (err != BD_ERROR_OK)
+            return err;
+        set_erased(config, entry->sector, false);
+        page = end;
+    }
+    entry->sector = UNUSED_SECTOR;
+    return BD_ERROR_OK;
+}
+
+static int flush_all(blockdevice_write_cache_config_t *config) {
+    cache_entry_t *entry;
+    while ((entry = oldest_entry(config)) != NULL) {
+        int err = flush_entry(config, entry);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return BD_ERROR_OK;
+}
+
+/* The buffer of `sector`, taking a free one or flushing the oldest sector */
+static cache_entry_t *get_entry(blockdevice_write_cache_config_t *config, uint32_t sector, int *err) {
+    cache_entry_t *entry = find_entry(config, sector);
+    if (entry != NULL)
+        return entry;
+    entry = find_entry(config, UNUSED_SECTOR);
+    if (entry == NULL) {
+        entry = oldest_entry(config);
+        *err = flush_entry(config, entry);
+        if (*err != BD_ERROR_OK)
+            return NULL;
+    }
+    entry->sector = sector;
+    entry->sequence = config->sequence++;
+    entry->dirty = 0;
+    entry->erase = false;
+    return entry;
+}
+
+static int write_cache_init(blockdevice_t *device) {
+    device->is_initialized = true;
+    return BD_ERROR_OK;
+}
+
+static int write_cache_deinit(blockdevice_t *device) {
+    blockdevice_write_cache_config_t *config = device->config;
+    int err = flush_all(config);
+    device->is_initialized = false;
+    return err;
+}
+
+static int write_cache_sync(blockdevice_t *device) {
+    blockdevice_write_cache_config_t *config = device->config;
+    int err = flush_all(config);
+    if (err != BD_ERROR_OK)
+        return err;
+    return config->device->sync(config->device);
+}
+
+static int write_cache_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_write_cache_config_t *config = device->config;
+    blockdevice_t *flash = config->device;
+    if (addr + length > flash->size(flash))
+        return BD_ERROR_DEVICE_ERROR;
+    uint8_t *p = (uint8_t *)buffer;
+    while (length > 0) {
+        // Split at the sector end, then at the page end within a cached sector
+        bd_size_t chunk = flash->erase_size - addr % flash->erase_size;
+        cache_entry_t *entry = find_entry(config, (uint32_t)(addr / flash->erase_size));
+        if (entry != NULL)
+            chunk = flash->program_size - addr % flash->program_size;
+        if (chunk > length)
+            chunk = length;
+
+        size_t offset = addr % flash->erase_size;
+        uint32_t page = offset / flash->program_size;
+        if (entry != NULL && (entry->dirty & (1u << page))) {
+            memcpy(p, entry->data + offset, chunk);
+        } else if (entry != NULL && entry->erase) {
+            memset(p, 0xFF, chunk);
+        } else {
+            int err = flash->read(flash, p, addr, chunk);
+            if (err != BD_ERROR_OK)
+                return err;
+        }
+        p += chunk;
+        addr += chunk;
+        length -= chunk;
+    }
+    return BD_ERROR_OK;
+}
+
+static int write_cache_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_write_cache_config_t *config = device->config;
+    blockdevice_t *flash = config->device;
+    if (addr % flash->erase_size || length % flash->erase_size || addr + length > flash->size(flash))
+        return BD_ERROR_DEVICE_ERROR;
+    for (bd_size_t offset = 0; offset < length; offset += flash->erase_size) {
+        uint32_t sector = (uint32_t)((addr + offset) / flash->erase_size);
+        cache_entry_t *entry = find_entry(config, sector);
+        if (is_erased(config, sector)) {
+            if (entry != NULL)
+                entry->sector = UNUSED_SECTOR;  // Drop the pages not programmed yet
+            continue;
+        }
+        int err = BD_ERROR_OK;
+        entry = get_entry(config, sector, &err);
+        if (entry == NULL)
+            return err;
+        entry->erase = true;
+        entry->dirty = 0;
+    }
+    return BD_ERROR_OK;
+}
+
+static int write_cache_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    blockdevice_write_cache_config_t *config = device->config;
+    blockdevice_t *flash = config->device;
+    if (addr % flash->program_size || length % flash->program_size || addr + length > flash->size(flash))
+        return BD_ERROR_DEVICE_ERROR;
+    const uint8_t *p = buffer;
+    for (bd_size_t offset = 0; offset < length; offset += flash->program_size) {
+        uint32_t sector = (uint32_t)((addr + offset) / flash->erase_size);
+        size_t position = (addr + offset) % flash->erase_size;
+        int err = BD_ERROR_OK;
+        cache_entry_t *entry = get_entry(config, sector, &err);
+        if (entry == NULL)
+            return err;
+        memcpy(entry->data + position, p + offset, flash->program_size);
+        entry->dirty |= 1u << (position / flash->program_size);
+    }
+    return BD_ERROR_OK;
+}
+
+static int write_cache_trim(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    blockdevice_write_cache_config_t *config = device->config;
+    return config->device->trim(config->device, addr, length);
+}
+
+static bd_size_t write_cache_size(blockdevice_t *device) {
+    blockdevice_write_cache_config_t *config = device->config;
+    return config->device->size(config->device);
+}
+
+blockdevice_t *blockdevice_write_cache_create(blockdevice_t *device, size_t cache_size) {
+    size_t pages = device->program_size > 0 ? device->erase_size / device->program_size : 0;
+    if (pages == 0 || pages > 32 || device->erase_size % device->program_size != 0)
+        return NULL;  // The dirty pages of a sector must fit one bitmap word
+    size_t entry_count = cache_size / device->erase_size;
+    if (entry_count == 0)
+        entry_count = 1;
+    size_t sectors = device->size(device) / device->erase_size;
+
+    blockdevice_t *cache = mem_arena_alloc(MEM_FLASH_CACHE, sizeof(blockdevice_t));
+    blockdevice_write_cache_config_t *config = mem_arena_alloc(MEM_FLASH_CACHE, sizeof(blockdevice_write_cache_config_t));
+    cache_entry_t *entries = mem_arena_alloc(MEM_FLASH_CACHE, entry_count * sizeof(cache_entry_t));
+    uint8_t *buffers = mem_arena_alloc(MEM_FLASH_CACHE, entry_count * device->erase_size);
+    uint8_t *erased = mem_arena_alloc(MEM_FLASH_CACHE, (sectors + 7) / 8);
+    if (cache == NULL || config == NULL || entries == NULL || buffers == NULL || erased == NULL)
+        return NULL;
+    for (size_t i = 0; i < entry_count; i++) {
+        entries[i].sector = UNUSED_SECTOR;
+        entries[i].data = buffers + i * device->erase_size;
+    }
+    config->device = device;
+    config->entries = entries;
+    config->entry_count = entry_count;
+    config->erased = erased;
+    config->buffers = buffers;
+    config->erases = 0;
+
+    cache->init = write_cache_init;
+    cache->deinit = write_cache_deinit;
+    cache->read = write_cache_read;
+    cache->erase = write_cache_erase;
+    cache->program = write_cache_program;
+    cache->trim = write_cache_trim;
+    cache->sync = write_cache_sync;
+    cache->size = write_cache_size;
+    cache->read_size = device->read_size;
+    cache->erase_size = device->erase_size;
+    cache->program_size = device->program_size;
+    cache->name = "write_cache";
+    cache->config = config;
+    cache->is_initialized = true;
+    return cache;
+}
+
+void blockdevice_write_cache_free(blockdevice_t *device) {
+    if (device == NULL)
+        return;
+    flush_all(device->config);  // The memory stays in the arena
+}
+
+blockdevice_t *blockdevice_write_cache_device(blockdevice_t *device) {
+    blockdevice_write_cache_config_t *config = device->config;
+    return config->device;
+}
+
+uint32_t blockdevice_write_cache_erases(blockdevice_t *device) {
+    blockdevice_write_cache_config_t *config = device->config;
+    return config->erases;
+}
@@ -0,0 +1,175 @@
+/* Output of core 0 on the CDC port, written there by core 1
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <hardware/sync.h>
+#include <pico/stdio/driver.h>
+#include <pico/stdio_usb.h>
+#include <pico/stdlib.h>
+#include <tusb.h>
+#include "console.h"
+
+typedef struct {
+    uint8_t *data;
+    uint32_t size;           // Power of two
+    volatile uint32_t head;  // Advanced by the producer only
+    volatile uint32_t tail;  // Advanced by the consumer only
+} ring_t;
+
+static uint8_t log_data[CONSOLE_LOG_SIZE];
+static uint8_t send_data[CONSOLE_STREAM_SIZE];
+static uint8_t receive_data[CONSOLE_STREAM_SIZE];
+static ring_t log_ring = {log_data, sizeof(log_data), 0, 0};
+static ring_t send_ring = {send_data, sizeof(send_data), 0, 0};        // Core 0 to the port
+static ring_t receive_ring = {receive_data, sizeof(receive_data), 0, 0};  // The port to core 0
+static volatile bool handed_over = false;
+static volatile bool connected = false;
+static volatile uint32_t log_dropped = 0;  // Bytes of log that did not fit, counted by core 0
+static uint32_t log_reported = 0;           // and reported so far by core 1
+
+
+static size_t ring_put(ring_t *ring, const void *data, size_t size) {
+    uint32_t head = ring->head;
+    size_t room = ring->size - (head - ring->tail);
+    if (size > room)
+        size = room;
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++)
+        ring->data[(head + i) & (ring->size - 1)] = p[i];
+    __dmb();  // The bytes are in place before the other core sees the new head
+    ring->head = head + (uint32_t)size;
+    return size;
+}
+
+static size_t ring_get(ring_t *ring, void *data, size_t size) {
+    uint32_t tail = ring->tail;
+    size_t used = ring->head - tail;
+    __dmb();
+    if (size > used)
+        size = used;
+    uint8_t *p = data;
+    for (size_t i = 0; i < size; i++)
+        p[i] = ring->data[(tail + i) & (ring->size - 1)];
+    __dmb();  // The bytes are read before the other core may overwrite them
+    ring->tail = tail + (uint32_t)size;
+    return size;
+}
+
+/* Bytes that can be read in one piece from `*data` */
+static size_t ring_readable(ring_t *ring, uint8_t **data) {
+    uint32_t tail = ring->tail;
+    size_t used = ring->head - tail;
+    __dmb();
+    size_t offset = tail & (ring->size - 1);
+    *data = ring->data + offset;
+    return used < ring->size - offset ? used : ring->size - offset;
+}
+
+/* Bytes that can be written in one piece to `*data` */
+static size_t ring_writable(ring_t *ring, uint8_t **data) {
+    uint32_t head = ring->head;
+    size_t room = ring->size - (head - ring->tail);
+    size_t offset = head & (ring->size - 1);
+    *data = ring->data + offset;
+    return room < ring->size - offset ? room : ring->size - offset;
+}
+
+static void ring_consume(ring_t *ring, size_t size) {
+    __dmb();
+    ring->tail += (uint32_t)size;
+}
+
+static void ring_produce(ring_t *ring, size_t size) {
+    __dmb();
+    ring->head += (uint32_t)size;
+}
+
+static bool is_core1_port(void) {
+    return !handed_over || get_core_num() == 1;
+}
+
+static void console_out_chars(const char *buf, int length) {
+    if (is_core1_port()) {
+        stdio_usb.out_chars(buf, length);
+        return;
+    }
+    size_t n = ring_put(&log_ring, buf, (size_t)length);
+    log_dropped += (uint32_t)((size_t)length - n);
+}
+
+static void console_out_flush(void) {
+    if (is_core1_port() && stdio_usb.out_flush != NULL)
+        stdio_usb.out_flush();
+}
+
+static int console_in_chars(char *buf, int length) {
+    if (!is_core1_port())
+        return PICO_ERROR_NO_DATA;  // The console commands are read by core 1
+    return stdio_usb.in_chars(buf, length);
+}
+
+static stdio_driver_t console_driver = {
+    .out_chars = console_out_chars,
+    .out_flush = console_out_flush,
+    .in_chars = console_in_chars,
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+    .crlf_enabled = PICO_STDIO_DEFAULT_CRLF,
+#endif
+};
+
+void console_init(void) {
+    stdio_set_driver_enabled(&stdio_usb, false);
+    stdio_set_driver_enabled(&console_driver, true);
+}
+
+void console_hand_over(void) {
+    handed_over = true;
+}
+
+void console_task(bool stream) {
+    connected = tud_cdc_connected();
+    uint8_t *data;
+    size_t size = ring_readable(&send_ring, &data);
+    if (size > 0) {
+        ring_consume(&send_ring, tud_cdc_write(data, (uint32_t)size));
+        tud_cdc_write_flush();
+    }
+    if (stream) {
+        size = ring_writable(&receive_ring, &data);
+        if (size > 0 && tud_cdc_available() > 0)
+            ring_produce(&receive_ring, tud_cdc_read(data, (uint32_t)size));
+        return;
+    }
+    if (send_ring.head != send_ring.tail)
+        return;  // The end of a transfer goes out before the log held back meanwhile
+
+    size = ring_readable(&log_ring, &data);
+    if (size > 0) {
+        stdio_usb.out_chars((const char *)data, (int)size);
+        ring_consume(&log_ring, size);
+    }
+    uint32_t dropped = log_dropped;
+    if (dropped != log_reported) {
+        printf("console  # %lu bytes of log dropped\n", (unsigned long)(dropped - log_reported));
+        log_reported = dropped;
+    }
+}
+
+size_t console_stream_read(void *buffer, size_t size) {
+    return ring_get(&receive_ring, buffer, size);
+}
+
+size_t console_stream_write(const void *buffer, size_t size) {
+    return ring_put(&send_ring, buffer, size);
+}
+
+void console_stream_reset(void) {
+    receive_ring.tail = receive_ring.head;
+}
+
+bool console_connected(void) {
+    return connected;
+}
@@ -0,0 +1,56 @@
+/* CRC-32 of IEEE 802.3
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdbool.h>
+#include "crc32.h"
+
+#define CRC32_POLYNOMIAL  0xEDB88320u  // Reflected
+
+/* Slicing-by-8: table[k][i] is the CRC of byte i followed by k zero bytes,
+ * so eight bytes are folded with two word loads and eight lookups
+ */
+static uint32_t table[8][256];
+static bool table_ready = false;
+
+static void build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+    table_ready = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+    if (!table_ready)
+        build_table();
+    const uint8_t *p = data;
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Up to a word boundary, as the Cortex-M0+ faults on unaligned loads
+    while (size > 0 && ((uintptr_t)p & 3) != 0) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 8) {
+        uint32_t low = ((const uint32_t *)p)[0] ^ crc;
+        uint32_t high = ((const uint32_t *)p)[1];
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+              table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^
+              table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+#endif
+    while (size--)
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
@@ -0,0 +1,407 @@
+/* Lightweight FAT12/FAT16 decoder for the RAM disk
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include "fat_decode.h"
+
+#define SECTOR_SIZE         512
+#define DIR_ENTRY_SIZE      32
+#define DIR_MAX_DEPTH       32
+#define WINDOWS_HIDDEN_DIR  "System Volume Information"
+
+#define ATTR_VOLUME_ID      0x08
+#define ATTR_DIRECTORY      0x10
+#define ATTR_LONG_NAME      0x0F
+#define NTRES_LOWER_BASE    0x08
+#define NTRES_LOWER_EXT     0x10
+
+/* Directory being read, one level of the explicit stack of the scan */
+typedef struct {
+    uint32_t cluster;    // Cluster being read, 0 for the FAT12/16 root directory
+    uint32_t index;      // Sectors of the cluster or of the root read so far
+    uint32_t lba;        // Sector being read
+    uint32_t offset;     // Next entry within the sector
+    size_t path_length;  // End of the path of the directory in `scan_t.path`
+    bool entry_dirty;    // The sector was written by the host
+    bool changed;        // An entry or a sector of the directory was written
+    bool ended;          // The end of directory marker was found
+} dir_frame_t;
+
+typedef struct {
+    fat_volume_t *volume;
+    const uint8_t *dirty;
+    uint8_t *pending;
+    fat_touched_cb_t touched;
+    void *context;
+    char path[PATH_MAX + 1];
+    dir_frame_t stack[DIR_MAX_DEPTH + 1];  // The root directory and up to DIR_MAX_DEPTH levels below
+    size_t depth;
+} scan_t;
+
+static uint8_t dir_buffer[SECTOR_SIZE];
+static uint32_t dir_buffer_sector = UINT32_MAX;
+static uint8_t fat_buffer[SECTOR_SIZE * 2];  // A FAT12 entry may straddle two sectors
+static uint32_t fat_buffer_sector = UINT32_MAX;
+static char long_name[256];
+
+static uint16_t load16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool bit_test(const uint8_t *map, uint32_t n) {
+    return map[n / 8] & (1 << (n % 8));
+}
+
+static void bit_set(uint8_t *map, uint32_t n) {
+    map[n / 8] |= (uint8_t)(1 << (n % 8));
+}
+
+static bool read_sector(fat_volume_t *volume, void *buffer, uint32_t lba, uint32_t count) {
+    if (lba + count > volume->device_sectors)
+        return false;
+    blockdevice_t *device = volume->device;
+    return device->read(device, buffer, (bd_size_t)lba * SECTOR_SIZE, (bd_size_t)count * SECTOR_SIZE) == BD_ERROR_OK;
+}
+
+bool fat_volume_open(fat_volume_t *volume, blockdevice_t *device) {
+    memset(volume, 0, sizeof(fat_volume_t));
+    volume->device = device;
+    volume->device_sectors = (uint32_t)(device->size(device) / SECTOR_SIZE);
+    fat_buffer_sector = UINT32_MAX;
+    dir_buffer_sector = UINT32_MAX;
+
+    uint8_t *bpb = dir_buffer;
+    if (device->erase_size != SECTOR_SIZE || !read_sector(volume, bpb, 0, 1))
+        return false;
+    if (load16(bpb + 510) != 0xAA55 || load16(bpb + 11) != SECTOR_SIZE)
+        return false;
+
+    volume->sectors_per_cluster = bpb[13];
+    volume->reserved_sectors = load16(bpb + 14);
+    volume->fat_count = bpb[16];
+    uint32_t root_entries = load16(bpb + 17);
+    uint32_t total_sectors = load16(bpb + 19);
+    if (total_sectors == 0)
+        total_sectors = load32(bpb + 32);
+    volume->fat_sectors = load16(bpb + 22);
+    if (volume->sectors_per_cluster == 0 || volume->fat_count == 0 ||
+        volume->fat_sectors == 0 || root_entries == 0)
+        return false;  // FAT32 or not a FAT volume
+
+    volume->root_sector = volume->reserved_sectors + volume->fat_count * volume->fat_sectors;
+    volume->root_sectors = (root_entries * DIR_ENTRY_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    volume->data_sector = volume->root_sector + volume->root_sectors;
+    if (total_sectors > volume->device_sectors || total_sectors <= volume->data_sector)
+        return false;
+    volume->cluster_count = (total_sectors - volume->data_sector) / volume->sectors_per_cluster;
+    if (volume->cluster_count < 4085)
+        volume->fat_type = 12;
+    else if (volume->cluster_count < 65525)
+        volume->fat_type = 16;
+    else
+        return false;
+    return true;
+}
+
+/* Offset in bytes of the FAT entry of `cluster` from the start of a FAT */
+static uint32_t fat_offset(fat_volume_t *volume, uint32_t cluster) {
+    return volume->fat_type == 12 ? cluster + cluster / 2 : cluster * 2;
+}
+
+static bool fat_next(fat_volume_t *volume, uint32_t cluster, uint32_t *next) {
+    uint32_t offset = fat_offset(volume, cluster);
+    uint32_t sector = volume->reserved_sectors + offset / SECTOR_SIZE;
+    if (sector != fat_buffer_sector) {
+        if (!read_sector(volume, fat_buffer, sector, 2))
+            return false;
+        fat_buffer_sector = sector;
+    }
+    uint16_t value = load16(fat_buffer + offset % SECTOR_SIZE);
+    if (volume->fat_type == 12)
+        *next = (cluster & 1) ? value >> 4 : value & 0x0FFF;
+    else
+        *next = value;
+    return true;
+}
+
+static bool is_end_of_chain(fat_volume_t *volume, uint32_t cluster) {
+    return cluster >= (volume->fat_type == 12 ? 0x0FF8u : 0xFFF8u);
+}
+
+static bool is_valid_cluster(fat_volume_t *volume, uint32_t cluster) {
+    return cluster >= 2 && cluster < volume->cluster_count + 2;
+}
+
+static uint32_t cluster_sector(fat_volume_t *volume, uint32_t cluster) {
+    return volume->data_sector + (cluster - 2) * volume->sectors_per_cluster;
+}
+
+/* Whether a data sector of `cluster` was written
+ *
+ * FAT sectors are not considered: on a small volume a single FAT sector maps
+ * every file. A chain change always comes with a write to the data or the
+ * directory entry of the file.
+ */
+static bool cluster_touched(scan_t *scan, uint32_t cluster, bool mark_pending) {
+    fat_volume_t *volume = scan->volume;
+    bool touched = false;
+    uint32_t lba = cluster_sector(volume, cluster);
+    for (uint32_t i = 0; i < volume->sectors_per_cluster; i++) {
+        if (bit_test(scan->dirty, lba + i)) {
+            touched = true;
+            if (mark_pending)
+                bit_set(scan->pending, lba + i);
+        }
+    }
+    return touched;
+}
+
+/* Walk the cluster chain of a file
+ *
+ * @retval true The chain ends properly and holds at least `size` bytes
+ */
+static bool walk_chain(scan_t *scan, uint32_t first, uint32_t size, bool mark_pending, bool *touched) {
+    fat_volume_t *volume = scan->volume;
+    uint32_t cluster_size = volume->sectors_per_cluster * SECTOR_SIZE;
+    uint32_t needed = (size + cluster_size - 1) / cluster_size;
+    if (first == 0)
+        return needed == 0;
+
+    uint32_t cluster = first;
+    for (uint32_t length = 1; length <= volume->cluster_count; length++) {
+        if (!is_valid_cluster(volume, cluster))
+            return false;
+        *touched |= cluster_touched(scan, cluster, mark_pending);
+        uint32_t next;
+        if (!fat_next(volume, cluster, &next))
+            return false;
+        if (is_end_of_chain(volume, next))
+            return length >= needed;
+        cluster = next;
+    }
+    return false;  // Loop in the chain
+}
+
+/* Next sector of a directory, `cluster` 0 stands for the FAT12/16 root directory */
+static bool next_dir_sector(fat_volume_t *volume, uint32_t *cluster, uint32_t *index, uint32_t *lba) {
+    if (*cluster == 0) {
+        if (*index >= volume->root_sectors)
+            return false;
+        *lba = volume->root_sector + (*index)++;
+        return true;
+    }
+    if (*index == volume->sectors_per_cluster) {
+        uint32_t next;
+        if (!fat_next(volume, *cluster, &next) || !is_valid_cluster(volume, next))
+            return false;
+        *cluster = next;
+        *index = 0;
+    }
+    *lba = cluster_sector(volume, *cluster) + (*index)++;
+    return true;
+}
+
+static void short_name(const uint8_t *entry, char *name) {
+    size_t n = 0;
+    for (size_t i = 0; i < 8 && entry[i] != ' '; i++) {
+        char c = (char)(i == 0 && entry[i] == 0x05 ? 0xE5 : entry[i]);
+        name[n++] = (entry[12] & NTRES_LOWER_BASE) && c >= 'A' && c <= 'Z' ? (char)(c + 32) : c;
+    }
+    if (entry[8] != ' ') {
+        name[n++] = '.';
+        for (size_t i = 8; i < 11 && entry[i] != ' '; i++) {
+            char c = (char)entry[i];
+            name[n++] = (entry[12] & NTRES_LOWER_EXT) && c >= 'A' && c <= 'Z' ? (char)(c + 32) : c;
+        }
+    }
+    name[n] = '\0';
+}
+
+/* Collect the 13 UCS-2 characters of a long file name entry as UTF-8 */
+static void long_name_part(const uint8_t *entry, char *name, size_t *length) {
+    static const uint8_t offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    size_t n = 0;
+    char part[13 * 3];
+    for (size_t i = 0; i < 13; i++) {
+        uint16_t c = load16(entry + offsets[i]);
+        if (c == 0x0000 || c == 0xFFFF)
+            break;
+        if (c < 0x80) {
+            part[n++] = (char)c;
+        } else if (c < 0x800) {
+            part[n++] = (char)(0xC0 | (c >> 6));
+            part[n++] = (char)(0x80 | (c & 0x3F));
+        } else {
+            part[n++] = (char)(0xE0 | (c >> 12));
+            part[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            part[n++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    // Entries are stored last part first, so each part goes in front
+    if (*length + n >= sizeof(long_name))
+        return;
+    memmove(name + n, name, *length + 1);
+    memcpy(name, part, n);
+    *length += n;
+}
+
+/* The directory sector `lba` in `dir_buffer`, which the levels of the scan share */
+static bool read_dir_sector(fat_volume_t *volume, uint32_t lba) {
+    if (lba == dir_buffer_sector)
+        return true;
+    dir_buffer_sector = UINT32_MAX;
+    if (!read_sector(volume, dir_buffer, lba, 1))
+        return false;
+    dir_buffer_sector = lba;
+    return true;
+}
+
+/* Report a file entry of the directory `frame`, or find the subdirectory to scan next
+ *
+ * @param[out] subdirectory  First cluster of the subdirectory, left 0 for none
+ * @retval false The volume is not decodable
+ */
+static bool scan_entry(scan_t *scan, const uint8_t *entry, const dir_frame_t *frame,
+                       uint32_t *subdirectory, size_t *subpath_length) {
+    fat_volume_t *volume = scan->volume;
+    char name[sizeof(long_name)];
+    if (long_name[0] != '\0')
+        strcpy(name, long_name);
+    else
+        short_name(entry, name);
+
+    bool is_directory = entry[11] & ATTR_DIRECTORY;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return true;
+    if (is_directory && (name[0] == '.' || strcmp(name, WINDOWS_HIDDEN_DIR) == 0))
+        return true;
+    size_t path_length = frame->path_length;
+    int n = snprintf(scan->path + path_length, sizeof(scan->path) - path_length, "/%s", name);
+    if (n < 0 || path_length + (size_t)n >= sizeof(scan->path))
+        return true;
+
+    uint32_t first = load16(entry + 26);
+    if (volume->fat_type == 16 && load16(entry + 20) != 0)
+        return false;  // FAT32 style cluster number
+    if (is_directory) {
+        if (scan->depth <= DIR_MAX_DEPTH && is_valid_cluster(volume, first)) {
+            *subdirectory = first;
+            *subpath_length = path_length + (size_t)n;
+        }
+        return true;
+    }
+
+    bool touched = frame->entry_dirty;
+    bool complete = walk_chain(scan, first, load32(entry + 28), false, &touched);
+    if (!touched)
+        return true;
+    if (!complete) {
+        bool ignored = false;
+        walk_chain(scan, first, load32(entry + 28), true, &ignored);
+    }
+    scan->touched(scan->path, complete ? FAT_TOUCHED_FILE : FAT_TOUCHED_INCOMPLETE, scan->context);
+    return true;
+}
+
+/* Walk the directory tree depth first with an explicit stack, no recursion
+ *
+ * A directory is reported after its subdirectories, once all its sectors are read.
+ */
+static bool scan_tree(scan_t *scan) {
+    fat_volume_t *volume = scan->volume;
+    size_t long_name_length = 0;
+    long_name[0] = '\0';
+    scan->stack[0] = (dir_frame_t){.offset = SECTOR_SIZE};
+    scan->depth = 1;
+
+    while (scan->depth > 0) {
+        dir_frame_t *frame = &scan->stack[scan->depth - 1];
+        if (frame->offset >= SECTOR_SIZE) {
+            if (frame->ended || !next_dir_sector(volume, &frame->cluster, &frame->index, &frame->lba)) {
+                if (frame->changed) {
+                    scan->path[frame->path_length] = '\0';
+                    scan->touched(frame->path_length > 0 ? scan->path : "/", FAT_TOUCHED_DIRECTORY,
+                                  scan->context);
+                }
+                scan->depth--;
+                continue;
+            }
+            frame->entry_dirty = bit_test(scan->dirty, frame->lba);
+            frame->changed |= frame->entry_dirty;
+            if (frame->cluster != 0)
+                frame->changed |= cluster_touched(scan, frame->cluster, false);
+            frame->offset = 0;
+        }
+        // The sector buffer may have been reused by a subdirectory
+        if (!read_dir_sector(volume, frame->lba))
+            return false;
+        const uint8_t *entry = dir_buffer + frame->offset;
+        frame->offset += DIR_ENTRY_SIZE;
+
+        if (entry[0] == 0x00) {
+            frame->ended = true;
+            frame->offset = SECTOR_SIZE;
+            continue;
+        }
+        if (entry[0] == 0xE5) {
+            long_name[0] = '\0';
+            long_name_length = 0;
+            continue;
+        }
+        if ((entry[11] & 0x3F) == ATTR_LONG_NAME) {
+            if (entry[0] & 0x40) {
+                long_name[0] = '\0';
+                long_name_length = 0;
+            }
+            long_name_part(entry, long_name, &long_name_length);
+            continue;
+        }
+        if (entry[11] & ATTR_VOLUME_ID) {
+            long_name[0] = '\0';
+            long_name_length = 0;
+            continue;
+        }
+
+        uint32_t subdirectory = 0;
+        size_t subpath_length = 0;
+        if (!scan_entry(scan, entry, frame, &subdirectory, &subpath_length))
+            return false;
+        long_name[0] = '\0';
+        long_name_length = 0;
+        if (subdirectory != 0) {
+            scan->stack[scan->depth++] = (dir_frame_t){
+                .cluster = subdirectory,
+                .offset = SECTOR_SIZE,
+                .path_length = subpath_length,
+            };
+        }
+    }
+    return true;
+}
+
+bool fat_volume_scan(fat_volume_t *volume, const uint8_t *dirty, uint8_t *pending,
+                     fat_touched_cb_t touched, void *context) {
+    for (uint32_t lba = 0; lba < volume->reserved_sectors; lba++) {
+        if (bit_test(dirty, lba))
+            return false;  // Boot sector rewritten, e.g. the host formatted the drive
+    }
+    static scan_t scan;
+    scan.volume = volume;
+    scan.dirty = dirty;
+    scan.pending = pending;
+    scan.touched = touched;
+    scan.context = context;
+    scan.path[0] = '\0';
+    fat_buffer_sector = UINT32_MAX;
+    dir_buffer_sector = UINT32_MAX;
+    memset(pending, 0, (volume->device_sectors + 7) / 8);
+    return scan_tree(&scan);
+}
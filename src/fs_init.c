@@ -1,29 +1,50 @@
 /*
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <hardware/clocks.h>
 #include <hardware/flash.h>
+#include "blockdevice/compressed.h"
 #include "blockdevice/heap.h"
+#include "blockdevice/snapshot.h"
+#include "blockdevice/sparse.h"
 #include "blockdevice/flash.h"
+#include "blockdevice/write_cache.h"
 #include "filesystem/fat.h"
 #include "filesystem/littlefs.h"
 #include "filesystem/vfs.h"
+#include "mem_arena.h"
+#include "metrics.h"
+#include "planner.h"
 
+#ifndef RAM_DISK_SIZE
 #define RAM_DISK_SIZE    (64 * 1024)
+#endif
+#ifndef RAM_DISK_MAX_SIZE
+#define RAM_DISK_MAX_SIZE   (8 * 1024 * 1024)
+#endif
+#define HEAP_RESERVE        (24 * 1024)  // Left for FatFs, the planner, the manifest and the file lists of a commit
+#define SNAPSHOT_POOL_SIZE  (8 * 1024)   // Sectors the host may rewrite while a commit reads the RAM disk, from the arena
+#ifndef FLASH_WRITE_CACHE_SIZE
+#define FLASH_WRITE_CACHE_SIZE  (8 * 1024)  // Flash sectors littlefs writes are gathered in, from the arena, 0 for none
+#endif
 
-blockdevice_t *blockdevice_heap;  // Share to device access in usb_msc.c
+blockdevice_t *blockdevice_heap;  // Share to device access in usb_msc.c, through a snapshot
+blockdevice_t *blockdevice_littlefs;  // Share to the image transfer in main.c
+size_t flash_write_cache_size = FLASH_WRITE_CACHE_SIZE;  // 0 without the cache. Changed by sync_bench to compare
+static filesystem_t *lfs;
 static filesystem_t *fat;
 
 //  USB devices require remounting to incorporate USB host updates
-bool remount_ram_disk(void) {
+bool remount_ram_disk(blockdevice_t *device) {
     int err = fs_unmount("/ram");
     if (err == -1) {
         printf("fs_mount /ram error: %s\n", strerror(errno));
         return false;
     }
-    err = fs_mount("/ram", fat, blockdevice_heap);
+    err = fs_mount("/ram", fat, device);
     if (err == -1) {
         printf("fs_mount /ram error: %s\n", strerror(errno));
         return false;
@@ -31,15 +52,63 @@ bool remount_ram_disk(void) {
     return true;
 }
 
+#if !VIRTUAL_FAT
+/* Heap memory the RAM disk may take once TinyUSB and stdio are initialised
+ *
+ * The snapshot pool comes from the arena, so only what grows later is kept back.
+ */
+static size_t ram_disk_available_memory(void) {
+    size_t available = mem_heap_available(HEAP_RESERVE);
+    return available < RAM_DISK_MAX_SIZE ? available : RAM_DISK_MAX_SIZE;
+}
+#endif
+
 bool fs_init(void) {
-    blockdevice_heap = blockdevice_heap_create(RAM_DISK_SIZE);
+    size_t heap_used = mem_heap_used();
     blockdevice_t *flash = blockdevice_flash_create(PICO_FLASH_SIZE_BYTES - PICO_FS_DEFAULT_SIZE, 0);
+    lfs = filesystem_littlefs_create(500, 16);
+    metrics_track_flash(flash);
+    blockdevice_littlefs = flash_write_cache_size > 0 ? blockdevice_write_cache_create(flash, flash_write_cache_size) : flash;
+    if (blockdevice_littlefs == NULL) {
+        blockdevice_littlefs = flash;
+        flash_write_cache_size = 0;
+    }
 
+    printf("/flash mount ... ");
+    int err = fs_mount("/flash", lfs, blockdevice_littlefs);
+    if (err == -1) {
+        fprintf(stderr, "%s", strerror(errno));
+        return false;
+    }
+    printf("ok\n");
+    mem_heap_charge(MEM_FILESYSTEM, heap_used);
+
+#if !VIRTUAL_FAT  // The virtual FAT volume is generated from /flash without a RAM disk
+    planner_scan("/flash");
+    size_t available = ram_disk_available_memory();
+    heap_used = mem_heap_used();
+#ifdef COMPRESSED_RAM_DISK_SIZE  // Up to RAM_DISK_SIZE bytes of memory hold the larger logical disk
+    size_t disk_size = COMPRESSED_RAM_DISK_SIZE;
+    blockdevice_t *ram_disk = blockdevice_compressed_create(disk_size, available < RAM_DISK_SIZE ? available : RAM_DISK_SIZE);
+#elif defined(SPARSE_RAM_DISK_SIZE)  // Sectors are taken from a pool of up to RAM_DISK_SIZE bytes when written
+    size_t disk_size = SPARSE_RAM_DISK_SIZE;
+    blockdevice_t *ram_disk = blockdevice_sparse_create(disk_size, available < RAM_DISK_SIZE ? available : RAM_DISK_SIZE);
+#else
+    size_t disk_size = planner_disk_size(RAM_DISK_SIZE, available);
+    blockdevice_t *ram_disk = blockdevice_heap_create(disk_size);
+#endif
+    mem_heap_charge(MEM_RAM_DISK, heap_used);
+    blockdevice_heap = ram_disk ? blockdevice_snapshot_create(ram_disk, SNAPSHOT_POOL_SIZE) : NULL;
+    if (blockdevice_heap == NULL) {
+        fprintf(stderr, "RAM disk of %lu bytes: out of memory\n", (unsigned long)disk_size);
+        return false;
+    }
+    planner_select(disk_size);
+    heap_used = mem_heap_used();
     fat = filesystem_fat_create();
-    filesystem_t *lfs = filesystem_littlefs_create(500, 16);
 
     printf("/ram format FAT ... ");
-    int err = fs_format(fat, blockdevice_heap);
+    err = fs_format(fat, blockdevice_heap);
     if (err == -1) {
         fprintf(stderr, "%s", strerror(errno));
         return false;
@@ -52,15 +121,42 @@ bool fs_init(void) {
         fprintf(stderr, "%s", strerror(errno));
         return false;
     }
+    mem_heap_charge(MEM_FILESYSTEM, heap_used);
     printf("ok\n");
+#endif
 
-    printf("/flash mount ... ");
-    err = fs_mount("/flash", lfs, flash);
+    return true;
+}
+
+/* Mount /flash again after its blocks were rewritten beneath littlefs, and
+ * give /ram an empty FAT for `sync_flash_to_ram()` to fill with the new tree
+ */
+bool fs_reload(void) {
+    printf("/flash remount ... ");
+    fs_unmount("/flash");
+    int err = fs_mount("/flash", lfs, blockdevice_littlefs);
     if (err == -1) {
-        fprintf(stderr, "%s", strerror(errno));
+        fprintf(stderr, "%s\n", strerror(errno));
         return false;
     }
     printf("ok\n");
 
+#if !VIRTUAL_FAT
+    planner_scan("/flash");
+    planner_select(blockdevice_heap->size(blockdevice_heap));
+    fs_unmount("/ram");
+    printf("/ram format FAT ... ");
+    err = fs_format(fat, blockdevice_heap);
+    if (err == -1) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        return false;
+    }
+    printf("ok\n");
+    err = fs_mount("/ram", fat, blockdevice_heap);
+    if (err == -1) {
+        fprintf(stderr, "/ram mount: %s\n", strerror(errno));
+        return false;
+    }
+#endif
     return true;
 }
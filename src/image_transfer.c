@@ -0,0 +1,247 @@
+/* Raw image transfer of the littlefs region over a byte stream
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+#include "crc32.h"
+#include "image_transfer.h"
+#include "mem_arena.h"
+
+#define COMPARE_CHUNK  256  // Bytes of flash read at a time to find the sectors that differ
+#define LITTLEFS_MAGIC_OFFSET  8  // After the revision count and the tag of the superblock entry
+
+static uint8_t *sector_buffer;     // One flash sector, taken once from the arena
+static uint32_t sector_buffer_size;
+
+uint32_t image_get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void image_put_le32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+static bool read_exact(const image_stream_t *stream, uint8_t *buffer, size_t size, uint32_t timeout_ms) {
+    while (size > 0) {
+        size_t n = stream->read(stream->context, buffer, size, timeout_ms);
+        if (n == 0)
+            return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool image_send_frame(const image_stream_t *stream, uint8_t type, uint32_t offset, const void *payload, uint32_t length) {
+    uint8_t header[IMAGE_FRAME_HEADER_SIZE] = {'P', 'I', type, 0};
+    uint8_t trailer[IMAGE_FRAME_TRAILER_SIZE];
+    image_put_le32(header + 4, offset);
+    image_put_le32(header + 8, length);
+    uint32_t crc = crc32_update(CRC32_INIT, header, sizeof(header));
+    crc = crc32_update(crc, payload, length);
+    image_put_le32(trailer, crc);
+    return stream->write(stream->context, header, sizeof(header)) &&
+           (length == 0 || stream->write(stream->context, payload, length)) &&
+           stream->write(stream->context, trailer, sizeof(trailer));
+}
+
+image_receive_t image_receive_frame(const image_stream_t *stream, image_frame_t *frame,
+                                    uint8_t *payload, size_t capacity, uint32_t timeout_ms) {
+    uint8_t header[IMAGE_FRAME_HEADER_SIZE];
+    size_t matched = 0;
+    while (matched < 2) {  // Console output or the rest of a broken frame may come first
+        uint8_t c;
+        if (stream->read(stream->context, &c, 1, timeout_ms) == 0)
+            return IMAGE_RECEIVE_TIMEOUT;
+        if (c == "PI"[matched])
+            header[matched++] = c;
+        else
+            matched = c == 'P' ? 1 : 0;
+    }
+    if (!read_exact(stream, header + 2, sizeof(header) - 2, timeout_ms))
+        return IMAGE_RECEIVE_TIMEOUT;
+    frame->type = header[2];
+    frame->flags = header[3];
+    frame->offset = image_get_le32(header + 4);
+    frame->length = image_get_le32(header + 8);
+    if (frame->length > capacity)
+        return IMAGE_RECEIVE_CORRUPT;
+
+    uint8_t trailer[IMAGE_FRAME_TRAILER_SIZE];
+    if (!read_exact(stream, payload, frame->length, timeout_ms) ||
+        !read_exact(stream, trailer, sizeof(trailer), timeout_ms))
+        return IMAGE_RECEIVE_TIMEOUT;
+    uint32_t crc = crc32_update(CRC32_INIT, header, sizeof(header));
+    crc = crc32_update(crc, payload, frame->length);
+    return crc == image_get_le32(trailer) ? IMAGE_RECEIVE_OK : IMAGE_RECEIVE_CORRUPT;
+}
+
+static bool send_info(blockdevice_t *flash, const image_stream_t *stream) {
+    uint8_t info[8];
+    image_put_le32(info, (uint32_t)flash->size(flash));
+    image_put_le32(info + 4, (uint32_t)flash->erase_size);
+    return image_send_frame(stream, IMAGE_FRAME_INFO, 0, info, sizeof(info));
+}
+
+static void send_error(const image_stream_t *stream, image_stats_t *stats, const char *message) {
+    stats->error = message;
+    image_send_frame(stream, IMAGE_FRAME_ERROR, 0, message, (uint32_t)strlen(message));
+}
+
+bool image_transfer_reserve(uint32_t sector_size) {
+    if (sector_buffer == NULL) {
+        sector_buffer = mem_arena_alloc(MEM_IMAGE, sector_size);
+        sector_buffer_size = sector_buffer != NULL ? sector_size : 0;
+    }
+    return sector_buffer != NULL && sector_size <= sector_buffer_size;
+}
+
+bool image_export(blockdevice_t *flash, const image_stream_t *stream, image_stats_t *stats) {
+    uint32_t size = (uint32_t)flash->size(flash);
+    uint32_t sector_size = (uint32_t)flash->erase_size;
+    memset(stats, 0, sizeof(*stats));
+    if (!image_transfer_reserve(sector_size)) {
+        send_error(stream, stats, "out of memory");
+        return false;
+    }
+    uint8_t *buffer = sector_buffer;
+    if (!send_info(flash, stream))
+        return false;
+
+    uint32_t next = 0;   // Offset of the next frame to send
+    uint32_t acked = 0;  // Offset the client has received in order
+    bool result = false;
+    while (acked < size) {
+        while (next < size && next - acked < IMAGE_WINDOW * sector_size) {
+            if (flash->read(flash, buffer, next, sector_size) != BD_ERROR_OK) {
+                send_error(stream, stats, "flash read error");
+                goto done;
+            }
+            if (!image_send_frame(stream, IMAGE_FRAME_DATA, next, buffer, sector_size))
+                goto done;
+            next += sector_size;
+        }
+
+        image_frame_t frame;
+        image_receive_t received = image_receive_frame(stream, &frame, NULL, 0, IMAGE_TIMEOUT_MS);
+        if (received == IMAGE_RECEIVE_TIMEOUT) {
+            stats->error = "no reply from the client";
+            goto done;
+        }
+        if (received == IMAGE_RECEIVE_CORRUPT)
+            continue;
+        if (frame.type == IMAGE_FRAME_ACK && frame.offset > acked && frame.offset <= next) {
+            acked = frame.offset;
+        } else if (frame.type == IMAGE_FRAME_NAK && frame.offset >= acked && frame.offset < next &&
+                   frame.offset % sector_size == 0) {
+            stats->retries += (next - frame.offset) / sector_size;
+            next = frame.offset;
+        } else if (frame.type == IMAGE_FRAME_ERROR) {
+            stats->error = "aborted by the client";
+            goto done;
+        }
+    }
+    stats->bytes = size;
+    result = image_send_frame(stream, IMAGE_FRAME_END, size, NULL, 0);
+done:
+    return result;
+}
+
+/* Whether the sector of flash at `offset` holds other bytes than `data` */
+static bool sector_differs(blockdevice_t *flash, uint32_t offset, const uint8_t *data, uint32_t sector_size) {
+    uint8_t current[COMPARE_CHUNK];
+    for (uint32_t i = 0; i < sector_size; i += sizeof(current)) {
+        uint32_t length = sector_size - i < sizeof(current) ? sector_size - i : sizeof(current);
+        if (flash->read(flash, current, offset + i, length) != BD_ERROR_OK ||
+            memcmp(current, data + i, length) != 0)
+            return true;
+    }
+    return false;
+}
+
+bool image_import(blockdevice_t *flash, const image_stream_t *stream,
+                  bool (*reload)(const image_stats_t *stats), image_stats_t *stats) {
+    uint32_t size = (uint32_t)flash->size(flash);
+    uint32_t sector_size = (uint32_t)flash->erase_size;
+    memset(stats, 0, sizeof(*stats));
+    if (!image_transfer_reserve(sector_size)) {
+        send_error(stream, stats, "out of memory");
+        return false;
+    }
+    uint8_t *buffer = sector_buffer;
+    if (!send_info(flash, stream))
+        return false;
+
+    bool result = false;
+    while (1) {
+        image_frame_t frame;
+        image_receive_t received = image_receive_frame(stream, &frame, buffer, sector_size, IMAGE_TIMEOUT_MS);
+        if (received == IMAGE_RECEIVE_TIMEOUT) {
+            stats->error = "no frame from the client";
+            break;
+        }
+        if (received == IMAGE_RECEIVE_CORRUPT) {
+            stats->retries++;
+            if (!image_send_frame(stream, IMAGE_FRAME_NAK, 0, NULL, 0))
+                break;
+            continue;
+        }
+        if (frame.type == IMAGE_FRAME_END) {
+            if (stats->bytes != size) {
+                send_error(stream, stats, "image incomplete");
+                break;
+            }
+            if (flash->sync(flash) != BD_ERROR_OK) {
+                send_error(stream, stats, "flash write error");
+                break;
+            }
+            if (reload != NULL && !reload(stats)) {
+                send_error(stream, stats, "littlefs does not mount");
+                break;
+            }
+            uint8_t counts[8];
+            image_put_le32(counts, stats->sectors_written);
+            image_put_le32(counts + 4, stats->sectors_skipped);
+            result = image_send_frame(stream, IMAGE_FRAME_END, stats->bytes, counts, sizeof(counts));
+            break;
+        }
+        if (frame.type != IMAGE_FRAME_DATA) {
+            stats->error = "unexpected frame";
+            break;
+        }
+        if (frame.offset % sector_size != 0 || frame.length != sector_size || frame.offset > size - sector_size) {
+            send_error(stream, stats, "frame outside of the littlefs region");
+            break;
+        }
+        // In order, so that the superblock is checked before anything is erased
+        if (frame.offset > stats->bytes) {
+            send_error(stream, stats, "frame out of order");
+            break;
+        }
+        if (frame.offset == 0 &&
+            memcmp(buffer + LITTLEFS_MAGIC_OFFSET, "littlefs", 8) != 0) {
+            send_error(stream, stats, "not a littlefs image");
+            break;
+        }
+
+        if (sector_differs(flash, frame.offset, buffer, sector_size)) {
+            if (flash->erase(flash, frame.offset, sector_size) != BD_ERROR_OK ||
+                flash->program(flash, buffer, frame.offset, sector_size) != BD_ERROR_OK) {
+                send_error(stream, stats, "flash write error");
+                break;
+            }
+            stats->sectors_written++;
+        } else {
+            stats->sectors_skipped++;
+        }
+        if (frame.offset == stats->bytes)  // Not a frame sent again after a lost ACK
+            stats->bytes += sector_size;
+        if (!image_send_frame(stream, IMAGE_FRAME_ACK, frame.offset, NULL, 0))
+            break;
+    }
+    return result;
+}
@@ -3,159 +3,268 @@
  * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <dirent.h>
-#include <errno.h>
+#include <hardware/irq.h>
 #include <hardware/structs/timer.h>
 #include <stdio.h>
 #include <string.h>
+#include <pico/multicore.h>
 #include <pico/stdlib.h>
 #include <tusb.h>
+#include "blockdevice/snapshot.h"
+#include "console.h"
 #include "filesystem/vfs.h"
+#include "image_transfer.h"
+#include "mem_arena.h"
+#include "metrics.h"
+#include "pre_erase.h"
+#include "scsi_trace.h"
 #include "ssi_enable.h"
+#include "sync.h"
+#include "vfat.h"
 
-#define SRC_PREFIX          "/flash"
-#define DIST_PREFIX         "/ram"
-#define WINDOWS_HIDDEN_DIR  "System Volume Information"
 #define USB_HOST_RECOGNISE_TIME   (250) // Time required for the USB host to recognise the change. Approx. 250 ms min
+#define CONSOLE_LINE_MAX          (32)
 
-static uint8_t copy_buffer[512] = {0};  // Buffer used for file copying. This location because we want to reduce memory
-extern bool is_usb_write_access(void);  // from usb_msc.c
-extern bool remount_ram_disk(void);     // from fs_init.c
+// Commit requests sent from the USB stack on core 1 to the sync engine on core 0
+#define COMMIT_REQUEST_PARTIAL    (1u << 0)  // The host is still writing; commit the complete files
+#define COMMIT_REQUEST_FORCE      (1u << 1)  // The host stopped writing
+#define COMMIT_REQUEST_REPLY      (1u << 2)  // Core 1 waits for the result of the commit
+#define IMAGE_REQUEST_EXPORT      (1u << 3)  // Send the littlefs region over the CDC port
+#define IMAGE_REQUEST_IMPORT      (1u << 4)  // Receive the littlefs region, then reload /flash and /ram
 
+#ifndef PRE_ERASE
+#define PRE_ERASE   1  // Erase free flash blocks between commits
+#endif
 
-static void create_directory(const char *path) {
-    printf("mkdir %s  # ", path);
-    int err = mkdir(path, 0777);
-    if (err == -1 && errno != EEXIST) {
-        fprintf(stderr, "%s", strerror(errno));
-        return;
-    }
-    printf("ok\n");
-}
+extern bool usb_msc_flush_due(bool *force);     // from usb_msc.c
+extern bool is_usb_msc_dirty(void);             // from usb_msc.c
+extern void usb_msc_init(void);                 // from usb_msc.c
+extern uint8_t *usb_msc_take_dirty_sectors(void);  // from usb_msc.c
+extern void usb_msc_clear_dirty_sectors(void);  // from usb_msc.c
+extern void usb_msc_dump_trace(FILE *stream);   // from usb_msc.c
+extern void usb_msc_set_medium_loading(bool loading);  // from usb_msc.c
+extern bool remount_ram_disk(blockdevice_t *device);  // from fs_init.c
+extern bool fs_reload(void);                    // from fs_init.c
+extern blockdevice_t *blockdevice_heap;         // from fs_init.c
+extern blockdevice_t *blockdevice_littlefs;     // from fs_init.c
+extern size_t flash_write_cache_size;           // from fs_init.c
 
-static void file_copy(const char *dist, const char *src) {
-    printf("cp %s %s  # ", src, dist);
+volatile bool image_transfer_active = false;  // The CDC port carries image frames, not the console. Shared with usb_msc.c
+static bool flash_failed = false;  // The littlefs region holds part of an import; nothing may commit to it
+static bool flash_reloaded = false;  // The last import mounted a new littlefs
 
-    FILE *in = fopen(src, "rb");
-    if (in == NULL) {
-        printf("fopen: %s", strerror(errno));
-        return;
-    }
-    FILE *out = fopen(dist, "wb");
-    if (out == NULL) {
-        printf("fopen: %s", strerror(errno));
-        fclose(in);
-        return;
-    }
 
-    while (1) {
-        size_t read_size = fread(copy_buffer, 1, sizeof(copy_buffer), in);
-        if (read_size == 0) {
-            if (feof(in))
-                break;
-            fprintf(stderr, "fread: %s", strerror(errno));
-            break;
-        }
-        size_t write_size = fwrite(copy_buffer, 1, read_size, out);
-        if (write_size != read_size) {
-            fprintf(stderr, "fwrite: %s", strerror(errno));
-            break;
+/* Commit the files touched by the host
+ *
+ * The commit reads a snapshot of the RAM disk, so the host keeps writing to it
+ * through core 1 meanwhile. Without `force`, files whose directory entry or
+ * cluster chain is not complete yet are left for a later call.
+ */
+static bool commit_host_writes(bool force) {
+    if (flash_failed)
+        return false;
+    if (!is_usb_msc_dirty())
+        return true;
+    uint64_t start = metrics_now_us();
+    uint8_t *dirty = usb_msc_take_dirty_sectors();  // Before the freeze, so later writes stay dirty
+    blockdevice_snapshot_freeze(blockdevice_heap);
+    blockdevice_t *view = blockdevice_snapshot_view(blockdevice_heap);
+    bool result = remount_ram_disk(view);  // Reflect updates from the host
+    if (result) {
+        if (dirty == NULL || !sync_touched_to_flash(view, dirty, force)) {
+            sync_ram_to_flash();
+            usb_msc_clear_dirty_sectors();
         }
     }
-    fclose(out);
-    fclose(in);
+    blockdevice_snapshot_release(blockdevice_heap);
+    metrics_record(METRIC_SYNC, start);
+    return result;
+}
 
-    printf("ok\n");
+/* Commit everything the host has written and wait until it is on littlefs
+ *
+ * Called on core 1 by the SCSI commands that make the data durable.
+ */
+bool commit_host_writes_now(void) {
+    multicore_fifo_push_blocking(COMMIT_REQUEST_FORCE | COMMIT_REQUEST_REPLY);
+    return multicore_fifo_pop_blocking() != 0;
 }
 
-static void directory_file_copy(const char *src, const char *dist) {
-    DIR *dir = opendir(src);
-    if (dir == NULL) {
-        fprintf(stderr, "opendir %s: %s", src, strerror(errno));
-        return;
+/* Byte stream of the image transfer on the CDC port
+ *
+ * Core 1 moves the bytes between the port and the console rings. With the
+ * virtual FAT volume there is no second core, so the USB stack is run from
+ * here while waiting.
+ */
+static size_t cdc_read(void *context, void *buffer, size_t size, uint32_t timeout_ms) {
+    (void)context;
+    uint64_t deadline = time_us_64() + (uint64_t)timeout_ms * 1000;
+    while (1) {
+#if VIRTUAL_FAT
+        tud_task();
+        size_t n = tud_cdc_read(buffer, (uint32_t)size);
+#else
+        size_t n = console_stream_read(buffer, size);
+#endif
+        if (n > 0)
+            return n;
+        if (time_us_64() > deadline)
+            return 0;
     }
-    char src_path[PATH_MAX + 2] = {0};
-    char dist_path[PATH_MAX + 2] = {0};
-
-    struct dirent *ent = NULL;
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_DIR && (strcmp(ent->d_name, ".") == 0 ||
-                                      strcmp(ent->d_name, "..") == 0)) {
-            continue;
-        } else if (ent->d_type == DT_DIR && ent->d_name[0] == '.') {
-            continue;
-        } else if (ent->d_type == DT_DIR && strcmp(ent->d_name, WINDOWS_HIDDEN_DIR) == 0) {
-            continue;
-        } else if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
-            snprintf(src_path, sizeof(src_path) - 1, "%s/%s", src, ent->d_name);
-            snprintf(dist_path, sizeof(dist_path) - 1, "%s/%s", dist, ent->d_name);
-            if (ent->d_type == DT_DIR) {
-                create_directory(dist_path);
-                directory_file_copy(src_path, dist_path);
-            } else {
-                file_copy(dist_path, src_path);
-            }
+}
+
+static bool cdc_write(void *context, const void *buffer, size_t size) {
+    (void)context;
+    const uint8_t *p = buffer;
+    uint64_t deadline = time_us_64() + (uint64_t)IMAGE_TIMEOUT_MS * 1000;
+    while (size > 0) {
+#if VIRTUAL_FAT
+        tud_task();
+        size_t n = tud_cdc_write(p, (uint32_t)size);
+#else
+        size_t n = console_stream_write(p, size);
+#endif
+        if (n > 0) {
+            p += n;
+            size -= n;
+            deadline = time_us_64() + (uint64_t)IMAGE_TIMEOUT_MS * 1000;
+        } else {
+#if VIRTUAL_FAT
+            tud_cdc_write_flush();  // The host reads at its own pace
+            bool connected = tud_cdc_connected();
+#else
+            bool connected = console_connected();
+#endif
+            if (!connected || time_us_64() > deadline)
+                return false;
         }
     }
-    int err = closedir(dir);
-    if (err == -1) {
-        fprintf(stderr, "closedir: %s", strerror(errno));
-    }
+#if VIRTUAL_FAT
+    tud_cdc_write_flush();
+#endif
+    return true;
+}
+
+/* Mount /flash on the imported region, before the client is told the import is done */
+static bool reload_flash(const image_stats_t *stats) {
+    if (stats->sectors_written == 0 && !flash_failed)
+        return true;  // littlefs is unchanged beneath its mount
+    flash_reloaded = fs_reload();
+    flash_failed = !flash_reloaded;
+    return flash_reloaded;
 }
 
-static void unlink_if_needed(const char *src, const char *dist) {
-    struct stat finfo;
-    int err = stat(dist, &finfo);
-    if (err == -1) {
-        printf("unlink %s  # ", src);
-        err = unlink(src);
-        if (err == -1) {
-            fprintf(stderr, "%s", strerror(errno));
-            return;
+/* Export or import the raw littlefs region, on core 0 which owns the flash
+ *
+ * An import that changed any sector is followed by a fresh copy of the new
+ * littlefs tree to the RAM disk, while the host is told the medium is loading.
+ * An import that wrote sectors but failed leaves the medium not ready and
+ * refuses every commit, until an import succeeds.
+ */
+static void transfer_image(uint32_t request) {
+    image_stream_t stream = {cdc_read, cdc_write, NULL};
+    image_stats_t stats;
+    uint64_t start = metrics_now_us();
+    bool result;
+    console_stream_reset();
+    if (request & IMAGE_REQUEST_EXPORT) {
+        result = image_export(blockdevice_littlefs, &stream, &stats);
+    } else {
+        usb_msc_set_medium_loading(true);
+        flash_reloaded = false;
+        result = image_import(blockdevice_littlefs, &stream, reload_flash, &stats);
+        if (stats.sectors_written > 0 && !flash_reloaded)
+            flash_failed = true;  // Part of the new image lies over the former littlefs
+        if (flash_reloaded) {
+            sync_flash_to_ram();
+            usb_msc_take_dirty_sectors();  // Writes of the host to the former volume
+            usb_msc_clear_dirty_sectors();
         }
-        printf("ok\n");
+        if (!flash_failed)
+            usb_msc_set_medium_loading(false);
     }
+    image_transfer_active = false;
+    printf("image %s  # %lu bytes in %lu ms, %lu written, %lu skipped, %lu retries, %s\n",
+           request & IMAGE_REQUEST_EXPORT ? "export" : "import", (unsigned long)stats.bytes,
+           (unsigned long)((metrics_now_us() - start) / 1000), (unsigned long)stats.sectors_written,
+           (unsigned long)stats.sectors_skipped, (unsigned long)stats.retries,
+           result ? "ok" : stats.error != NULL ? stats.error : "connection lost");
+    if (flash_failed)
+        fprintf(stderr, "image import: the littlefs region is incomplete, the drive stays not ready until an import succeeds\n");
 }
 
-static void directory_file_delete(const char *src, const char *dist) {
-    DIR *dir = opendir(src);
-    if (dir == NULL) {
-        fprintf(stderr, "opendir %s: %s", src, strerror(errno));
-        return;
-    }
+/* Commands typed on the USB serial port
+ *
+ * `metrics` prints the telemetry as one JSON line, `metrics reset` clears it.
+ * `memory` prints the memory budget report, also printed at boot.
+ * `trace` prints the SCSI commands recorded, `trace clear` forgets them.
+ * `image export` and `image import` hand the port over to `host/image_client`.
+ *
+ * @return Request for core 0, or 0
+ */
+static uint32_t serve_console(void) {
+    static char line[CONSOLE_LINE_MAX];
+    static size_t length = 0;
 
-    struct dirent *ent = NULL;
-    char src_path[PATH_MAX + 3] = {0};
-    char dist_path[PATH_MAX + 3] = {0};
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_DIR && (strcmp(ent->d_name, ".") == 0 ||
-                                      strcmp(ent->d_name, "..") == 0)) {
-            continue;
-        } else if (ent->d_type == DT_DIR && ent->d_name[0] == '.') {
-            continue;
-        } else if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
-            snprintf(src_path, sizeof(src_path) - 1, "%s/%s", src, ent->d_name);
-            snprintf(dist_path, sizeof(dist_path) - 1, "%s/%s", dist, ent->d_name);
-            if (ent->d_type == DT_DIR)
-                directory_file_delete(src_path, dist_path);
-            unlink_if_needed(src_path, dist_path);
-        }
+    int c = getchar_timeout_us(0);
+    if (c == PICO_ERROR_TIMEOUT)
+        return 0;
+    if (c != '\r' && c != '\n') {
+        if (length < sizeof(line) - 1)
+            line[length++] = (char)c;
+        return 0;
     }
-    int err = closedir(dir);
-    if (err == -1) {
-        fprintf(stderr, "closedir: %s", strerror(errno));
+    line[length] = '\0';
+    length = 0;
+    if (strcmp(line, "image export") == 0) {
+        image_transfer_active = true;
+        return IMAGE_REQUEST_EXPORT;
     }
+    if (strcmp(line, "image import") == 0) {
+#if VIRTUAL_FAT
+        printf("image import  # not with the virtual FAT volume\n");
+        return 0;
+#endif
+        image_transfer_active = true;
+        return IMAGE_REQUEST_IMPORT;
+    }
+    if (strcmp(line, "metrics") == 0)
+        metrics_dump(stdout);
+    else if (strcmp(line, "metrics reset") == 0)
+        metrics_reset();
+    else if (strcmp(line, "memory") == 0)
+        mem_report(stdout);
+    else if (strcmp(line, "trace") == 0)
+        usb_msc_dump_trace(stdout);
+    else if (strcmp(line, "trace clear") == 0)
+        scsi_trace_clear();
+    else if (line[0] != '\0')
+        printf("unknown command: %s\n", line);
+    return 0;
 }
 
-static bool is_end_of_usb_msc_write(void) {
-    static bool last_access = false;
-    bool usb_write = is_usb_write_access();
-    bool result = false;
-    if (last_access != usb_write && !usb_write) {
-        result = true;
+/* USB stack on core 1, which keeps answering the host while core 0 writes to flash */
+static void usb_task(void) {
+    irq_set_enabled(USBCTRL_IRQ, true);
+
+    uint32_t request = 0;
+    uint64_t last = metrics_now_us();
+    while (1) {
+        tud_task();
+        metrics_record(METRIC_USB_GAP, last);
+        last = metrics_now_us();
+        console_task(image_transfer_active);
+        if (request && multicore_fifo_wready()) {  // Otherwise merged into the next request
+            multicore_fifo_push_blocking(request);
+            request = 0;
+        }
+        if (image_transfer_active)
+            continue;  // The CDC port carries the frames of core 0, and no log line may enter them
+        request |= serve_console();
+        bool force;
+        if (usb_msc_flush_due(&force))
+            request |= force ? COMMIT_REQUEST_FORCE : COMMIT_REQUEST_PARTIAL;
     }
-    last_access = usb_write;
-    return result;
 }
 
 static void reconnect_usb_for_host(void) {
@@ -170,6 +279,7 @@ static void reconnect_usb_for_host(void) {
 int main(void) {
     tud_init(BOARD_TUD_RHPORT);
     stdio_init_all();
+    console_init();
     reconnect_usb_for_host();
 
     ssi_enable();
@@ -177,16 +287,47 @@ int main(void) {
         fprintf(stderr, "File system initialize failure\n");
         return -1;
     }
+    image_transfer_reserve((uint32_t)blockdevice_littlefs->erase_size);  // Taken on first use if this fails
+
+#if VIRTUAL_FAT
+    if (!vfat_build(SYNC_FLASH_PREFIX)) {
+        fprintf(stderr, "Virtual FAT build failure\n");
+        return -1;
+    }
+    mem_report(stdout);
+    printf("USB MSC start\n");
+    while (1) {
+        tud_task();
+        uint32_t request = serve_console();
+        if (request)
+            transfer_image(request);
+    }
+#endif
 
-    directory_file_copy("/flash", "/ram");
+    uint64_t start = metrics_now_us();
+    sync_flash_to_ram();
+    metrics_add(METRIC_BOOT_COPY_US, (uint32_t)(metrics_now_us() - start));
+    usb_msc_init();
+    mem_report(stdout);
     printf("USB MSC start\n");
+    irq_set_enabled(USBCTRL_IRQ, false);  // The USB interrupt is taken by core 1 from here on
+    console_hand_over();  // and so is the CDC port
+    multicore_launch_core1(usb_task);
+    // The erased blocks are remembered by the write cache, and must be found again after every write
+    bool pre_erase = PRE_ERASE && flash_write_cache_size > 0;
+    bool erasing = pre_erase && pre_erase_scan(blockdevice_littlefs);
     while (1) {
-         if (is_end_of_usb_msc_write()) {
-             if (!remount_ram_disk())  // Reflect updates from the host
-                 continue;
-             directory_file_copy("/ram", "/flash");
-             directory_file_delete("/flash", "/ram");
-         }
-         tud_task();
+        // One block at a time, so a request waits for one sector erase at most
+        while (erasing && !multicore_fifo_rvalid())
+            erasing = pre_erase_step();
+        uint32_t request = multicore_fifo_pop_blocking();
+        while (multicore_fifo_rvalid())
+            request |= multicore_fifo_pop_blocking();
+        bool result = commit_host_writes(request & COMMIT_REQUEST_FORCE);
+        if (request & COMMIT_REQUEST_REPLY)
+            multicore_fifo_push_blocking(result);
+        if (request & (IMAGE_REQUEST_EXPORT | IMAGE_REQUEST_IMPORT))
+            transfer_image(request);
+        erasing = pre_erase && !flash_failed && pre_erase_scan(blockdevice_littlefs);
     }
 }
@@ -0,0 +1,305 @@
+/* Per-file manifest of the littlefs contents
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesystem/vfs.h"
+#include "manifest.h"
+
+#define MANIFEST_VERSION    1
+#define MANIFEST_SEEN       0x01
+#define MANIFEST_DIRTY      0x02
+#define INDEX_MIN_SIZE      64
+
+enum {
+    RECORD_PUT = 1,
+    RECORD_DELETE = 2,
+};
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+} manifest_header_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t path_length;
+    uint32_t size;
+    uint32_t hash;
+} manifest_record_t;
+
+static const char manifest_magic[4] = {'P', 'D', 'S', 'M'};
+
+uint32_t manifest_hash(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t index_home(const manifest_t *manifest, const char *path) {
+    return manifest_hash(MANIFEST_HASH_INIT, path, strlen(path)) & (manifest->index_size - 1);
+}
+
+/* Slot holding `path`, or the empty slot where it belongs */
+static size_t index_slot(const manifest_t *manifest, const char *path) {
+    size_t mask = manifest->index_size - 1;
+    size_t slot = index_home(manifest, path);
+    while (manifest->index[slot] != 0 && strcmp(manifest->entries[manifest->index[slot] - 1].path, path) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static bool grow_index(manifest_t *manifest) {
+    size_t size = manifest->index_size ? manifest->index_size * 2 : INDEX_MIN_SIZE;
+    uint32_t *index = calloc(size, sizeof(uint32_t));
+    if (index == NULL)
+        return false;
+    free(manifest->index);
+    manifest->index = index;
+    manifest->index_size = size;
+    for (size_t i = 0; i < manifest->count; i++)
+        index[index_slot(manifest, manifest->entries[i].path)] = (uint32_t)i + 1;
+    return true;
+}
+
+/* Empty `slot`, shifting back the entries of its probe run that would no longer be found */
+static void index_remove(manifest_t *manifest, size_t slot) {
+    size_t mask = manifest->index_size - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; manifest->index[next] != 0; next = (next + 1) & mask) {
+        size_t home = index_home(manifest, manifest->entries[manifest->index[next] - 1].path);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            manifest->index[hole] = manifest->index[next];
+            hole = next;
+        }
+    }
+    manifest->index[hole] = 0;
+}
+
+manifest_entry_t *manifest_find(manifest_t *manifest, const char *path) {
+    if (manifest->count == 0)
+        return NULL;
+    uint32_t position = manifest->index[index_slot(manifest, path)];
+    return position != 0 ? &manifest->entries[position - 1] : NULL;
+}
+
+manifest_entry_t *manifest_find_content(manifest_t *manifest, const manifest_entry_t *after,
+                                        uint32_t size, uint32_t hash) {
+    for (size_t i = after != NULL ? (size_t)(after - manifest->entries) + 1 : 0; i < manifest->count; i++) {
+        if (manifest->entries[i].size == size && manifest->entries[i].hash == hash)
+            return &manifest->entries[i];
+    }
+    return NULL;
+}
+
+static manifest_entry_t *entry_put(manifest_t *manifest, const char *path, uint32_t size, uint32_t hash) {
+    manifest_entry_t *entry = manifest_find(manifest, path);
+    if (entry == NULL) {
+        if (manifest->count == manifest->capacity) {
+            size_t capacity = manifest->capacity ? manifest->capacity * 2 : 16;
+            manifest_entry_t *entries = realloc(manifest->entries, capacity * sizeof(manifest_entry_t));
+            if (entries == NULL)
+                return NULL;
+            manifest->entries = entries;
+            manifest->capacity = capacity;
+        }
+        if ((manifest->count + 1) * 2 > manifest->index_size && !grow_index(manifest))
+            return NULL;
+        char *copy = strdup(path);
+        if (copy == NULL)
+            return NULL;
+        manifest->index[index_slot(manifest, path)] = (uint32_t)manifest->count + 1;
+        entry = &manifest->entries[manifest->count++];
+        entry->path = copy;
+        entry->flags = MANIFEST_DIRTY;
+    } else if (entry->size != size || entry->hash != hash) {
+        entry->flags |= MANIFEST_DIRTY;
+    }
+    entry->size = size;
+    entry->hash = hash;
+    return entry;
+}
+
+static void entry_delete(manifest_t *manifest, size_t index, bool record) {
+    manifest_entry_t *entry = &manifest->entries[index];
+    char *path = entry->path;
+    index_remove(manifest, index_slot(manifest, path));
+    size_t last = manifest->count - 1;
+    if (index != last)  // The last entry takes the place of the removed one
+        manifest->index[index_slot(manifest, manifest->entries[last].path)] = (uint32_t)index + 1;
+    *entry = manifest->entries[last];
+    manifest->count = last;
+    if (record) {
+        char **removed = realloc(manifest->removed, (manifest->removed_count + 1) * sizeof(char *));
+        if (removed != NULL) {
+            manifest->removed = removed;
+            manifest->removed[manifest->removed_count++] = path;
+            return;
+        }
+        manifest->compact = true;  // The deletion can no longer be journaled
+    }
+    free(path);
+}
+
+bool manifest_update(manifest_t *manifest, const char *path, uint32_t size, uint32_t hash) {
+    manifest_entry_t *entry = entry_put(manifest, path, size, hash);
+    if (entry == NULL)
+        return false;
+    entry->flags |= MANIFEST_SEEN;
+    return true;
+}
+
+void manifest_remove(manifest_t *manifest, const char *path) {
+    manifest_entry_t *entry = manifest_find(manifest, path);
+    if (entry != NULL)
+        entry_delete(manifest, (size_t)(entry - manifest->entries), true);
+}
+
+void manifest_prune(manifest_t *manifest) {
+    for (size_t i = manifest->count; i > 0; i--) {
+        manifest_entry_t *entry = &manifest->entries[i - 1];
+        if (entry->flags & MANIFEST_SEEN)
+            entry->flags &= ~MANIFEST_SEEN;
+        else
+            entry_delete(manifest, i - 1, true);
+    }
+}
+
+static void clear_changes(manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->count; i++)
+        manifest->entries[i].flags &= ~MANIFEST_DIRTY;
+    for (size_t i = 0; i < manifest->removed_count; i++)
+        free(manifest->removed[i]);
+    free(manifest->removed);
+    manifest->removed = NULL;
+    manifest->removed_count = 0;
+}
+
+void manifest_free(manifest_t *manifest) {
+    clear_changes(manifest);
+    for (size_t i = 0; i < manifest->count; i++)
+        free(manifest->entries[i].path);
+    free(manifest->entries);
+    free(manifest->index);
+    memset(manifest, 0, sizeof(manifest_t));
+}
+
+size_t manifest_memory(const manifest_t *manifest) {
+    size_t bytes = manifest->capacity * sizeof(manifest_entry_t) + manifest->index_size * sizeof(uint32_t) +
+                   manifest->removed_count * sizeof(char *);
+    for (size_t i = 0; i < manifest->count; i++)
+        bytes += strlen(manifest->entries[i].path) + 1;
+    return bytes;
+}
+
+bool manifest_load(manifest_t *manifest, const char *path) {
+    manifest_free(manifest);
+    manifest->compact = true;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return errno == ENOENT;
+
+    manifest_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, manifest_magic, sizeof(header.magic)) != 0 ||
+        header.version != MANIFEST_VERSION) {
+        fclose(fp);
+        return false;
+    }
+
+    static char name[PATH_MAX + 1];  // Off the 2 KB stack of core 0, which loads after an image import
+    manifest_record_t record;
+    bool ok = true;
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        if (record.path_length > PATH_MAX ||
+            fread(name, 1, record.path_length, fp) != record.path_length) {
+            ok = false;
+            break;
+        }
+        name[record.path_length] = '\0';
+        if (record.type == RECORD_PUT) {
+            if (entry_put(manifest, name, record.size, record.hash) == NULL) {
+                ok = false;
+                break;
+            }
+        } else if (record.type == RECORD_DELETE) {
+            manifest_entry_t *entry = manifest_find(manifest, name);
+            if (entry != NULL)
+                entry_delete(manifest, (size_t)(entry - manifest->entries), false);
+        } else {
+            ok = false;
+            break;
+        }
+        manifest->journal_records++;
+    }
+    fclose(fp);
+
+    clear_changes(manifest);
+    manifest->compact = !ok;  // A torn tail is dropped by rewriting the journal
+    return ok;
+}
+
+static bool write_record(FILE *fp, uint8_t type, const char *path, uint32_t size, uint32_t hash) {
+    manifest_record_t record = {
+        .type = type,
+        .path_length = (uint16_t)strlen(path),
+        .size = size,
+        .hash = hash,
+    };
+    return fwrite(&record, sizeof(record), 1, fp) == 1 &&
+           fwrite(path, 1, record.path_length, fp) == record.path_length;
+}
+
+bool manifest_save(manifest_t *manifest, const char *path) {
+    size_t changes = manifest->removed_count;
+    for (size_t i = 0; i < manifest->count; i++) {
+        if (manifest->entries[i].flags & MANIFEST_DIRTY)
+            changes++;
+    }
+    if (changes == 0 && !manifest->compact)
+        return true;
+
+    bool rewrite = manifest->compact || manifest->journal_records == 0 ||
+                   manifest->journal_records + changes > manifest->count * 2 + 32;
+    FILE *fp = fopen(path, rewrite ? "wb" : "ab");
+    if (fp == NULL)
+        return false;
+
+    bool ok = true;
+    if (rewrite) {
+        manifest_header_t header = {.version = MANIFEST_VERSION};
+        memcpy(header.magic, manifest_magic, sizeof(header.magic));
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        for (size_t i = 0; ok && i < manifest->count; i++) {
+            manifest_entry_t *entry = &manifest->entries[i];
+            ok = write_record(fp, RECORD_PUT, entry->path, entry->size, entry->hash);
+        }
+        manifest->journal_records = manifest->count;
+    } else {
+        for (size_t i = 0; ok && i < manifest->removed_count; i++)
+            ok = write_record(fp, RECORD_DELETE, manifest->removed[i], 0, 0);
+        for (size_t i = 0; ok && i < manifest->count; i++) {
+            manifest_entry_t *entry = &manifest->entries[i];
+            if (entry->flags & MANIFEST_DIRTY)
+                ok = write_record(fp, RECORD_PUT, entry->path, entry->size, entry->hash);
+        }
+        manifest->journal_records += changes;
+    }
+    if (fclose(fp) != 0)
+        ok = false;
+
+    clear_changes(manifest);
+    manifest->compact = !ok;
+    return ok;
+}
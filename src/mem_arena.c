@@ -0,0 +1,112 @@
+/* Static memory arena and the memory budget report
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdint.h>
+#include <string.h>
+#if PICO_ON_DEVICE
+#include <malloc.h>
+#endif
+#include "mem_arena.h"
+
+#define ALIGNMENT  8
+
+#if PICO_ON_DEVICE
+extern char __StackLimit, __bss_end__;  // from the pico-sdk linker script
+#endif
+
+static uint8_t arena[MEM_ARENA_SIZE] __attribute__((aligned(ALIGNMENT)));
+static size_t arena_used;
+static size_t arena_failed;  // Bytes asked for once the arena was full
+static size_t arena_bytes[MEM_TAG_COUNT];
+static size_t heap_bytes[MEM_TAG_COUNT];
+
+static const char *tag_names[MEM_TAG_COUNT] = {
+    "filesystem", "ram_disk", "snapshot", "flash_cache", "sync", "image",
+};
+
+
+void *mem_arena_alloc_aligned(mem_tag_t tag, size_t size, size_t alignment) {
+    uintptr_t base = (uintptr_t)arena;
+    size_t start = (size_t)((base + arena_used + alignment - 1) / alignment * alignment - base);
+    if (start > sizeof(arena) || size > sizeof(arena) - start) {
+        arena_failed += size;
+        return NULL;
+    }
+    arena_bytes[tag] += start + size - arena_used;
+    arena_used = start + size;
+    memset(arena + start, 0, size);
+    return arena + start;
+}
+
+void *mem_arena_alloc(mem_tag_t tag, size_t size) {
+    return mem_arena_alloc_aligned(tag, size, ALIGNMENT);
+}
+
+#if PICO_ON_DEVICE
+static size_t heap_size(void) {
+    return (size_t)(&__StackLimit - &__bss_end__);
+}
+#endif
+
+size_t mem_heap_used(void) {
+#if PICO_ON_DEVICE
+    return (size_t)mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+void mem_heap_charge(mem_tag_t tag, size_t since) {
+    size_t used = mem_heap_used();
+    if (used > since)
+        heap_bytes[tag] += used - since;
+}
+
+void mem_heap_set(mem_tag_t tag, size_t bytes) {
+    heap_bytes[tag] = bytes;
+}
+
+size_t mem_heap_available(size_t reserve) {
+#if PICO_ON_DEVICE
+    size_t used = mem_heap_used() + reserve;
+    return heap_size() > used ? heap_size() - used : 0;
+#else
+    (void)reserve;
+    return SIZE_MAX;  // Bounded by the caller off the device
+#endif
+}
+
+void mem_report(FILE *stream) {
+    fprintf(stream, "memory arena  # %lu of %lu bytes", (unsigned long)arena_used, (unsigned long)sizeof(arena));
+    if (arena_failed > 0)
+        fprintf(stream, ", %lu more asked for, raise MEM_ARENA_SIZE", (unsigned long)arena_failed);
+    fprintf(stream, "\n");
+    for (size_t i = 0; i < MEM_TAG_COUNT; i++) {
+        if (arena_bytes[i] > 0)
+            fprintf(stream, "  %-12s %8lu\n", tag_names[i], (unsigned long)arena_bytes[i]);
+    }
+
+#if PICO_ON_DEVICE
+    // newlib never returns memory to sbrk, so the heap it claimed is the high-water mark
+    struct mallinfo info = mallinfo();
+    size_t used = (size_t)info.uordblks;
+    size_t high_water = (size_t)info.arena;
+    fprintf(stream, "memory heap  # %lu of %lu bytes in use, high water %lu\n", (unsigned long)used,
+            (unsigned long)heap_size(), (unsigned long)high_water);
+    size_t booked = 0;
+    for (size_t i = 0; i < MEM_TAG_COUNT; i++) {
+        booked += heap_bytes[i];
+        if (heap_bytes[i] > 0)
+            fprintf(stream, "  %-12s %8lu\n", tag_names[i], (unsigned long)heap_bytes[i]);
+    }
+    fprintf(stream, "  %-12s %8lu\n", "other", (unsigned long)(used > booked ? used - booked : 0));
+
+    // What the RAM disk holds now, plus the heap nothing has touched so far
+    size_t ram_disk_max = heap_bytes[MEM_RAM_DISK] + (heap_size() > high_water ? heap_size() - high_water : 0);
+    fprintf(stream, "memory RAM disk  # %lu bytes, up to %lu\n", (unsigned long)heap_bytes[MEM_RAM_DISK],
+            (unsigned long)ram_disk_max);
+#endif
+    fflush(stream);
+}
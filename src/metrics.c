@@ -0,0 +1,123 @@
+/* Telemetry of the sync engine and of the USB MSC data path
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+#if PICO_ON_DEVICE
+#include <pico/time.h>
+#else
+#include <time.h>
+#endif
+#include "metrics.h"
+
+typedef struct {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint32_t buckets[METRICS_BUCKETS];
+} histogram_t;
+
+/* Apart from a reset, each value is written by one core only, 32 bits at a
+ * time, so a dump on the other core reads whole values without a lock.
+ */
+static uint32_t counters[METRIC_COUNTER_COUNT];
+static histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    "boot_copy_us", "export_files", "export_bytes", "import_files", "import_bytes", "deleted_files",
+    "moved_files", "verify_failures", "flash_read_bytes", "flash_programs", "flash_program_bytes",
+    "flash_erases", "flash_erase_bytes", "pre_erased_blocks", "usb_read_bytes", "usb_write_bytes",
+    "ram_disk_high_water", "quiet_flushes", "deadline_flushes",
+};
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "sync_us", "file_copy_us", "read10_us", "write10_us", "usb_gap_us",
+};
+
+// Original operations of the tracked flash device
+static int (*flash_read)(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length);
+static int (*flash_program)(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length);
+static int (*flash_erase)(blockdevice_t *device, bd_size_t addr, bd_size_t length);
+
+
+uint64_t metrics_now_us(void) {
+#if PICO_ON_DEVICE
+    return time_us_64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+void metrics_add(metrics_counter_t counter, uint32_t value) {
+    counters[counter] += value;
+}
+
+void metrics_max(metrics_counter_t counter, uint32_t value) {
+    if (counters[counter] < value)
+        counters[counter] = value;
+}
+
+void metrics_record(metrics_histogram_t histogram, uint64_t start_us) {
+    uint64_t elapsed = metrics_now_us() - start_us;
+    uint32_t us = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    size_t bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && us >= (1u << bucket))
+        bucket++;
+
+    histogram_t *h = &histograms[histogram];
+    h->count++;
+    h->total_us += us;
+    if (h->max_us < us)
+        h->max_us = us;
+    h->buckets[bucket]++;
+}
+
+static int tracked_read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    metrics_add(METRIC_FLASH_READ_BYTES, (uint32_t)length);
+    return flash_read(device, buffer, addr, length);
+}
+
+static int tracked_program(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
+    metrics_add(METRIC_FLASH_PROGRAMS, 1);
+    metrics_add(METRIC_FLASH_PROGRAM_BYTES, (uint32_t)length);
+    return flash_program(device, buffer, addr, length);
+}
+
+static int tracked_erase(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    metrics_add(METRIC_FLASH_ERASES, 1);
+    metrics_add(METRIC_FLASH_ERASE_BYTES, (uint32_t)length);
+    return flash_erase(device, addr, length);
+}
+
+void metrics_track_flash(blockdevice_t *flash) {
+    flash_read = flash->read;
+    flash_program = flash->program;
+    flash_erase = flash->erase;
+    flash->read = tracked_read;
+    flash->program = tracked_program;
+    flash->erase = tracked_erase;
+}
+
+void metrics_dump(FILE *stream) {
+    fprintf(stream, "{\"counters\":{");
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++)
+        fprintf(stream, "%s\"%s\":%lu", i ? "," : "", counter_names[i], (unsigned long)counters[i]);
+    fprintf(stream, "},\"histograms\":{");
+    for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const histogram_t *h = &histograms[i];
+        fprintf(stream, "%s\"%s\":{\"count\":%lu,\"total\":%lu,\"max\":%lu,\"buckets\":[", i ? "," : "",
+                histogram_names[i], (unsigned long)h->count, (unsigned long)h->total_us, (unsigned long)h->max_us);
+        for (size_t b = 0; b < METRICS_BUCKETS; b++)
+            fprintf(stream, "%s%lu", b ? "," : "", (unsigned long)h->buckets[b]);
+        fprintf(stream, "]}");
+    }
+    fprintf(stream, "}}\n");
+    fflush(stream);
+}
+
+void metrics_reset(void) {
+    memset(counters, 0, sizeof(counters));
+    memset(histograms, 0, sizeof(histograms));
+}
@@ -0,0 +1,92 @@
+/* Set of paths stored in a single arena
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "manifest.h"
+#include "path_set.h"
+
+#define TABLE_MIN_SIZE  64
+#define ARENA_MIN_SIZE  1024
+
+
+static uint32_t path_hash(const char *path) {
+    return manifest_hash(MANIFEST_HASH_INIT, path, strlen(path));
+}
+
+/* Slot holding `path`, or the empty slot where it belongs */
+static size_t find_slot(const path_set_t *set, const char *path) {
+    size_t mask = set->table_size - 1;
+    size_t slot = path_hash(path) & mask;
+    while (set->table[slot] != 0 && strcmp(set->arena + set->table[slot] - 1, path) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static bool grow_table(path_set_t *set) {
+    size_t size = set->table_size ? set->table_size * 2 : TABLE_MIN_SIZE;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (table == NULL)
+        return false;
+    uint32_t *old = set->table;
+    size_t old_size = set->table_size;
+    set->table = table;
+    set->table_size = size;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i] != 0)
+            table[find_slot(set, set->arena + old[i] - 1)] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+bool path_set_add(path_set_t *set, const char *path) {
+    if ((set->count + 1) * 2 > set->table_size && !grow_table(set)) {
+        set->incomplete = true;
+        return false;
+    }
+    size_t slot = find_slot(set, path);
+    if (set->table[slot] != 0)
+        return true;
+
+    size_t length = strlen(path) + 1;
+    if (set->arena_used + length > set->arena_size) {
+        size_t size = set->arena_size ? set->arena_size : ARENA_MIN_SIZE;
+        while (set->arena_used + length > size)
+            size *= 2;
+        char *arena = realloc(set->arena, size);
+        if (arena == NULL) {
+            set->incomplete = true;
+            return false;
+        }
+        set->arena = arena;
+        set->arena_size = size;
+    }
+    memcpy(set->arena + set->arena_used, path, length);
+    set->table[slot] = (uint32_t)set->arena_used + 1;
+    set->arena_used += length;
+    set->count++;
+    return true;
+}
+
+bool path_set_contains(const path_set_t *set, const char *path) {
+    if (set->count == 0)
+        return false;
+    return set->table[find_slot(set, path)] != 0;
+}
+
+const char *path_set_next(const path_set_t *set, size_t *offset) {
+    if (*offset >= set->arena_used)
+        return NULL;
+    const char *path = set->arena + *offset;
+    *offset += strlen(path) + 1;
+    return path;
+}
+
+void path_set_free(path_set_t *set) {
+    free(set->table);
+    free(set->arena);
+    memset(set, 0, sizeof(path_set_t));
+}
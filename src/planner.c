@@ -0,0 +1,347 @@
+/* Boot time planner of the RAM disk size and of the files exported to it
+ *
+ * The FAT geometry is estimated with the defaults pico-vfs formats the RAM
+ * disk with through FatFs `f_mkfs()`: one reserved sector, a single FAT, 512
+ * root directory entries and clusters of one sector below 2 MB.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "filesystem/vfs.h"
+#include "manifest.h"
+#include "planner.h"
+#include "tree_walk.h"
+
+#define SECTOR_SIZE           512
+#define DIR_ENTRY_SIZE        32
+#define LFN_CHARS_PER_ENTRY   13
+#define ROOT_ENTRIES          512
+#define RESERVED_SECTORS      1
+#define FAT_COUNT             1
+#define FAT12_MAX_CLUSTERS    4085
+#define MKFS_MIN_SECTORS      128            // f_mkfs refuses smaller volumes
+#define DISK_SIZE_STEP        4096
+#define HOST_HEADROOM         (16 * 1024)    // Free space left on the RAM disk for the host
+#define WINDOWS_HIDDEN_DIR    "System Volume Information"
+#define ROOT_INDEX            SIZE_MAX
+
+typedef struct {
+    char *path;              // Path relative to the mount point
+    uint32_t size;
+    size_t parent;           // Index of the parent directory, ROOT_INDEX below the root
+    uint32_t entries;        // Directory entries taken in the parent
+    uint32_t used_entries;   // Directories only: entries of the selected children
+    size_t rank;             // Position in the priority file
+    bool is_dir;
+    bool selected;
+} plan_item_t;
+
+static plan_item_t *items = NULL;
+static size_t item_count = 0;
+static size_t *order = NULL;     // Item indices sorted by path
+static char **priorities = NULL;
+static size_t priority_count = 0;
+
+static uint32_t cluster_bytes;
+static uint32_t capacity_clusters;
+static uint32_t used_clusters;
+static uint32_t root_used_entries;
+
+
+static uint32_t entries_for_name(const char *name) {
+    uint32_t length = 0;
+    for (const char *p = name; *p != '\0'; p++) {
+        if ((*p & 0xC0) != 0x80)  // Count UTF-8 characters
+            length++;
+    }
+    return 1 + (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;  // LFN entries and the short name
+}
+
+static uint32_t clusters_for(uint32_t bytes) {
+    return (bytes + cluster_bytes - 1) / cluster_bytes;
+}
+
+static size_t priority_rank(const char *path) {
+    for (size_t i = 0; i < priority_count; i++) {
+        size_t length = strlen(priorities[i]);
+        if (strcmp(priorities[i], "/") == 0 ||
+            (strncmp(path, priorities[i], length) == 0 && (path[length] == '\0' || path[length] == '/')))
+            return i;
+    }
+    return priority_count;
+}
+
+static void load_priorities(const char *root) {
+    // Off the 2 KB stack of core 0, which reaches this through `fs_reload()` while core 1 runs
+    static char path[PATH_MAX];
+    static char line[PATH_MAX];
+    for (size_t i = 0; i < priority_count; i++)
+        free(priorities[i]);
+    priority_count = 0;
+    snprintf(path, sizeof(path), "%s/%s", root, PLANNER_PRIORITY_FILE_NAME);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        size_t length = strlen(line);
+        while (length > 1 && line[length - 1] == '/')
+            line[--length] = '\0';
+        if (line[0] != '/')
+            continue;  // Blank lines and comments
+        char **p = realloc(priorities, (priority_count + 1) * sizeof(char *));
+        if (p == NULL)
+            break;
+        priorities = p;
+        if ((priorities[priority_count] = strdup(line)) != NULL)
+            priority_count++;
+    }
+    fclose(fp);
+}
+
+static bool append_item(const char *path, const char *name, size_t parent, bool is_dir, uint32_t size) {
+    plan_item_t *p = realloc(items, (item_count + 1) * sizeof(plan_item_t));
+    if (p == NULL)
+        return false;
+    items = p;
+    plan_item_t *item = &items[item_count];
+    memset(item, 0, sizeof(*item));
+    if ((item->path = strdup(path)) == NULL)
+        return false;
+    item->size = size;
+    item->parent = parent;
+    item->entries = entries_for_name(name);
+    item->rank = priority_rank(path);
+    item->is_dir = is_dir;
+    item->selected = true;  // Until planner_select() decides
+    item_count++;
+    return true;
+}
+
+/* Scan the tree under `root` */
+static bool scan_tree(const char *root) {
+    static tree_walk_t walker;
+    size_t parents[TREE_WALK_MAX_DEPTH];  // Item of the directory open at each depth
+    if (!tree_walk_open(&walker, root)) {
+        fprintf(stderr, "opendir %s: %s\n", root, strerror(errno));
+        return true;
+    }
+    bool result = true;
+    tree_walk_event_t event;
+    while (result && (event = tree_walk_next(&walker)) != TREE_WALK_END) {
+        const char *name = walker.name;
+        if (event == TREE_WALK_DIRECTORY_END)
+            continue;
+        if (event == TREE_WALK_DIRECTORY && (name[0] == '.' || strcmp(name, WINDOWS_HIDDEN_DIR) == 0)) {
+            tree_walk_skip(&walker);
+            continue;
+        }
+        if (event == TREE_WALK_FILE && strcmp(name, MANIFEST_FILE_NAME) == 0)
+            continue;
+
+        uint32_t size = 0;
+        struct stat finfo;
+        if (event == TREE_WALK_FILE) {
+            if (stat(walker.path, &finfo) == -1) {
+                fprintf(stderr, "stat %s: %s\n", walker.path, strerror(errno));
+                continue;
+            }
+            size = (uint32_t)finfo.st_size;
+        }
+        size_t parent = walker.depth == 0 ? ROOT_INDEX : parents[walker.depth];
+        result = append_item(walker.path + walker.root_length, name, parent, event == TREE_WALK_DIRECTORY, size);
+        if (result && event == TREE_WALK_DIRECTORY && walker.depth + 1 < TREE_WALK_MAX_DEPTH)
+            parents[walker.depth + 1] = item_count - 1;
+    }
+    tree_walk_close(&walker);
+    return result;
+}
+
+static void clear_items(void) {
+    for (size_t i = 0; i < item_count; i++)
+        free(items[i].path);
+    free(items);
+    free(order);
+    items = NULL;
+    order = NULL;
+    item_count = 0;
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp(items[*(const size_t *)a].path, items[*(const size_t *)b].path);
+}
+
+bool planner_scan(const char *root) {
+    load_priorities(root);
+    printf("plan %s  # ", root);
+    clear_items();
+    if (!scan_tree(root) ||
+        (item_count > 0 && (order = malloc(item_count * sizeof(size_t))) == NULL)) {
+        printf("out of memory\n");
+        clear_items();  // Nothing is excluded without a plan
+        return false;
+    }
+    for (size_t i = 0; i < item_count; i++)
+        order[i] = i;
+    qsort(order, item_count, sizeof(size_t), compare_path);
+    printf("%lu entries\n", (unsigned long)item_count);
+    return true;
+}
+
+/* Lay out a FAT volume of `disk_size` bytes the way f_mkfs does */
+static void layout(size_t disk_size) {
+    static const uint32_t boundaries[] = {1, 4, 16, 64, 256, 512};  // Cluster size steps in 4K sectors
+    uint32_t sectors = (uint32_t)(disk_size / SECTOR_SIZE);
+    uint32_t cluster_sectors = 1;
+    for (size_t i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]) && boundaries[i] <= sectors / 0x1000; i++)
+        cluster_sectors <<= 1;
+    cluster_bytes = cluster_sectors * SECTOR_SIZE;
+
+    uint32_t root_sectors = ROOT_ENTRIES * DIR_ENTRY_SIZE / SECTOR_SIZE;
+    uint32_t fat_sectors = 1;
+    uint32_t clusters = 0;
+    while (sectors > RESERVED_SECTORS + root_sectors + FAT_COUNT * fat_sectors) {
+        clusters = (sectors - RESERVED_SECTORS - root_sectors - FAT_COUNT * fat_sectors) / cluster_sectors;
+        uint32_t fat_bytes = clusters < FAT12_MAX_CLUSTERS ? (clusters + 2) * 3 / 2 + 1 : (clusters + 2) * 2;
+        uint32_t needed = (fat_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (needed <= fat_sectors)
+            break;
+        fat_sectors = needed;
+        clusters = 0;
+    }
+    capacity_clusters = clusters;
+}
+
+/* Clusters taken by every scanned item in the current layout */
+static uint32_t needed_clusters(void) {
+    uint32_t clusters = 0;
+    uint32_t *dir_entries = calloc(item_count + 1, sizeof(uint32_t));
+    if (dir_entries == NULL)
+        return UINT32_MAX;
+    for (size_t i = 0; i < item_count; i++) {
+        if (items[i].is_dir)
+            dir_entries[i] += 2;  // "." and ".."
+        else
+            clusters += clusters_for(items[i].size);
+        if (items[i].parent != ROOT_INDEX)
+            dir_entries[items[i].parent] += items[i].entries;
+    }
+    for (size_t i = 0; i < item_count; i++) {
+        if (items[i].is_dir)
+            clusters += clusters_for(dir_entries[i] * DIR_ENTRY_SIZE);
+    }
+    free(dir_entries);
+    return clusters;
+}
+
+size_t planner_disk_size(size_t minimum, size_t available) {
+    if (minimum < MKFS_MIN_SECTORS * SECTOR_SIZE)
+        minimum = MKFS_MIN_SECTORS * SECTOR_SIZE;
+    size_t size = minimum;
+    for (; size + DISK_SIZE_STEP <= available; size += DISK_SIZE_STEP) {
+        layout(size);
+        if (needed_clusters() + HOST_HEADROOM / cluster_bytes <= capacity_clusters)
+            break;
+    }
+    printf("RAM disk %lu bytes of %lu available\n", (unsigned long)size, (unsigned long)available);
+    return size;
+}
+
+static bool select_item(size_t index) {
+    plan_item_t *item = &items[index];
+    if (item->selected)
+        return true;
+    if (item->parent != ROOT_INDEX && !select_item(item->parent))
+        return false;
+
+    uint32_t clusters = item->is_dir ? clusters_for(2 * DIR_ENTRY_SIZE) : clusters_for(item->size);
+    if (item->parent == ROOT_INDEX) {
+        if (root_used_entries + item->entries > ROOT_ENTRIES)
+            return false;
+    } else {
+        uint32_t used = items[item->parent].used_entries;
+        clusters += clusters_for((used + item->entries) * DIR_ENTRY_SIZE) - clusters_for(used * DIR_ENTRY_SIZE);
+    }
+    if (used_clusters + clusters > capacity_clusters)
+        return false;
+
+    used_clusters += clusters;
+    if (item->parent == ROOT_INDEX)
+        root_used_entries += item->entries;
+    else
+        items[item->parent].used_entries += item->entries;
+    if (item->is_dir)
+        item->used_entries = 2;
+    item->selected = true;
+    return true;
+}
+
+/* Priority files first, then the smallest, and the path to break ties */
+static int compare_export_order(const void *a, const void *b) {
+    const plan_item_t *x = &items[*(const size_t *)a];
+    const plan_item_t *y = &items[*(const size_t *)b];
+    if (x->is_dir != y->is_dir)
+        return x->is_dir ? 1 : -1;
+    if (x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+void planner_select(size_t disk_size) {
+    if (item_count == 0)
+        return;
+    size_t *candidates = malloc(item_count * sizeof(size_t));
+    if (candidates == NULL) {
+        for (size_t i = 0; i < item_count; i++)
+            items[i].selected = true;  // Export everything, as before the planner
+        return;
+    }
+    layout(disk_size);
+    used_clusters = 0;
+    root_used_entries = 1;  // FatFs puts the volume label in the root directory
+    for (size_t i = 0; i < item_count; i++) {
+        items[i].selected = false;
+        items[i].used_entries = 0;
+        candidates[i] = i;
+    }
+    qsort(candidates, item_count, sizeof(size_t), compare_export_order);
+
+    size_t excluded = 0;
+    uint64_t excluded_bytes = 0;
+    for (size_t i = 0; i < item_count; i++) {
+        plan_item_t *item = &items[candidates[i]];
+        if (!select_item(candidates[i]) && !item->is_dir) {
+            printf("skip %s  # no space on the RAM disk\n", item->path);
+            excluded++;
+            excluded_bytes += item->size;
+        }
+    }
+    free(candidates);
+    if (excluded > 0)
+        printf("plan: %lu files, %llu bytes are not exported to the RAM disk\n",
+               (unsigned long)excluded, (unsigned long long)excluded_bytes);
+}
+
+bool planner_is_excluded(const char *path) {
+    size_t low = 0, high = item_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = strcmp(items[order[mid]].path, path);
+        if (cmp == 0)
+            return !items[order[mid]].selected;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return false;
+}
@@ -0,0 +1,131 @@
+/* Erase the free littlefs blocks ahead of time while the host is idle
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+#include <lfs.h>
+#include "blockdevice/write_cache.h"
+#include "mem_arena.h"
+#include "metrics.h"
+#include "pre_erase.h"
+
+#define LOOKAHEAD_SIZE  16
+
+static blockdevice_t *device;
+static uint8_t *free_blocks;  // Bitmap of the blocks littlefs did not use at the last scan
+static uint32_t block_count;
+static uint32_t block_capacity;  // Blocks `free_blocks` has room for
+static lfs_t *scan_lfs;          // Private littlefs instance and its buffers, taken once from the arena
+static uint8_t *scan_buffers;
+static lfs_size_t scan_cache_size;
+static uint32_t next_block;
+
+
+static int traverse_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    blockdevice_t *bd = c->context;
+    int err = bd->read(bd, buffer, (bd_size_t)block * c->block_size + off, size);
+    return err == BD_ERROR_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int traverse_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+    (void)c;
+    (void)block;
+    (void)off;
+    (void)buffer;
+    (void)size;
+    return LFS_ERR_IO;  // Read only
+}
+
+static int traverse_erase(const struct lfs_config *c, lfs_block_t block) {
+    (void)c;
+    (void)block;
+    return LFS_ERR_IO;  // Read only
+}
+
+static int traverse_sync(const struct lfs_config *c) {
+    (void)c;
+    return LFS_ERR_OK;
+}
+
+static int mark_used(void *data, lfs_block_t block) {
+    (void)data;
+    if (block < block_count)
+        free_blocks[block / 8] &= (uint8_t)~(1 << (block % 8));
+    return LFS_ERR_OK;
+}
+
+/* Mount a second, private littlefs instance just to walk the blocks in use
+ *
+ * pico-vfs does not expose its own instance. Nothing is written, and the
+ * instance is gone before the next write through pico-vfs.
+ */
+bool pre_erase_scan(blockdevice_t *bd) {
+    uint32_t count = (uint32_t)(bd->size(bd) / bd->erase_size);
+    if (free_blocks == NULL || count > block_capacity) {
+        free_blocks = mem_arena_alloc(MEM_FLASH_CACHE, (count + 7) / 8);
+        block_capacity = free_blocks != NULL ? count : 0;
+        if (free_blocks == NULL) {
+            block_count = 0;
+            return false;
+        }
+    }
+    block_count = count;
+    lfs_size_t cache_size = (lfs_size_t)bd->program_size;
+    if (scan_lfs == NULL) {
+        scan_lfs = mem_arena_alloc(MEM_FLASH_CACHE, sizeof(lfs_t));
+        scan_buffers = mem_arena_alloc(MEM_FLASH_CACHE, cache_size * 2 + LOOKAHEAD_SIZE);
+        scan_cache_size = scan_buffers != NULL ? cache_size : 0;
+    }
+    if (scan_lfs == NULL || scan_buffers == NULL || cache_size != scan_cache_size) {
+        next_block = block_count;
+        return false;
+    }
+    memset(free_blocks, 0xFF, (count + 7) / 8);
+    device = bd;
+    next_block = 0;
+
+    struct lfs_config config = {
+        .context = bd,
+        .read = traverse_read,
+        .prog = traverse_prog,
+        .erase = traverse_erase,
+        .sync = traverse_sync,
+        .read_size = bd->read_size > 0 ? (lfs_size_t)bd->read_size : 1,
+        .prog_size = (lfs_size_t)bd->program_size,
+        .block_size = (lfs_size_t)bd->erase_size,
+        .block_count = count,
+        .block_cycles = -1,
+        .cache_size = cache_size,
+        .lookahead_size = LOOKAHEAD_SIZE,
+        .read_buffer = scan_buffers,
+        .prog_buffer = scan_buffers + cache_size,
+        .lookahead_buffer = scan_buffers + cache_size * 2,
+    };
+    bool result = lfs_mount(scan_lfs, &config) == LFS_ERR_OK;
+    if (result) {
+        result = lfs_fs_traverse(scan_lfs, mark_used, NULL) >= 0;
+        lfs_unmount(scan_lfs);
+    }
+    if (!result)
+        next_block = block_count;  // A block in use might be taken for free
+    return result;
+}
+
+bool pre_erase_step(void) {
+    while (next_block < block_count && (free_blocks[next_block / 8] & (1 << (next_block % 8))) == 0)
+        next_block++;
+    if (next_block >= block_count)
+        return false;
+
+    // Through the write cache, which skips a block known to be erased and remembers the others.
+    // Only a block the cache actually erased on the flash is counted.
+    bd_size_t addr = (bd_size_t)next_block++ * device->erase_size;
+    uint32_t erases = blockdevice_write_cache_erases(device);
+    if (device->erase(device, addr, device->erase_size) != BD_ERROR_OK || device->sync(device) != BD_ERROR_OK) {
+        next_block = block_count;
+        return false;
+    }
+    metrics_add(METRIC_PRE_ERASED_BLOCKS, blockdevice_write_cache_erases(device) - erases);
+    return true;
+}
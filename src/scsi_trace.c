@@ -0,0 +1,148 @@
+/* Recorder of the SCSI commands sent by the USB host
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+#include "manifest.h"
+#include "metrics.h"
+#include "scsi_trace.h"
+
+#define DUMP_LINE_BYTES  32
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void scsi_trace_encode(uint8_t *buffer, const scsi_trace_record_t *record) {
+    buffer[0] = record->opcode;
+    buffer[1] = record->flags;
+    buffer[2] = buffer[3] = 0;
+    put_le32(buffer + 4, record->delta_us);
+    put_le32(buffer + 8, record->lba);
+    put_le32(buffer + 12, record->length);
+    put_le32(buffer + 16, record->hash);
+}
+
+void scsi_trace_decode(const uint8_t *buffer, scsi_trace_record_t *record) {
+    record->opcode = buffer[0];
+    record->flags = buffer[1];
+    record->delta_us = get_le32(buffer + 4);
+    record->lba = get_le32(buffer + 8);
+    record->length = get_le32(buffer + 12);
+    record->hash = get_le32(buffer + 16);
+}
+
+#if SCSI_TRACE_SIZE > 0
+
+/* Records are stored encoded and back to back; a record may wrap around the end */
+static uint8_t ring[SCSI_TRACE_SIZE];
+static size_t ring_head = 0;  // Where the next record goes
+static size_t ring_tail = 0;  // Oldest record
+static size_t ring_used = 0;
+static uint32_t record_count = 0;
+static uint32_t dropped_count = 0;
+static uint64_t last_record_us = 0;
+
+static void ring_put(const void *data, size_t length) {
+    size_t first = SCSI_TRACE_SIZE - ring_head < length ? SCSI_TRACE_SIZE - ring_head : length;
+    memcpy(ring + ring_head, data, first);
+    memcpy(ring, (const uint8_t *)data + first, length - first);
+    ring_head = (ring_head + length) % SCSI_TRACE_SIZE;
+    ring_used += length;
+}
+
+static void ring_get(size_t offset, uint8_t *data, size_t length) {
+    size_t first = SCSI_TRACE_SIZE - offset < length ? SCSI_TRACE_SIZE - offset : length;
+    memcpy(data, ring + offset, first);
+    memcpy(data + first, ring, length - first);
+}
+
+static void drop_oldest(void) {
+    uint8_t header[SCSI_TRACE_HEADER_SIZE];
+    scsi_trace_record_t record;
+    ring_get(ring_tail, header, sizeof(header));
+    scsi_trace_decode(header, &record);
+    size_t size = SCSI_TRACE_HEADER_SIZE + (record.flags & SCSI_TRACE_HAS_DATA ? record.length : 0);
+    ring_tail = (ring_tail + size) % SCSI_TRACE_SIZE;
+    ring_used -= size;
+    record_count--;
+    dropped_count++;
+}
+
+void scsi_trace_record(uint8_t opcode, uint32_t lba, uint32_t length, const void *data, bool keep_data) {
+    uint64_t now = metrics_now_us();
+    uint64_t delta = last_record_us ? now - last_record_us : 0;
+    last_record_us = now;
+
+    bool keep = SCSI_TRACE_DATA && keep_data && data != NULL &&
+                length <= SCSI_TRACE_SIZE - SCSI_TRACE_HEADER_SIZE;
+    scsi_trace_record_t record = {
+        .opcode = opcode,
+        .flags = keep ? SCSI_TRACE_HAS_DATA : 0,
+        .delta_us = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta,
+        .lba = lba,
+        .length = length,
+        .hash = data != NULL ? manifest_hash(MANIFEST_HASH_INIT, data, length) : 0,
+    };
+    size_t size = SCSI_TRACE_HEADER_SIZE + (keep ? length : 0);
+    while (SCSI_TRACE_SIZE - ring_used < size)
+        drop_oldest();
+
+    uint8_t header[SCSI_TRACE_HEADER_SIZE];
+    scsi_trace_encode(header, &record);
+    ring_put(header, sizeof(header));
+    if (keep)
+        ring_put(data, length);
+    record_count++;
+}
+
+void scsi_trace_dump(FILE *stream, uint32_t sector_count, uint32_t sector_size) {
+    fprintf(stream, "scsi-trace %d sectors %lu size %lu records %lu dropped %lu bytes %lu\n",
+            SCSI_TRACE_VERSION, (unsigned long)sector_count, (unsigned long)sector_size,
+            (unsigned long)record_count, (unsigned long)dropped_count, (unsigned long)ring_used);
+    uint8_t line[DUMP_LINE_BYTES];
+    for (size_t done = 0; done < ring_used; done += sizeof(line)) {
+        size_t length = ring_used - done < sizeof(line) ? ring_used - done : sizeof(line);
+        ring_get((ring_tail + done) % SCSI_TRACE_SIZE, line, length);
+        for (size_t i = 0; i < length; i++)
+            fprintf(stream, "%02x", line[i]);
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, "scsi-trace end\n");
+    fflush(stream);
+}
+
+void scsi_trace_clear(void) {
+    ring_head = ring_tail = ring_used = 0;
+    record_count = dropped_count = 0;
+    last_record_us = 0;
+}
+
+#else
+
+void scsi_trace_record(uint8_t opcode, uint32_t lba, uint32_t length, const void *data, bool keep_data) {
+    (void)opcode;
+    (void)lba;
+    (void)length;
+    (void)data;
+    (void)keep_data;
+}
+
+void scsi_trace_dump(FILE *stream, uint32_t sector_count, uint32_t sector_size) {
+    (void)sector_count;
+    (void)sector_size;
+    fprintf(stream, "scsi-trace disabled, build with -DSCSI_TRACE_SIZE\n");
+}
+
+void scsi_trace_clear(void) {
+}
+
+#endif
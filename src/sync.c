@@ -0,0 +1,683 @@
+/* Synchronisation engine between littlefs on flash and the FAT RAM disk
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include "filesystem/vfs.h"
+#include "crc32.h"
+#include "fat_decode.h"
+#include "manifest.h"
+#include "mem_arena.h"
+#include "metrics.h"
+#include "path_set.h"
+#include "planner.h"
+#include "sync.h"
+#include "tree_walk.h"
+
+#define WINDOWS_HIDDEN_DIR  "System Volume Information"
+#define MANIFEST_PATH       SYNC_FLASH_PREFIX "/" MANIFEST_FILE_NAME
+
+#ifndef SYNC_COPY_BUFFER_SIZE
+#define SYNC_COPY_BUFFER_SIZE   FLASH_SECTOR_SIZE  // Multiple of FLASH_PAGE_SIZE
+#endif
+#ifndef SYNC_VERBOSE
+#define SYNC_VERBOSE    1  // Log every file copied, created and deleted
+#endif
+
+#ifndef SYNC_VERIFY
+#define SYNC_VERIFY     0  // Read every file written to littlefs back and check its CRC-32
+#endif
+#define SYNC_VERIFY_RETRIES  2  // Full rewrites of a file that fails the check
+
+#if SYNC_VERBOSE
+#define verbose_printf(...)  printf(__VA_ARGS__)
+#else
+#define verbose_printf(...)  ((void)0)
+#endif
+
+extern blockdevice_t *blockdevice_heap;  // from fs_init.c
+
+typedef void (*file_sync_func_t)(const char *dist, const char *src);
+
+typedef struct {
+    uint32_t size;
+    uint32_t hash;         // Of the manifest
+    uint32_t prefix_hash;  // Of the bytes the manifest entry covers, to tell an append
+    uint32_t crc;          // CRC-32 the copy is verified against
+} file_digest_t;
+
+typedef struct {
+    char *path;
+    fat_touched_t state;
+} touched_entry_t;
+
+typedef struct {
+    touched_entry_t *entries;
+    size_t count;
+    bool force;
+    bool overflow;  // A touched file could not be listed for lack of memory
+} touched_list_t;
+
+/* Buffer used for file copying, taken from the memory arena on the first sync.
+ * Aligned to the flash page so that littlefs can program whole pages from it.
+ */
+static uint8_t *copy_buffer;
+static uint8_t *pending_sectors;  // Sectors of the files still being written, for `sync_touched_to_flash()`
+static size_t pending_size;
+static manifest_t manifest;
+static tree_walk_t walker;           // Shared by the passes, which never run nested
+static char walk_dist_path[PATH_MAX + 8];  // Counterpart of `walker.path`
+// Off the 2 KB stack of core 0, like the walker
+static char move_from_path[PATH_MAX + 8];  // Candidate of `file_move()` on littlefs
+static char move_ram_path[PATH_MAX + 8];   // and on the RAM disk
+static char touched_src_path[PATH_MAX + 8];   // Entry of `sync_touched_to_flash()` on the RAM disk
+static char touched_dist_path[PATH_MAX + 8];  // and on littlefs
+
+
+static void create_directory(const char *path) {
+    verbose_printf("mkdir %s  # ", path);
+    int err = mkdir(path, 0777);
+    if (err == -1 && errno != EEXIST) {
+        fprintf(stderr, "%s", strerror(errno));
+        return;
+    }
+    verbose_printf("ok\n");
+}
+
+/* Path relative to the mount point, used as the manifest key */
+static const char *relative_path(const char *path) {
+    const char *p = strchr(path + 1, '/');
+    return p != NULL ? p : "/";
+}
+
+/* read() that only returns short at the end of the file, so that every write
+ * but the last stays a multiple of the flash page
+ */
+static ssize_t read_full(int fd, uint8_t *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, buffer + total, size - total);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += (size_t)n;
+    }
+    return (ssize_t)total;
+}
+
+static bool file_copy(const char *dist, const char *src, uint32_t *size, uint32_t *hash) {
+    verbose_printf("cp %s %s  # ", src, dist);
+
+    int in = open(src, O_RDONLY);
+    if (in == -1) {
+        printf("open: %s", strerror(errno));
+        return false;
+    }
+    int out = open(dist, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out == -1) {
+        printf("open: %s", strerror(errno));
+        close(in);
+        return false;
+    }
+
+    bool result = true;
+    *size = 0;
+    *hash = MANIFEST_HASH_INIT;
+    while (1) {
+        ssize_t read_size = read_full(in, copy_buffer, SYNC_COPY_BUFFER_SIZE);
+        if (read_size == 0)
+            break;
+        if (read_size < 0) {
+            fprintf(stderr, "read: %s", strerror(errno));
+            result = false;
+            break;
+        }
+        if (write(out, copy_buffer, (size_t)read_size) != read_size) {
+            fprintf(stderr, "write: %s", strerror(errno));
+            result = false;
+            break;
+        }
+        *size += (uint32_t)read_size;
+        *hash = manifest_hash(*hash, copy_buffer, (size_t)read_size);
+    }
+    if (close(out) != 0)
+        result = false;
+    close(in);
+
+    if (result)
+        verbose_printf("ok\n");
+    return result;
+}
+
+/* Digest of `path` taken in one pass, with the hash of its first `prefix_size` bytes */
+static bool file_hash(const char *path, uint32_t prefix_size, file_digest_t *digest) {
+    int in = open(path, O_RDONLY);
+    if (in == -1) {
+        fprintf(stderr, "open %s: %s", path, strerror(errno));
+        return false;
+    }
+    digest->size = 0;
+    digest->hash = MANIFEST_HASH_INIT;
+    digest->prefix_hash = MANIFEST_HASH_INIT;
+    digest->crc = CRC32_INIT;
+    ssize_t read_size;
+    while ((read_size = read_full(in, copy_buffer, SYNC_COPY_BUFFER_SIZE)) > 0) {
+        if (digest->size < prefix_size) {
+            size_t length = prefix_size - digest->size < (size_t)read_size ? prefix_size - digest->size : (size_t)read_size;
+            digest->prefix_hash = manifest_hash(digest->hash, copy_buffer, length);
+        }
+        digest->size += (uint32_t)read_size;
+        digest->hash = manifest_hash(digest->hash, copy_buffer, (size_t)read_size);
+#if SYNC_VERIFY
+        digest->crc = crc32_update(digest->crc, copy_buffer, (size_t)read_size);
+#endif
+    }
+    close(in);
+    return read_size == 0;
+}
+
+#if SYNC_VERIFY
+/* Whether `path` reads back with the size and CRC-32 of the source */
+static bool file_verify(const char *path, const file_digest_t *digest) {
+    int in = open(path, O_RDONLY);
+    if (in == -1)
+        return false;
+    uint32_t size = 0;
+    uint32_t crc = CRC32_INIT;
+    ssize_t read_size;
+    while ((read_size = read_full(in, copy_buffer, SYNC_COPY_BUFFER_SIZE)) > 0) {
+        size += (uint32_t)read_size;
+        crc = crc32_update(crc, copy_buffer, (size_t)read_size);
+    }
+    close(in);
+    return read_size == 0 && size == digest->size && crc == digest->crc;
+}
+#endif
+
+/* Rewrite `dist` with the contents of `src`, starting at the first byte that differs
+ *
+ * Both files are streamed side by side through the two halves of `copy_buffer`,
+ * so a destination with identical contents is not written at all, and littlefs
+ * keeps the blocks before the first change. A destination longer than the
+ * source is truncated afterwards.
+ */
+static bool file_update(const char *dist, const char *src, uint32_t *size, uint32_t *hash) {
+    const size_t chunk = SYNC_COPY_BUFFER_SIZE / 2;
+    uint8_t *ours = copy_buffer;
+    uint8_t *theirs = copy_buffer + chunk;
+
+    int in = open(src, O_RDONLY);
+    if (in == -1) {
+        printf("open: %s", strerror(errno));
+        return false;
+    }
+    int out = open(dist, O_RDWR);
+    off_t dist_length = out != -1 ? lseek(out, 0, SEEK_END) : -1;
+    if (dist_length < 0 || lseek(in, 0, SEEK_SET) != 0 || lseek(out, 0, SEEK_SET) != 0) {
+        if (out != -1)
+            close(out);
+        close(in);
+        return file_copy(dist, src, size, hash);  // New
+    }
+
+    *size = 0;
+    *hash = MANIFEST_HASH_INIT;
+    ssize_t read_size, dist_size;
+    size_t same;
+    while (1) {
+        read_size = read_full(in, ours, chunk);
+        dist_size = read_full(out, theirs, chunk);
+        if (read_size < 0 || dist_size < 0)
+            break;
+        for (same = 0; same < (size_t)read_size && same < (size_t)dist_size; same++) {
+            if (ours[same] != theirs[same])
+                break;
+        }
+        if (same < (size_t)read_size)
+            break;
+        if (read_size == 0) {  // Identical up to the end of the source
+            bool result = true;
+            if (dist_length > (off_t)*size) {
+                verbose_printf("truncate %s %lu  # ", dist, (unsigned long)*size);
+                if (ftruncate(out, (off_t)*size) != 0) {
+                    fprintf(stderr, "%s", strerror(errno));
+                    result = false;
+                } else {
+                    verbose_printf("ok\n");
+                }
+            }
+            if (close(out) != 0)
+                result = false;
+            close(in);
+            return result;
+        }
+        *size += (uint32_t)read_size;
+        *hash = manifest_hash(*hash, ours, (size_t)read_size);
+    }
+    if (read_size < 0 || dist_size < 0) {
+        close(out);
+        close(in);
+        return file_copy(dist, src, size, hash);
+    }
+
+    verbose_printf("cp %s %s  # from %lu ", src, dist, (unsigned long)(*size + same));
+    bool result = lseek(out, (off_t)(*size + same), SEEK_SET) == (off_t)(*size + same);
+    while (result && read_size > 0) {
+        size_t length = (size_t)read_size - same;
+        if (write(out, ours + same, length) != (ssize_t)length) {
+            fprintf(stderr, "write: %s", strerror(errno));
+            result = false;
+            break;
+        }
+        *size += (uint32_t)read_size;
+        *hash = manifest_hash(*hash, ours, (size_t)read_size);
+        same = 0;
+        read_size = read_full(in, ours, chunk);
+    }
+    if (read_size < 0)
+        result = false;
+    if (result && dist_length > (off_t)*size && ftruncate(out, (off_t)*size) != 0) {
+        fprintf(stderr, "ftruncate: %s", strerror(errno));
+        result = false;
+    }
+    if (close(out) != 0)
+        result = false;
+    close(in);
+
+    if (result)
+        verbose_printf("ok\n");
+    return result;
+}
+
+/* Write only the bytes of `src` past the `offset` bytes `dist` already holds
+ *
+ * The manifest hash of `dist` matched the first `offset` bytes of `src`, so
+ * the host only extended the file. The first write ends on a multiple of the
+ * copy buffer, so that the following ones stay aligned in the file.
+ */
+static bool file_append(const char *dist, const char *src, uint32_t offset) {
+    int in = open(src, O_RDONLY);
+    if (in == -1) {
+        printf("open: %s", strerror(errno));
+        return false;
+    }
+    int out = open(dist, O_WRONLY | O_APPEND);
+    if (out == -1 || lseek(out, 0, SEEK_END) != (off_t)offset || lseek(in, (off_t)offset, SEEK_SET) != (off_t)offset) {
+        if (out != -1)
+            close(out);
+        close(in);
+        return false;  // Not the file the manifest knows
+    }
+
+    verbose_printf("cp %s %s  # from %lu ", src, dist, (unsigned long)offset);
+    bool result = true;
+    size_t length = SYNC_COPY_BUFFER_SIZE - offset % SYNC_COPY_BUFFER_SIZE;
+    ssize_t read_size;
+    while ((read_size = read_full(in, copy_buffer, length)) > 0) {
+        if (write(out, copy_buffer, (size_t)read_size) != read_size) {
+            fprintf(stderr, "write: %s", strerror(errno));
+            result = false;
+            break;
+        }
+        length = SYNC_COPY_BUFFER_SIZE;
+    }
+    if (read_size < 0)
+        result = false;
+    if (close(out) != 0)
+        result = false;
+    close(in);
+
+    if (result)
+        verbose_printf("ok\n");
+    return result;
+}
+
+/* Whether `path` is a littlefs entry the planner left out of the RAM disk */
+static bool is_excluded(const char *path) {
+    return strncmp(path, SYNC_FLASH_PREFIX "/", strlen(SYNC_FLASH_PREFIX "/")) == 0 &&
+           planner_is_excluded(relative_path(path));
+}
+
+/* Whether two files hold the same bytes, streamed through the two halves of `copy_buffer` */
+static bool file_equal(const char *a, const char *b) {
+    const size_t chunk = SYNC_COPY_BUFFER_SIZE / 2;
+    int fa = open(a, O_RDONLY);
+    int fb = open(b, O_RDONLY);
+    bool equal = fa != -1 && fb != -1;
+    while (equal) {
+        ssize_t na = read_full(fa, copy_buffer, chunk);
+        ssize_t nb = read_full(fb, copy_buffer + chunk, chunk);
+        equal = na >= 0 && na == nb && memcmp(copy_buffer, copy_buffer + chunk, (size_t)na) == 0;
+        if (na == 0)
+            break;
+    }
+    if (fb != -1)
+        close(fb);
+    if (fa != -1)
+        close(fa);
+    return equal;
+}
+
+/* Rename the littlefs file the host moved to `dist` instead of copying `src`
+ *
+ * The candidates are the files of the manifest with the same size and hash
+ * that are gone from the RAM disk. One whose contents match `src` byte for
+ * byte is renamed, which costs littlefs a metadata commit instead of
+ * rewriting the data. The old path is then no longer found by the delete pass.
+ */
+static bool file_move(const char *dist, const char *src, uint32_t size, uint32_t hash) {
+    char *from = move_from_path;
+    struct stat finfo;
+    if (size == 0)
+        return false;  // Nothing to save
+    manifest_entry_t *entry = NULL;
+    while ((entry = manifest_find_content(&manifest, entry, size, hash)) != NULL) {
+        snprintf(from, sizeof(move_from_path), "%s%s", SYNC_FLASH_PREFIX, entry->path);
+        snprintf(move_ram_path, sizeof(move_ram_path), "%s%s", SYNC_RAM_PREFIX, entry->path);
+        if (strcmp(from, dist) == 0 || is_excluded(from) || stat(move_ram_path, &finfo) == 0 ||
+            !file_equal(from, src))
+            continue;
+
+        verbose_printf("mv %s %s  # ", from, dist);
+        if (rename(from, dist) == -1) {
+            fprintf(stderr, "%s", strerror(errno));
+            return false;
+        }
+        verbose_printf("ok\n");
+        manifest_update(&manifest, relative_path(dist), size, hash);
+        manifest_remove(&manifest, relative_path(from));
+        metrics_add(METRIC_MOVED_FILES, 1);
+        return true;
+    }
+    return false;
+}
+
+/* Copy a littlefs file to the RAM disk and record its content in the manifest */
+static void file_export(const char *dist, const char *src) {
+    uint32_t size, hash;
+    uint64_t start = metrics_now_us();
+    if (file_copy(dist, src, &size, &hash)) {
+        manifest_update(&manifest, relative_path(src), size, hash);
+        metrics_record(METRIC_FILE_COPY, start);
+        metrics_add(METRIC_EXPORT_FILES, 1);
+        metrics_add(METRIC_EXPORT_BYTES, size);
+    }
+}
+
+/* Write back a RAM disk file to littlefs only if its content has changed */
+static void file_import(const char *dist, const char *src) {
+    const char *path = relative_path(dist);
+    manifest_entry_t *entry = manifest_find(&manifest, path);
+    file_digest_t digest;
+    if (!file_hash(src, entry != NULL ? entry->size : 0, &digest))
+        return;
+    uint32_t size = digest.size;
+    uint32_t hash = digest.hash;
+    if (entry != NULL && entry->size == size && entry->hash == hash) {
+        manifest_update(&manifest, path, size, hash);
+        return;
+    }
+    if (entry == NULL && file_move(dist, src, size, hash))
+        return;
+    uint64_t start = metrics_now_us();
+    // An extended file is appended to; anything else is compared with the flash copy
+    bool result = (entry != NULL && size > entry->size && digest.prefix_hash == entry->hash &&
+                   file_append(dist, src, entry->size)) ||
+                  file_update(dist, src, &size, &hash);
+#if SYNC_VERIFY
+    // Read the copy back; a failed write or a mismatch is rewritten in full
+    for (int retry = 0; !(result && file_verify(dist, &digest)); retry++) {
+        metrics_add(METRIC_VERIFY_FAILURES, 1);
+        if (retry == SYNC_VERIFY_RETRIES) {
+            fprintf(stderr, "verify %s: failed\n", dist);
+            manifest_remove(&manifest, path);  // Written again by the next sync
+            return;
+        }
+        result = file_copy(dist, src, &size, &hash);
+    }
+#endif
+    if (result) {
+        manifest_update(&manifest, path, size, hash);
+        metrics_record(METRIC_FILE_COPY, start);
+        metrics_add(METRIC_IMPORT_FILES, 1);
+        metrics_add(METRIC_IMPORT_BYTES, size);
+    }
+}
+
+/* Sync every file under `src` to `dist`, adding the relative paths visited to `seen` if given */
+static void directory_file_copy(const char *src, const char *dist, file_sync_func_t file_sync, path_set_t *seen) {
+    if (!tree_walk_open(&walker, src)) {
+        fprintf(stderr, "opendir %s: %s", src, strerror(errno));
+        return;
+    }
+
+    tree_walk_event_t event;
+    while ((event = tree_walk_next(&walker)) != TREE_WALK_END) {
+        const char *src_path = walker.path;
+        if (event == TREE_WALK_DIRECTORY_END) {
+            continue;
+        } else if (event == TREE_WALK_DIRECTORY && (walker.name[0] == '.' ||
+                                                    strcmp(walker.name, WINDOWS_HIDDEN_DIR) == 0)) {
+            tree_walk_skip(&walker);
+            continue;
+        } else if (is_excluded(src_path)) {
+            tree_walk_skip(&walker);
+            continue;
+        }
+        snprintf(walk_dist_path, sizeof(walk_dist_path), "%s%s", dist, src_path + walker.root_length);
+        if (seen != NULL)
+            path_set_add(seen, relative_path(src_path));
+        if (event == TREE_WALK_DIRECTORY)
+            create_directory(walk_dist_path);
+        else if (strcmp(src_path, MANIFEST_PATH) != 0 && strcmp(walk_dist_path, MANIFEST_PATH) != 0)
+            file_sync(walk_dist_path, src_path);
+    }
+    tree_walk_close(&walker);
+}
+
+/* Whether the littlefs entry `src` has no counterpart `dist` on the RAM disk
+ *
+ * `present` holds the relative paths of the RAM disk, if it has been walked;
+ * otherwise `dist` is looked up.
+ */
+static bool is_deleted(const char *src, const char *dist, const path_set_t *present) {
+    if (present != NULL)
+        return !path_set_contains(present, relative_path(src));
+    struct stat finfo;
+    return stat(dist, &finfo) == -1;
+}
+
+/* Collect the entries under `src` missing from `dist`, children before their directory */
+static void directory_file_delete_scan(const char *src, const char *dist, const path_set_t *present,
+                                       path_set_t *deleted) {
+    if (!tree_walk_open(&walker, src)) {
+        fprintf(stderr, "opendir %s: %s", src, strerror(errno));
+        return;
+    }
+
+    tree_walk_event_t event;
+    while ((event = tree_walk_next(&walker)) != TREE_WALK_END) {
+        const char *src_path = walker.path;
+        if (event == TREE_WALK_DIRECTORY) {
+            // Hidden directories and those never exported are missing from the RAM disk on purpose
+            if (walker.name[0] == '.' || is_excluded(src_path))
+                tree_walk_skip(&walker);
+            continue;  // Decided after its entries
+        } else if (event == TREE_WALK_FILE && is_excluded(src_path)) {
+            continue;
+        }
+        snprintf(walk_dist_path, sizeof(walk_dist_path), "%s%s", dist, src_path + walker.root_length);
+        if (strcmp(src_path, MANIFEST_PATH) != 0 && is_deleted(src_path, walk_dist_path, present))
+            path_set_add(deleted, src_path);
+    }
+    tree_walk_close(&walker);
+}
+
+/* Remove the littlefs entries under `src` that the host deleted from `dist`
+ *
+ * The littlefs tree is walked first and the entries are unlinked afterwards,
+ * so that no directory is modified while it is being read.
+ */
+static void directory_file_delete(const char *src, const char *dist, const path_set_t *present) {
+    path_set_t deleted = {0};
+    directory_file_delete_scan(src, dist, present, &deleted);
+
+    size_t offset = 0;
+    const char *path;
+    while ((path = path_set_next(&deleted, &offset)) != NULL) {
+        verbose_printf("unlink %s  # ", path);
+        if (unlink(path) == -1) {
+            fprintf(stderr, "%s", strerror(errno));
+            continue;
+        }
+        verbose_printf("ok\n");
+        manifest_remove(&manifest, relative_path(path));
+        metrics_add(METRIC_DELETED_FILES, 1);
+    }
+    path_set_free(&deleted);
+}
+
+static void save_manifest(bool prune) {
+    if (prune)
+        manifest_prune(&manifest);
+    if (!manifest_save(&manifest, MANIFEST_PATH))
+        fprintf(stderr, "manifest save %s: %s\n", MANIFEST_PATH, strerror(errno));
+    mem_heap_set(MEM_SYNC, manifest_memory(&manifest));
+}
+
+/* Take the working buffers from the arena on the first sync, the boot copy
+ *
+ * The bitmap of pending sectors covers the RAM disk, whose size is fixed at boot.
+ */
+static bool reserve_buffers(void) {
+    if (copy_buffer == NULL)
+        copy_buffer = mem_arena_alloc_aligned(MEM_SYNC, SYNC_COPY_BUFFER_SIZE, FLASH_PAGE_SIZE);
+    if (copy_buffer == NULL) {
+        fprintf(stderr, "sync copy buffer of %lu bytes: out of memory\n", (unsigned long)SYNC_COPY_BUFFER_SIZE);
+        return false;
+    }
+    if (pending_sectors == NULL && blockdevice_heap != NULL) {
+        size_t sectors = blockdevice_heap->size(blockdevice_heap) / blockdevice_heap->erase_size;
+        pending_sectors = mem_arena_alloc(MEM_SYNC, (sectors + 7) / 8);
+        pending_size = pending_sectors != NULL ? (sectors + 7) / 8 : 0;
+    }
+    return true;
+}
+
+void sync_flash_to_ram(void) {
+    if (!reserve_buffers())
+        return;
+    // The manifest of the previous boot is refreshed with the hashes taken while
+    // copying, which cost no flash reads. Its own hashes may lag the files after a
+    // power loss during a commit; loading it only lets the save append the changes.
+    if (!manifest_load(&manifest, MANIFEST_PATH))
+        printf("manifest %s is broken, rebuilding\n", MANIFEST_PATH);
+    directory_file_copy(SYNC_FLASH_PREFIX, SYNC_RAM_PREFIX, file_export, NULL);
+    save_manifest(true);
+}
+
+void sync_ram_to_flash(void) {
+    if (!reserve_buffers())
+        return;
+    path_set_t present = {0};  // Relative paths of the RAM disk, for the delete pass
+    directory_file_copy(SYNC_RAM_PREFIX, SYNC_FLASH_PREFIX, file_import, &present);
+    directory_file_delete(SYNC_FLASH_PREFIX, SYNC_RAM_PREFIX, present.incomplete ? NULL : &present);
+    path_set_free(&present);
+    save_manifest(true);
+}
+
+static void collect_touched(const char *path, fat_touched_t state, void *context) {
+    touched_list_t *list = context;
+    if (state == FAT_TOUCHED_INCOMPLETE && !list->force)
+        return;
+    touched_entry_t *entries = realloc(list->entries, (list->count + 1) * sizeof(touched_entry_t));
+    if (entries == NULL) {
+        list->overflow = true;
+        return;
+    }
+    list->entries = entries;
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        list->overflow = true;
+        return;
+    }
+    list->entries[list->count].path = copy;
+    list->entries[list->count].state = state;
+    list->count++;
+}
+
+/* Create `path` and every missing directory above it */
+static void make_directories(char *path) {
+    for (char *p = strchr(path + strlen(SYNC_FLASH_PREFIX) + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(path, 0777);
+        *p = '/';
+    }
+    create_directory(path);
+}
+
+bool sync_touched_to_flash(blockdevice_t *device, uint8_t *dirty, bool force) {
+    fat_volume_t volume;
+    if (!reserve_buffers() || !fat_volume_open(&volume, device))
+        return false;
+    size_t bitmap_size = (volume.device_sectors + 7) / 8;
+    uint8_t *pending = pending_sectors;
+    if (pending == NULL || bitmap_size > pending_size)
+        return false;  // Committed by a full sync instead
+
+    touched_list_t list = {.force = force};
+    bool result = fat_volume_scan(&volume, dirty, pending, collect_touched, &list);
+    if (list.overflow) {
+        fprintf(stderr, "touched files: out of memory, committing every file\n");
+        result = false;  // The dirty bits of a file left out must not be cleared
+    }
+    if (result) {
+        char *src_path = touched_src_path;
+        char *dist_path = touched_dist_path;
+        // Files before directories, so that a file moved to another directory is
+        // renamed before the delete pass of its old directory unlinks it
+        for (size_t n = 0; n < list.count * 2; n++) {
+            touched_entry_t *entry = &list.entries[n % list.count];
+            if ((entry->state == FAT_TOUCHED_DIRECTORY) != (n >= list.count))
+                continue;
+            const char *path = strcmp(entry->path, "/") == 0 ? "" : entry->path;
+            snprintf(src_path, sizeof(touched_src_path), "%s%s", SYNC_RAM_PREFIX, path);
+            snprintf(dist_path, sizeof(touched_dist_path), "%s%s", SYNC_FLASH_PREFIX, path);
+            if (entry->state == FAT_TOUCHED_DIRECTORY) {
+                if (path[0] != '\0')
+                    make_directories(dist_path);
+                directory_file_delete(dist_path, src_path, NULL);
+            } else {
+                char *slash = strrchr(dist_path, '/');
+                if (slash != dist_path + strlen(SYNC_FLASH_PREFIX)) {
+                    *slash = '\0';
+                    make_directories(dist_path);
+                    *slash = '/';
+                }
+                file_import(dist_path, src_path);
+            }
+        }
+        save_manifest(false);
+        if (force)
+            memset(dirty, 0, bitmap_size);
+        else
+            memcpy(dirty, pending, bitmap_size);
+    }
+
+    for (size_t i = 0; i < list.count; i++)
+        free(list.entries[i].path);
+    free(list.entries);
+    return result;
+}
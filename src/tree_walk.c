@@ -0,0 +1,100 @@
+/* Iterative walker of a directory tree
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesystem/vfs.h"
+#include "tree_walk.h"
+
+
+bool tree_walk_open(tree_walk_t *walk, const char *root) {
+    size_t length = strlen(root);
+    if (length >= sizeof(walk->path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    DIR *dir = opendir(root);
+    if (dir == NULL)
+        return false;
+    memcpy(walk->path, root, length + 1);
+    walk->name = walk->path;
+    walk->root_length = length;
+    walk->depth = 0;
+    walk->dirs[0] = dir;
+    walk->lengths[0] = length;
+    walk->open_count = 1;
+    walk->enter = false;
+    return true;
+}
+
+/* Open the directory just returned; its end is reported at once if it cannot be */
+static bool enter_directory(tree_walk_t *walk) {
+    walk->enter = false;
+    if (walk->open_count == TREE_WALK_MAX_DEPTH) {
+        fprintf(stderr, "opendir %s: too deep\n", walk->path);
+        return false;
+    }
+    DIR *dir = opendir(walk->path);
+    if (dir == NULL) {
+        fprintf(stderr, "opendir %s: %s\n", walk->path, strerror(errno));
+        return false;
+    }
+    walk->dirs[walk->open_count] = dir;
+    walk->lengths[walk->open_count] = strlen(walk->path);
+    walk->open_count++;
+    return true;
+}
+
+tree_walk_event_t tree_walk_next(tree_walk_t *walk) {
+    if (walk->enter && !enter_directory(walk))
+        return TREE_WALK_DIRECTORY_END;
+
+    while (walk->open_count > 0) {
+        size_t level = walk->open_count - 1;
+        size_t length = walk->lengths[level];
+        walk->path[length] = '\0';
+        struct dirent *ent = readdir(walk->dirs[level]);
+        if (ent == NULL) {
+            closedir(walk->dirs[level]);
+            walk->open_count--;
+            if (walk->open_count == 0)
+                break;
+            walk->name = strrchr(walk->path, '/') + 1;  // Back to the directory itself
+            walk->depth = walk->open_count - 1;
+            return TREE_WALK_DIRECTORY_END;
+        }
+        if (ent->d_type == DT_DIR && (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0))
+            continue;
+        if (ent->d_type != DT_DIR && ent->d_type != DT_REG)
+            continue;
+        size_t name_length = strlen(ent->d_name);
+        if (length + 1 + name_length >= sizeof(walk->path)) {
+            fprintf(stderr, "%s/%s: path too long\n", walk->path, ent->d_name);
+            continue;
+        }
+        walk->path[length] = '/';
+        memcpy(walk->path + length + 1, ent->d_name, name_length + 1);
+        walk->name = walk->path + length + 1;
+        walk->depth = level;
+        if (ent->d_type == DT_REG)
+            return TREE_WALK_FILE;
+        walk->enter = true;
+        return TREE_WALK_DIRECTORY;
+    }
+    walk->path[walk->root_length] = '\0';
+    walk->name = walk->path;
+    return TREE_WALK_END;
+}
+
+void tree_walk_skip(tree_walk_t *walk) {
+    walk->enter = false;
+}
+
+void tree_walk_close(tree_walk_t *walk) {
+    while (walk->open_count > 0)
+        closedir(walk->dirs[--walk->open_count]);
+    walk->enter = false;
+}
@@ -3,34 +3,205 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <bsp/board.h>
 #include <tusb.h>
+#include "blockdevice/compressed.h"
 #include "blockdevice/heap.h"
+#include "blockdevice/snapshot.h"
+#include "blockdevice/sparse.h"
+#include "mem_arena.h"
+#include "metrics.h"
+#include "scsi_trace.h"
+#include <pico/critical_section.h>
 #include <pico/time.h>
+#include "vfat.h"
 
 
-#define USB_WRITE_ACCESS_MINIMUM_TICKS    3  // Minimum number of `usb_ticks` to be considered as being written
+#ifndef SYNC_DEBOUNCE_MS
+#define SYNC_DEBOUNCE_MS                  500   // Host idle time after the last write that ends a burst
+#endif
+#ifndef SYNC_MAX_DELAY_MS
+#define SYNC_MAX_DELAY_MS                 5000  // Longest a burst of writes waits for a commit
+#endif
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10     0x35
+#define SCSI_CMD_SYNCHRONIZE_CACHE_16     0x91
+#define SCSI_CMD_UNMAP                    0x42
+#define SCSI_CMD_SERVICE_ACTION_IN_16     0x9E
+#define SCSI_SA_READ_CAPACITY_16          0x10
+#define UNMAP_DESCRIPTOR_SIZE             16
+
+#ifndef VIRTUAL_FAT
+#define VIRTUAL_FAT  0
+#endif
+#if defined(COMPRESSED_RAM_DISK_SIZE) || defined(SPARSE_RAM_DISK_SIZE)
+#define THIN_PROVISIONED  1  // Unmapped sectors give their memory back and read as zeros
+#else
+#define THIN_PROVISIONED  0
+#endif
 
 static bool ejected = false;
+static volatile bool medium_loading = false;  // Core 0 is rebuilding the RAM disk
+static volatile bool medium_changed = false;  // Tell the host at the next TEST UNIT READY
 
 extern blockdevice_t *blockdevice_heap;  // from fs_init.c
+extern bool commit_host_writes_now(void);  // from main.c
+extern volatile bool image_transfer_active;  // from main.c
+
+/* Flush scheduler
+ *
+ * Host writes are merged into bursts timed with the hardware timer, which runs
+ * once `timer_hw->dbgpause` is cleared in main.c. A burst is committed once the
+ * host has been idle for SYNC_DEBOUNCE_MS, or SYNC_MAX_DELAY_MS after it began
+ * if the host keeps writing.
+ */
+static uint64_t burst_start_us = 0;
+static uint64_t last_write_us = 0;
+static uint32_t burst_writes = 0;     // WRITE10 and UNMAP commands in the current burst
+
+/* The host writes run on core 1 and the commits on core 0. Core 1 sets the bits
+ * of `dirty_sectors`, and core 0 moves them to `commit_sectors` before it takes
+ * a snapshot of the RAM disk, so a sector written during a commit stays dirty.
+ */
+static uint8_t *dirty_sectors = NULL;   // One bit per RAM disk sector written by the host
+static uint8_t *commit_sectors = NULL;  // Taken by core 0 and not committed yet
+static size_t dirty_sector_count = 0;
+static critical_section_t dirty_lock;
+static bool untracked_write = false;    // Written while the bitmaps could not be allocated
+static bool untracked_commit = false;
+
+static void note_host_write(void) {
+    last_write_us = time_us_64();
+    if (burst_writes == 0)
+        burst_start_us = last_write_us;
+    burst_writes++;
+}
+
+/* Whether the writes of the host are due for a commit
+ *
+ * Both kinds of flushes are counted in the metrics, to tune SYNC_DEBOUNCE_MS
+ * and SYNC_MAX_DELAY_MS against the number of commits.
+ *
+ * @param force  Set if the host went idle, cleared if it is still writing
+ *               and only the files complete so far should be committed.
+ */
+bool usb_msc_flush_due(bool *force) {
+    if (burst_writes == 0)
+        return false;
+    uint64_t now = time_us_64();
+    uint64_t idle_ms = (now - last_write_us) / 1000;
+    uint64_t burst_ms = (now - burst_start_us) / 1000;
+    if (idle_ms < SYNC_DEBOUNCE_MS && burst_ms < SYNC_MAX_DELAY_MS)
+        return false;
+
+    *force = idle_ms >= SYNC_DEBOUNCE_MS;
+    metrics_add(*force ? METRIC_QUIET_FLUSHES : METRIC_DEADLINE_FLUSHES, 1);
+    burst_writes = 0;
+    return true;
+}
+
+/* Commit point requested by the host: SYNCHRONIZE CACHE, ALLOW MEDIUM REMOVAL or eject
+ *
+ * The command completes only once the writes of the host are on littlefs, so
+ * the USB stack waits here for the commit on core 0.
+ *
+ * During an image transfer core 0 waits on the CDC port, which needs this core
+ * to run the USB stack, and no log line may enter the frames. The command then
+ * fails with NOT READY for the host to retry, and the writes stay due for the
+ * next flush.
+ */
+static bool host_commit_point(uint8_t lun, const char *command) {
+    if (VIRTUAL_FAT)
+        return true;  // Nothing is ever written
+    if (image_transfer_active || medium_loading) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x07);  // Operation in progress
+        return false;
+    }
+    printf("flush %s  # %lu writes\n", command, (unsigned long)burst_writes);
+    burst_writes = 0;
+    if (!commit_host_writes_now()) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // Write error
+        return false;
+    }
+    return true;
+}
 
-/* NOTE:
- * The counter is incremented by a call to `tud_msc_test_unit_ready_cb` as the timer
- *  does not run during RAM execution.
+/* Allocate the dirty sector bitmaps from the memory arena. Called on core 0 before the USB stack moves to core 1. */
+void usb_msc_init(void) {
+    critical_section_init(&dirty_lock);
+    dirty_sector_count = blockdevice_heap->size(blockdevice_heap) / blockdevice_heap->erase_size;
+    dirty_sectors = mem_arena_alloc(MEM_SYNC, (dirty_sector_count + 7) / 8);
+    commit_sectors = mem_arena_alloc(MEM_SYNC, (dirty_sector_count + 7) / 8);
+    if (dirty_sectors == NULL || commit_sectors == NULL)
+        commit_sectors = dirty_sectors = NULL;
+}
+
+/* Move the sectors written by the host to the bitmap of the next commit
+ *
+ * @return Bitmap of the RAM disk sectors written by the host since they were
+ *         last committed, or NULL if every file has to be compared.
  */
-static int64_t usb_ticks = 10;
-static int64_t usb_last_ticks = 0;
+uint8_t *usb_msc_take_dirty_sectors(void) {
+    critical_section_enter_blocking(&dirty_lock);
+    untracked_commit |= untracked_write;
+    untracked_write = false;
+    if (dirty_sectors != NULL) {
+        for (size_t i = 0; i < (dirty_sector_count + 7) / 8; i++) {
+            commit_sectors[i] |= dirty_sectors[i];
+            dirty_sectors[i] = 0;
+        }
+    }
+    critical_section_exit(&dirty_lock);
+    return commit_sectors;
+}
+
+bool is_usb_msc_dirty(void) {
+    if (dirty_sectors == NULL)
+        return untracked_write || untracked_commit;
+    for (size_t i = 0; i < (dirty_sector_count + 7) / 8; i++) {
+        if (dirty_sectors[i] || commit_sectors[i])
+            return true;
+    }
+    return false;
+}
+
+/* Forget the taken sectors once every file has been compared */
+void usb_msc_clear_dirty_sectors(void) {
+    untracked_commit = false;
+    if (commit_sectors != NULL)
+        memset(commit_sectors, 0, (dirty_sector_count + 7) / 8);
+}
 
-/* USB MSC Host device write status
+static void mark_dirty_sectors(uint32_t lba, uint32_t bufsize) {
+    critical_section_enter_blocking(&dirty_lock);
+    if (dirty_sectors == NULL) {
+        untracked_write = true;
+    } else {
+        uint32_t count = (bufsize + blockdevice_heap->erase_size - 1) / blockdevice_heap->erase_size;
+        for (uint32_t i = lba; i < lba + count && i < dirty_sector_count; i++)
+            dirty_sectors[i / 8] |= (uint8_t)(1 << (i % 8));
+    }
+    critical_section_exit(&dirty_lock);
+}
+
+/* Keep the host off the RAM disk while core 0 rebuilds it from a new littlefs
  *
- * @retval true  being written
- * @retval false Not written
+ * Reads and writes fail with NOT READY meanwhile, and the end is reported to
+ * the host as a medium change so that it drops its cache of the volume.
  */
-bool is_usb_write_access(void) {
-    return (usb_ticks - usb_last_ticks) < USB_WRITE_ACCESS_MINIMUM_TICKS;
+void usb_msc_set_medium_loading(bool loading) {
+    if (medium_loading && !loading)
+        medium_changed = true;
+    medium_loading = loading;
+}
+
+static bool is_medium_loading(uint8_t lun) {
+    if (medium_loading)
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);  // Becoming ready
+    return medium_loading;
 }
 
 void tud_mount_cb(void) {
@@ -54,31 +225,53 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 
 bool tud_msc_test_unit_ready_cb(uint8_t lun) {
     (void) lun;
-
-    usb_ticks++;
+    scsi_trace_record(SCSI_CMD_TEST_UNIT_READY, 0, 0, NULL, false);
 
     if (ejected) {
         tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
         return false;
     }
+    if (is_medium_loading(lun))
+        return false;
+    if (medium_changed) {
+        medium_changed = false;
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);  // Medium may have changed
+        return false;
+    }
     return true;
 }
 
 void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size) {
     (void) lun;
+#if VIRTUAL_FAT
+    *block_count = vfat_sector_count();
+    *block_size  = VFAT_SECTOR_SIZE;
+    return;
+#endif
     *block_count = blockdevice_heap->size(blockdevice_heap) /  blockdevice_heap->erase_size;
     *block_size  = blockdevice_heap->erase_size;
 }
 
+/* Print the SCSI trace with the geometry of the drive it was recorded on */
+void usb_msc_dump_trace(FILE *stream) {
+    uint32_t block_count;
+    uint16_t block_size;
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    scsi_trace_dump(stream, block_count, block_size);
+}
+
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
     (void) lun;
     (void) power_condition;
+    scsi_trace_record(SCSI_CMD_START_STOP_UNIT, (uint32_t)load_eject << 1 | start, 0, NULL, false);
 
     if ( load_eject ) {
         if (start) {
             // load disk storage
         } else {
             // unload disk storage
+            if (!host_commit_point(lun, "eject"))
+                return false;
             ejected = true;
         }
     }
@@ -87,46 +280,161 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize) {
     (void)lun;
-    (void)offset;
 
-    int err = blockdevice_heap->read(blockdevice_heap, buffer, lba * blockdevice_heap->erase_size, bufsize);
+#if VIRTUAL_FAT
+    (void)offset;  // Always 0, the buffer holds whole sectors
+    if (!vfat_read(lba, buffer, bufsize / VFAT_SECTOR_SIZE)) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);  // LBA out of range
+        return -1;
+    }
+    return (int32_t) bufsize;
+#endif
+    if (is_medium_loading(lun))
+        return -1;
+    uint64_t start = metrics_now_us();
+    bd_size_t addr = (bd_size_t)lba * blockdevice_heap->erase_size + offset;
+    int err = blockdevice_heap->read(blockdevice_heap, buffer, addr, bufsize);
     if (err != 0) {
         printf("read error=%d\n", err);
     }
+    metrics_record(METRIC_READ10, start);
+    scsi_trace_record(SCSI_CMD_READ_10, (uint32_t)(addr / blockdevice_heap->erase_size), bufsize, buffer, false);
+    metrics_add(METRIC_USB_READ_BYTES, bufsize);
     return (int32_t) bufsize;
 }
 
 bool tud_msc_is_writable_cb (uint8_t lun) {
     (void) lun;
-    usb_last_ticks = usb_ticks;
-    return true;
+    return !VIRTUAL_FAT;  // The virtual FAT volume is write protected
 }
 
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize) {
     (void)lun;
-    (void)offset;
 
-    uint32_t block_size = blockdevice_heap->erase_size;
-    int err = blockdevice_heap->erase(blockdevice_heap, lba * block_size, bufsize);
-    if (err != BD_ERROR_OK) {
-        printf("erase error=%d\n", err);
-    }
-    err = blockdevice_heap->program(blockdevice_heap, buffer, lba * block_size, bufsize);
-    if (err != BD_ERROR_OK) {
+    if (is_medium_loading(lun))
+        return -1;
+    // Every RAM disk overwrites sectors in place, so the whole transfer is programmed without an erase
+    uint64_t start = metrics_now_us();
+    bd_size_t addr = (bd_size_t)lba * blockdevice_heap->erase_size + offset;
+    int err = blockdevice_heap->program(blockdevice_heap, buffer, addr, bufsize);
+    if (err == BD_ERROR_SNAPSHOT_BUSY)
+        return 0;  // TinyUSB calls again until the commit on core 0 releases the snapshot
+    scsi_trace_record(SCSI_CMD_WRITE_10, (uint32_t)(addr / blockdevice_heap->erase_size), bufsize, buffer, true);
+    if (err == BD_ERROR_COMPRESSED_FULL || err == BD_ERROR_SPARSE_FULL) {
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x07);  // Space allocation failed
+        return -1;
+    } else if (err != BD_ERROR_OK) {
         printf("program error=%d\n", err);
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // Write error
+        return -1;
     }
+    // Only a transfer that reached the RAM disk is committed; the host repeats a failed one
+    mark_dirty_sectors(lba, bufsize);
+    metrics_record(METRIC_WRITE10, start);
+    metrics_add(METRIC_USB_WRITE_BYTES, bufsize);
+    metrics_max(METRIC_RAM_DISK_HIGH_WATER, (uint32_t)(addr + bufsize));
 
     return (int32_t)bufsize;
 }
 
+void tud_msc_write10_complete_cb(uint8_t lun) {
+    (void)lun;
+    note_host_write();
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+/* READ CAPACITY(16), which also tells the host whether UNMAP frees sectors */
+static int32_t read_capacity_16(uint8_t *response) {
+    uint32_t block_count;
+    uint16_t block_size;
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    memset(response, 0, 32);
+    put_be32(response + 4, block_count - 1);
+    put_be32(response + 8, block_size);
+    if (THIN_PROVISIONED)
+        response[14] = 0xC0;  // LBPME and LBPRZ: unmapped blocks read as zeros
+    return 32;
+}
+
+/* Release the sectors listed in the UNMAP parameter list */
+static int32_t unmap(uint8_t lun, const uint8_t *parameters, uint16_t length) {
+    if (VIRTUAL_FAT) {
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);  // Write protected
+        return -1;
+    }
+    if (length < 8)
+        return 0;
+    uint32_t block_size = blockdevice_heap->erase_size;
+    uint32_t block_count = blockdevice_heap->size(blockdevice_heap) / block_size;
+    size_t end = 8 + ((size_t)parameters[2] << 8 | parameters[3]);
+    if (end > length)
+        end = length;
+    for (size_t i = 8; i + UNMAP_DESCRIPTOR_SIZE <= end; i += UNMAP_DESCRIPTOR_SIZE) {
+        const uint8_t *descriptor = parameters + i;
+        uint32_t lba = get_be32(descriptor + 4);  // The upper 32 bits must be zero
+        uint32_t count = get_be32(descriptor + 8);
+        if (get_be32(descriptor) != 0 || lba > block_count || count > block_count - lba) {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);  // LBA out of range
+            return -1;
+        }
+        scsi_trace_record(SCSI_CMD_UNMAP, lba, count * block_size, NULL, false);
+        int err = blockdevice_heap->trim(blockdevice_heap, (bd_size_t)lba * block_size,
+                                         (bd_size_t)count * block_size);
+        if (err == BD_ERROR_SNAPSHOT_BUSY)
+            continue;  // UNMAP is only a hint; the sectors keep their data
+        if (err != BD_ERROR_OK) {
+            printf("trim error=%d\n", err);
+            continue;
+        }
+        mark_dirty_sectors(lba, count * block_size);
+        note_host_write();
+    }
+    return length;
+}
+
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize) {
     (void)lun;
 
     void const* response = NULL;
     int32_t resplen = 0;
     bool in_xfer = true;
+    uint8_t capacity[32];
 
     switch (scsi_cmd[0]) {
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+        if ((scsi_cmd[1] & 0x1F) != SCSI_SA_READ_CAPACITY_16) {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);  // Invalid field in CDB
+            resplen = -1;
+            break;
+        }
+        resplen = read_capacity_16(capacity);
+        response = capacity;
+        break;
+    case SCSI_CMD_UNMAP:
+        // Called after the parameter list has been received into `buffer`
+        in_xfer = false;
+        resplen = unmap(lun, buffer, bufsize);
+        break;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+        scsi_trace_record(scsi_cmd[0], 0, 0, NULL, false);
+        resplen = host_commit_point(lun, "sync") ? 0 : -1;
+        break;
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+        scsi_trace_record(scsi_cmd[0], scsi_cmd[4], 0, NULL, false);
+        if ((scsi_cmd[4] & 0x03) == 0)  // Allowed, so the host is about to unmount
+            resplen = host_commit_point(lun, "allow-removal") ? 0 : -1;
+        break;
     default:
         tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
         resplen = -1;
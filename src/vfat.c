@@ -0,0 +1,504 @@
+/* Virtual FAT16 volume generated on the fly from littlefs
+ *
+ * At boot the littlefs tree is walked once, breadth first, so that the
+ * children of every directory are stored next to each other in `nodes`.
+ * Clusters are then handed out in node order, which keeps every file and
+ * directory contiguous and lets the owner of a cluster be found with a binary
+ * search. Nothing else is stored: the FAT and the directory sectors are
+ * computed from `nodes` when the host reads them.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "filesystem/vfs.h"
+#include "vfat.h"
+
+#define DIR_ENTRY_SIZE          32
+#define DIR_ENTRIES_PER_SECTOR  (VFAT_SECTOR_SIZE / DIR_ENTRY_SIZE)
+#define LFN_CHARS_PER_ENTRY     13
+#define LFN_MAX_CHARS           255
+#define FAT16_MIN_CLUSTERS      4096    // Comfortably above the FAT12 limit of 4084
+#define FAT16_MAX_CLUSTERS      65524
+#define ROOT_MIN_ENTRIES        512
+#define FAT_COUNT               2
+#define VOLUME_LABEL            "PICO-DRIVE "
+#define VOLUME_DATE             (((2024 - 1980) << 9) | (1 << 5) | 1)  // 2024-01-01, there is no RTC
+
+#define ATTR_DIRECTORY          0x10
+#define ATTR_VOLUME_ID          0x08
+#define ATTR_LONG_NAME          0x0F
+
+typedef struct {
+    uint32_t parent;       // Index of the parent directory
+    uint32_t name;         // Offset of the UTF-8 name in `names`
+    uint32_t size;         // File size in bytes, or number of directory entries
+    uint32_t cluster;      // First cluster; also set for empty files to keep the order
+    uint32_t clusters;
+    uint32_t first_child;  // Directories only
+    uint32_t child_count;
+    uint8_t lfn_entries;
+    bool is_dir;
+} vfat_node_t;
+
+static vfat_node_t *nodes = NULL;
+static size_t node_count = 0;
+static size_t node_capacity = 0;
+static char *names = NULL;
+static size_t names_length = 0;
+static size_t names_capacity = 0;
+static char root_path[PATH_MAX] = {0};
+
+static uint32_t sectors_per_cluster;
+static uint32_t cluster_count;
+static uint32_t fat_sectors;
+static uint32_t root_entries;
+static uint32_t root_sector;
+static uint32_t data_sector;
+static uint32_t total_sectors;
+
+static FILE *data_file = NULL;   // Kept open across reads of the same file
+static uint32_t data_node = 0;
+static uint16_t lfn_buffer[LFN_MAX_CHARS + 1];
+
+
+static void put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    put16(p, (uint16_t)value);
+    put16(p + 2, (uint16_t)(value >> 16));
+}
+
+/* Convert UTF-8 to UCS-2 into `lfn_buffer`, returning the number of characters */
+static size_t utf8_to_ucs2(const char *name) {
+    const uint8_t *p = (const uint8_t *)name;
+    size_t length = 0;
+    while (*p != '\0') {
+        uint32_t c;
+        if (*p < 0x80) {
+            c = *p++;
+        } else if ((*p & 0xE0) == 0xC0 && p[1] != '\0') {
+            c = ((uint32_t)(p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if ((*p & 0xF0) == 0xE0 && p[1] != '\0' && p[2] != '\0') {
+            c = ((uint32_t)(p[0] & 0x0F) << 12) | ((uint32_t)(p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        } else {
+            c = '_';  // Outside the BMP or malformed
+            p++;
+            while ((*p & 0xC0) == 0x80)
+                p++;
+        }
+        if (length >= LFN_MAX_CHARS)
+            return length + 1;
+        lfn_buffer[length++] = (uint16_t)c;
+    }
+    return length;
+}
+
+static bool append_node(uint32_t parent, const char *name, bool is_dir, uint32_t size) {
+    size_t length = utf8_to_ucs2(name);
+    if (length > LFN_MAX_CHARS) {
+        printf("vfat: name too long, skipped: %s\n", name);
+        return true;
+    }
+    if (node_count == node_capacity) {
+        size_t capacity = node_capacity ? node_capacity * 2 : 16;
+        vfat_node_t *p = realloc(nodes, capacity * sizeof(vfat_node_t));
+        if (p == NULL)
+            return false;
+        nodes = p;
+        node_capacity = capacity;
+    }
+    size_t name_size = strlen(name) + 1;
+    if (names_length + name_size > names_capacity) {
+        size_t capacity = names_capacity ? names_capacity * 2 : 256;
+        while (capacity < names_length + name_size)
+            capacity *= 2;
+        char *p = realloc(names, capacity);
+        if (p == NULL)
+            return false;
+        names = p;
+        names_capacity = capacity;
+    }
+    memcpy(names + names_length, name, name_size);
+
+    vfat_node_t *node = &nodes[node_count++];
+    memset(node, 0, sizeof(*node));
+    node->parent = parent;
+    node->name = (uint32_t)names_length;
+    node->size = size;
+    node->is_dir = is_dir;
+    node->lfn_entries = (uint8_t)((length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY);
+    names_length += name_size;
+    return true;
+}
+
+static size_t node_path(uint32_t index, char *path, size_t size) {
+    if (index == 0)
+        return (size_t)snprintf(path, size, "%s", root_path);
+    size_t length = node_path(nodes[index].parent, path, size);
+    if (length >= size)
+        return length;
+    return length + (size_t)snprintf(path + length, size - length, "/%s", names + nodes[index].name);
+}
+
+static bool scan_directory(uint32_t index) {
+    char path[PATH_MAX + 2];
+    size_t length = node_path(index, path, sizeof(path));
+    if (length >= sizeof(path))
+        return true;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "opendir %s: %s\n", path, strerror(errno));
+        return true;
+    }
+    nodes[index].first_child = (uint32_t)node_count;
+    bool result = true;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')  // ".", ".." and hidden entries such as the sync manifest
+            continue;
+        uint32_t size = 0;
+        if (ent->d_type == DT_REG) {
+            struct stat finfo;
+            snprintf(path + length, sizeof(path) - length, "/%s", ent->d_name);
+            int err = stat(path, &finfo);
+            path[length] = '\0';
+            if (err == -1) {
+                fprintf(stderr, "stat %s/%s: %s\n", path, ent->d_name, strerror(errno));
+                continue;
+            }
+            size = (uint32_t)finfo.st_size;
+        } else if (ent->d_type != DT_DIR) {
+            continue;
+        }
+        if (!append_node(index, ent->d_name, ent->d_type == DT_DIR, size)) {
+            result = false;
+            break;
+        }
+    }
+    closedir(dir);
+    nodes[index].child_count = (uint32_t)node_count - nodes[index].first_child;
+    return result;
+}
+
+static uint32_t directory_entry_count(uint32_t index) {
+    uint32_t count = index == 0 ? 1 : 2;  // Volume label, or "." and ".."
+    for (uint32_t i = 0; i < nodes[index].child_count; i++)
+        count += 1u + nodes[nodes[index].first_child + i].lfn_entries;
+    return count;
+}
+
+static bool layout(void) {
+    uint32_t cluster_bytes = 0;
+    uint32_t clusters = 0;
+    for (sectors_per_cluster = 1; sectors_per_cluster <= 64; sectors_per_cluster *= 2) {
+        cluster_bytes = sectors_per_cluster * VFAT_SECTOR_SIZE;
+        clusters = 0;
+        for (size_t i = 1; i < node_count; i++) {
+            uint32_t bytes = nodes[i].is_dir ? nodes[i].size * DIR_ENTRY_SIZE : nodes[i].size;
+            clusters += (bytes + cluster_bytes - 1) / cluster_bytes;
+        }
+        if (clusters <= FAT16_MAX_CLUSTERS)
+            break;
+    }
+    if (sectors_per_cluster > 64) {
+        printf("vfat: %lu clusters do not fit in FAT16\n", (unsigned long)clusters);
+        return false;
+    }
+
+    uint32_t next = 2;
+    for (size_t i = 1; i < node_count; i++) {
+        uint32_t bytes = nodes[i].is_dir ? nodes[i].size * DIR_ENTRY_SIZE : nodes[i].size;
+        nodes[i].cluster = next;
+        nodes[i].clusters = (bytes + cluster_bytes - 1) / cluster_bytes;
+        next += nodes[i].clusters;
+    }
+    nodes[0].cluster = 0;
+    nodes[0].clusters = 0;
+
+    cluster_count = clusters < FAT16_MIN_CLUSTERS ? FAT16_MIN_CLUSTERS : clusters;
+    fat_sectors = ((cluster_count + 2) * 2 + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE;
+    root_entries = (nodes[0].size + DIR_ENTRIES_PER_SECTOR - 1) & ~(uint32_t)(DIR_ENTRIES_PER_SECTOR - 1);
+    if (root_entries < ROOT_MIN_ENTRIES)
+        root_entries = ROOT_MIN_ENTRIES;
+    root_sector = 1 + FAT_COUNT * fat_sectors;
+    data_sector = root_sector + root_entries / DIR_ENTRIES_PER_SECTOR;
+    total_sectors = data_sector + cluster_count * sectors_per_cluster;
+    return true;
+}
+
+bool vfat_build(const char *root) {
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    node_count = 0;
+    names_length = 0;
+    if (!append_node(0, "", true, 0))
+        return false;
+
+    printf("vfat scan %s  # ", root);
+    for (size_t i = 0; i < node_count; i++) {  // Breadth first: children are appended behind
+        if (nodes[i].is_dir && !scan_directory((uint32_t)i)) {
+            printf("out of memory\n");
+            return false;
+        }
+    }
+    for (size_t i = 0; i < node_count; i++) {
+        if (nodes[i].is_dir)
+            nodes[i].size = directory_entry_count((uint32_t)i);
+    }
+    if (!layout())
+        return false;
+    printf("%lu entries, %lu sectors\n", (unsigned long)node_count, (unsigned long)total_sectors);
+    return true;
+}
+
+uint32_t vfat_sector_count(void) {
+    return total_sectors;
+}
+
+static void boot_sector(uint8_t *sector) {
+    static const uint8_t jump[3] = {0xEB, 0x3C, 0x90};
+    memcpy(sector, jump, sizeof(jump));
+    memcpy(sector + 3, "MSWIN4.1", 8);
+    put16(sector + 11, VFAT_SECTOR_SIZE);
+    sector[13] = (uint8_t)sectors_per_cluster;
+    put16(sector + 14, 1);                       // Reserved sectors
+    sector[16] = FAT_COUNT;
+    put16(sector + 17, (uint16_t)root_entries);
+    if (total_sectors < 0x10000)
+        put16(sector + 19, (uint16_t)total_sectors);
+    else
+        put32(sector + 32, total_sectors);
+    sector[21] = 0xF8;                           // Fixed media
+    put16(sector + 22, (uint16_t)fat_sectors);
+    put16(sector + 24, 63);                      // Sectors per track
+    put16(sector + 26, 255);                     // Heads
+    sector[36] = 0x80;                           // Drive number
+    sector[38] = 0x29;                           // Extended boot signature
+    put32(sector + 39, 0x50494344);              // Volume serial number
+    memcpy(sector + 43, VOLUME_LABEL, 11);
+    memcpy(sector + 54, "FAT16   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+/* Node owning `cluster`, or 0 for a free cluster */
+static uint32_t cluster_owner(uint32_t cluster) {
+    size_t low = 1, high = node_count;
+    while (low < high) {  // Last node whose first cluster is <= `cluster`
+        size_t mid = (low + high) / 2;
+        if (nodes[mid].cluster <= cluster)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low <= 1)
+        return 0;
+    vfat_node_t *node = &nodes[low - 1];
+    if (cluster < node->cluster + node->clusters)
+        return (uint32_t)(low - 1);
+    return 0;
+}
+
+static void fat_sector(uint32_t index, uint8_t *sector) {
+    uint32_t first = index * (VFAT_SECTOR_SIZE / 2);
+    for (uint32_t i = 0; i < VFAT_SECTOR_SIZE / 2; i++) {
+        uint32_t cluster = first + i;
+        uint16_t value = 0;
+        if (cluster == 0) {
+            value = 0xFFF8;
+        } else if (cluster == 1) {
+            value = 0xFFFF;
+        } else if (cluster < cluster_count + 2) {
+            uint32_t owner = cluster_owner(cluster);
+            if (owner != 0) {
+                vfat_node_t *node = &nodes[owner];
+                value = cluster + 1 == node->cluster + node->clusters ? 0xFFFF : (uint16_t)(cluster + 1);
+            }
+        }
+        put16(sector + i * 2, value);
+    }
+}
+
+static uint32_t first_cluster(uint32_t index) {
+    return nodes[index].clusters ? nodes[index].cluster : 0;
+}
+
+static bool is_short_name_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+/* Short name unique within the directory, derived from the child position */
+static void short_name(const char *name, uint32_t position, uint8_t sfn[11]) {
+    memset(sfn, ' ', 11);
+    const char *dot = strrchr(name, '.');
+    if (dot == name)
+        dot = NULL;
+    char suffix[12];
+    int suffix_length = snprintf(suffix, sizeof(suffix), "~%lu", (unsigned long)position + 1);
+
+    size_t length = 0;
+    for (const char *p = name; *p != '\0' && p != dot && length < (size_t)(8 - suffix_length); p++) {
+        char c = (char)(*p >= 'a' && *p <= 'z' ? *p - 'a' + 'A' : *p);
+        if (is_short_name_char(c))
+            sfn[length++] = (uint8_t)c;
+    }
+    if (length == 0)
+        sfn[length++] = '_';
+    memcpy(sfn + length, suffix, (size_t)suffix_length);
+
+    if (dot != NULL) {
+        length = 0;
+        for (const char *p = dot + 1; *p != '\0' && length < 3; p++) {
+            char c = (char)(*p >= 'a' && *p <= 'z' ? *p - 'a' + 'A' : *p);
+            if (is_short_name_char(c))
+                sfn[8 + length++] = (uint8_t)c;
+        }
+    }
+}
+
+static uint8_t short_name_checksum(const uint8_t sfn[11]) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + sfn[i]);
+    return sum;
+}
+
+static void short_entry(uint8_t *entry, const uint8_t sfn[11], uint8_t attr, uint32_t cluster, uint32_t size) {
+    memcpy(entry, sfn, 11);
+    entry[11] = attr;
+    put16(entry + 16, VOLUME_DATE);  // Created
+    put16(entry + 18, VOLUME_DATE);  // Accessed
+    put16(entry + 24, VOLUME_DATE);  // Modified
+    put16(entry + 26, (uint16_t)cluster);
+    put32(entry + 28, size);
+}
+
+/* `order` counts from 1 at the start of the name */
+static void long_entry(uint8_t *entry, size_t length, uint8_t order, bool last, uint8_t checksum) {
+    static const uint8_t offsets[LFN_CHARS_PER_ENTRY] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    entry[0] = (uint8_t)(order | (last ? 0x40 : 0));
+    entry[11] = ATTR_LONG_NAME;
+    entry[13] = checksum;
+    for (size_t i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+        size_t c = (order - 1u) * LFN_CHARS_PER_ENTRY + i;
+        uint16_t value = c < length ? lfn_buffer[c] : (c == length ? 0x0000 : 0xFFFF);
+        put16(entry + offsets[i], value);
+    }
+}
+
+/* Directory sector `index` of the directory node `dir` */
+static void directory_sector(uint32_t dir, uint32_t index, uint8_t *sector) {
+    uint32_t first = index * DIR_ENTRIES_PER_SECTOR;
+    uint32_t end = first + DIR_ENTRIES_PER_SECTOR;
+    uint32_t position = 0;  // Entry index within the directory
+    uint8_t sfn[11];
+
+    if (dir == 0) {
+        if (position >= first && position < end) {
+            memcpy(sfn, VOLUME_LABEL, 11);
+            short_entry(sector, sfn, ATTR_VOLUME_ID, 0, 0);
+        }
+        position++;
+    } else {
+        if (first == 0) {
+            memcpy(sfn, ".          ", 11);
+            short_entry(sector, sfn, ATTR_DIRECTORY, first_cluster(dir), 0);
+            memcpy(sfn, "..         ", 11);
+            short_entry(sector + DIR_ENTRY_SIZE, sfn, ATTR_DIRECTORY, first_cluster(nodes[dir].parent), 0);
+        }
+        position += 2;
+    }
+
+    for (uint32_t i = 0; i < nodes[dir].child_count && position < end; i++) {
+        uint32_t child = nodes[dir].first_child + i;
+        vfat_node_t *node = &nodes[child];
+        uint32_t span = 1u + node->lfn_entries;
+        if (position + span <= first) {
+            position += span;
+            continue;
+        }
+        const char *name = names + node->name;
+        size_t length = utf8_to_ucs2(name);
+        short_name(name, i, sfn);
+        uint8_t checksum = short_name_checksum(sfn);
+        for (uint8_t n = node->lfn_entries; n > 0; n--, position++) {  // Stored last part first
+            if (position >= first && position < end)
+                long_entry(sector + (position - first) * DIR_ENTRY_SIZE, length, n,
+                           n == node->lfn_entries, checksum);
+        }
+        if (position >= first && position < end) {
+            short_entry(sector + (position - first) * DIR_ENTRY_SIZE, sfn,
+                        node->is_dir ? ATTR_DIRECTORY : 0, first_cluster(child),
+                        node->is_dir ? 0 : node->size);
+        }
+        position++;
+    }
+}
+
+static void file_sector(uint32_t index, uint32_t offset, uint8_t *sector) {
+    if (offset >= nodes[index].size)
+        return;
+    if (data_file == NULL || data_node != index) {
+        if (data_file != NULL)
+            fclose(data_file);
+        char path[PATH_MAX + 2];
+        node_path(index, path, sizeof(path));
+        data_file = fopen(path, "rb");
+        if (data_file == NULL) {
+            fprintf(stderr, "fopen %s: %s\n", path, strerror(errno));
+            return;
+        }
+        data_node = index;
+    }
+    if (ftell(data_file) != (long)offset && fseek(data_file, (long)offset, SEEK_SET) != 0) {
+        fprintf(stderr, "fseek: %s\n", strerror(errno));
+        return;
+    }
+    if (fread(sector, 1, VFAT_SECTOR_SIZE, data_file) == 0 && ferror(data_file)) {
+        fprintf(stderr, "fread: %s\n", strerror(errno));
+        clearerr(data_file);
+    }
+}
+
+static void read_sector(uint32_t lba, uint8_t *sector) {
+    memset(sector, 0, VFAT_SECTOR_SIZE);
+    if (lba == 0) {
+        boot_sector(sector);
+    } else if (lba < root_sector) {
+        fat_sector((lba - 1) % fat_sectors, sector);
+    } else if (lba < data_sector) {
+        directory_sector(0, lba - root_sector, sector);
+    } else if (lba < total_sectors) {
+        uint32_t cluster = (lba - data_sector) / sectors_per_cluster + 2;
+        uint32_t owner = cluster_owner(cluster);
+        if (owner == 0)
+            return;
+        uint32_t index = (cluster - nodes[owner].cluster) * sectors_per_cluster +
+                         (lba - data_sector) % sectors_per_cluster;
+        if (nodes[owner].is_dir)
+            directory_sector(owner, index, sector);
+        else
+            file_sector(owner, index * VFAT_SECTOR_SIZE, sector);
+    }
+}
+
+bool vfat_read(uint32_t lba, void *buffer, uint32_t count) {
+    if (lba + count > total_sectors)
+        return false;
+    uint8_t *p = buffer;
+    for (uint32_t i = 0; i < count; i++)
+        read_sector(lba + i, p + i * VFAT_SECTOR_SIZE);
+    return true;
+}